@@ -11,7 +11,7 @@ struct dataplane_config {
 };
 
 struct dataplane {
-	struct pipeline *pipeline;
+	struct pipeline_map pipeline_map;
 	struct worker *workers;
 	uint32_t worker_count;
 };
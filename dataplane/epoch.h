@@ -0,0 +1,104 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation lets workers read shared configuration without
+ * locks. A writer publishes new data and retires the old one which may be
+ * still in use by workers. Each worker announces quiescent points where
+ * it holds no references to shared data, the announce records the epoch
+ * the worker observed. Advancing the epoch and waiting until each worker
+ * observes it guarantees no worker references data retired before.
+ *
+ * Workers not processing packets go offline so they never delay writers.
+ */
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define EPOCH_OFFLINE UINT64_MAX
+
+// Each worker writes its own cache line
+struct epoch_worker {
+	uint64_t epoch;
+} __attribute__((aligned(64)));
+
+struct epoch {
+	uint64_t current;
+	uint32_t worker_count;
+	struct epoch_worker *workers;
+};
+
+static inline int
+epoch_init(struct epoch *epoch, uint32_t worker_count)
+{
+	epoch->current = 1;
+	epoch->worker_count = worker_count;
+	epoch->workers = (struct epoch_worker *)aligned_alloc(
+		64, sizeof(struct epoch_worker) * worker_count);
+	if (epoch->workers == NULL)
+		return -1;
+
+	// Workers come online with their first quiescent point
+	for (uint32_t idx = 0; idx < worker_count; ++idx)
+		epoch->workers[idx].epoch = EPOCH_OFFLINE;
+	return 0;
+}
+
+static inline void
+epoch_free(struct epoch *epoch)
+{
+	free(epoch->workers);
+}
+
+/*
+ * The routine announces the worker holds no references to shared data.
+ * Reads of shared data preceding the announce are ordered before it.
+ *
+ * A worker coming online must publish its epoch before it reads shared
+ * data, otherwise a writer may miss it and free data the worker loads.
+ * A release store does not order later loads so the fence follows it.
+ */
+static inline void
+epoch_quiescent(struct epoch *epoch, uint32_t worker_idx)
+{
+	uint64_t *worker_epoch = &epoch->workers[worker_idx].epoch;
+	uint64_t prev = __atomic_load_n(worker_epoch, __ATOMIC_RELAXED);
+
+	__atomic_store_n(
+		worker_epoch,
+		__atomic_load_n(&epoch->current, __ATOMIC_ACQUIRE),
+		__ATOMIC_RELEASE);
+
+	if (prev == EPOCH_OFFLINE)
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void
+epoch_offline(struct epoch *epoch, uint32_t worker_idx)
+{
+	__atomic_store_n(
+		&epoch->workers[worker_idx].epoch,
+		EPOCH_OFFLINE,
+		__ATOMIC_RELEASE);
+}
+
+/*
+ * The routine waits until each online worker passes a quiescent point
+ * after the call, so data unpublished before the call may be freed. The
+ * writer only waits and workers are never stalled.
+ */
+static inline void
+epoch_synchronize(struct epoch *epoch)
+{
+	uint64_t target =
+		__atomic_add_fetch(&epoch->current, 1, __ATOMIC_SEQ_CST);
+
+	for (uint32_t idx = 0; idx < epoch->worker_count; ++idx) {
+		while (__atomic_load_n(&epoch->workers[idx].epoch,
+				       __ATOMIC_ACQUIRE) < target)
+			sched_yield();
+	}
+}
+
+#endif
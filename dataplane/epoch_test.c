@@ -0,0 +1,113 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Workers read the published data between quiescent points while the
+ * writer replaces it and frees the previous one after a grace period.
+ * Freed data is poisoned first so a worker reaching it fails the test.
+ * Workers go offline and online again to exercise the transition.
+ */
+#define TEST_WORKER_COUNT 2
+#define TEST_UPDATE_COUNT 2000
+#define TEST_MAGIC 0x5eed
+
+struct test_data {
+	uint32_t magic;
+};
+
+struct test_worker {
+	struct epoch *epoch;
+	uint32_t idx;
+	uint64_t reads;
+	bool failed;
+};
+
+static struct test_data *test_published;
+static bool test_stop;
+
+static void *
+test_worker_loop(void *arg)
+{
+	struct test_worker *worker = (struct test_worker *)arg;
+
+	while (!__atomic_load_n(&test_stop, __ATOMIC_RELAXED)) {
+		epoch_quiescent(worker->epoch, worker->idx);
+
+		struct test_data *data =
+			__atomic_load_n(&test_published, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&data->magic, __ATOMIC_RELAXED) !=
+		    TEST_MAGIC)
+			worker->failed = true;
+
+		if (++worker->reads % 64 == 0)
+			epoch_offline(worker->epoch, worker->idx);
+	}
+
+	epoch_offline(worker->epoch, worker->idx);
+	return NULL;
+}
+
+static struct test_data *
+test_data_create(void)
+{
+	struct test_data *data =
+		(struct test_data *)malloc(sizeof(struct test_data));
+	if (data != NULL)
+		data->magic = TEST_MAGIC;
+	return data;
+}
+
+int
+main(int argc, char **argv)
+{
+	(void) argc;
+	(void) argv;
+
+	struct epoch epoch;
+	if (epoch_init(&epoch, TEST_WORKER_COUNT))
+		return -1;
+
+	test_published = test_data_create();
+	if (test_published == NULL)
+		return -1;
+
+	pthread_t threads[TEST_WORKER_COUNT];
+	struct test_worker workers[TEST_WORKER_COUNT];
+	for (uint32_t idx = 0; idx < TEST_WORKER_COUNT; ++idx) {
+		workers[idx] = (struct test_worker){&epoch, idx, 0, false};
+		if (pthread_create(
+			threads + idx, NULL, test_worker_loop, workers + idx))
+			return -1;
+	}
+
+	for (uint32_t update = 0; update < TEST_UPDATE_COUNT; ++update) {
+		struct test_data *data = test_data_create();
+		if (data == NULL)
+			return -1;
+
+		struct test_data *old = test_published;
+		__atomic_store_n(&test_published, data, __ATOMIC_RELEASE);
+		epoch_synchronize(&epoch);
+
+		__atomic_store_n(&old->magic, 0, __ATOMIC_RELAXED);
+		free(old);
+	}
+
+	__atomic_store_n(&test_stop, true, __ATOMIC_RELAXED);
+
+	int res = 0;
+	for (uint32_t idx = 0; idx < TEST_WORKER_COUNT; ++idx) {
+		pthread_join(threads[idx], NULL);
+		if (workers[idx].failed) {
+			fprintf(stderr, "worker %u reached freed data\n", idx);
+			res = -1;
+		}
+	}
+
+	free(test_published);
+	epoch_free(&epoch);
+	return res;
+}
@@ -46,6 +46,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define FILTER_INVALID ((uint32_t)-1)
 
@@ -56,18 +57,46 @@ typedef uint32_t (*filter_classify)(
 	const struct filter *filter,
 	const struct packet *packet);
 
+/*
+ * Filters implemented with another matching strategy replace classifiers
+ * and lookups with the match routine.
+ */
+typedef uint32_t (*filter_match)(
+	const struct filter *filter,
+	const struct packet *packet);
+
 struct filter_lookup {
 	uint8_t first_arg;
 	uint8_t second_arg;
 	uint16_t table_idx;
 };
 
+/*
+ * Lookup table is either dense or sparse one.
+ *
+ * Dense table is an array of first_dim * second_dim values.
+ *
+ * Sparse table keeps only pairs with non-default value inside a static
+ * minimal perfect hash: a key pair is hashed into a bucket and the bucket
+ * seed selects the key slot, so each lookup costs two probes at most.
+ * Any pair absent in slot keys has the default value. Sparse tables are
+ * intended for huge tables where only a few pairs are populated.
+ */
 struct filter_table {
 	uint32_t first_dim;
 	uint32_t second_dim;
 	uint32_t *values;
+
+	uint32_t slot_count;
+	uint32_t bucket_count;
+	uint32_t default_value;
+	uint32_t *seeds;
+	uint64_t *keys;
 };
 
+#define FILTER_TABLE_BUCKET_SIZE 4
+#define FILTER_TABLE_SEED_LIMIT 65536
+
 static inline int
 filter_table_init(struct filter_table *table, uint32_t first_dim, uint32_t second_dim) {
 	// zero-initialized
@@ -77,7 +106,233 @@ filter_table_init(struct filter_table *table, uint32_t first_dim, uint32_t secon
 		return -1;
 	table->first_dim = first_dim;
 	table->second_dim = second_dim;
+
+	table->slot_count = 0;
+	table->bucket_count = 0;
+	table->default_value = 0;
+	table->seeds = NULL;
+	table->keys = NULL;
+	return 0;
+}
+
+static inline uint64_t
+filter_table_key(uint32_t first, uint32_t second)
+{
+	return ((uint64_t)second << 32) | first;
+}
+
+static inline uint64_t
+filter_table_hash(uint64_t key, uint64_t seed)
+{
+	key ^= seed * 0x9e3779b97f4a7c15;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccd;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53;
+	key ^= key >> 33;
+	return key;
+}
+
+static inline uint32_t
+filter_table_reduce(uint64_t hash, uint32_t range)
+{
+	return ((hash >> 32) * range) >> 32;
+}
+
+static inline void
+filter_table_free(struct filter_table *table)
+{
+	free(table->values);
+	free(table->seeds);
+	free(table->keys);
+}
+
+static inline uint64_t
+filter_table_size(const struct filter_table *table)
+{
+	if (table->keys == NULL)
+		return (uint64_t)table->first_dim * table->second_dim *
+		       sizeof(uint32_t);
+	return (uint64_t)table->slot_count *
+		       (sizeof(uint64_t) + sizeof(uint32_t)) +
+	       (uint64_t)table->bucket_count * sizeof(uint32_t);
+}
+
+/*
+ * The routine tries to place all keys of a bucket into free slots and
+ * returns the seed found or -1 if there is no one.
+ */
+static inline int64_t
+filter_table_place_bucket(
+	struct filter_table *table,
+	const uint64_t *keys,
+	uint32_t count,
+	uint8_t *used,
+	uint32_t *slots)
+{
+	for (uint32_t seed = 0; seed < FILTER_TABLE_SEED_LIMIT; ++seed) {
+		uint32_t idx;
+		for (idx = 0; idx < count; ++idx) {
+			slots[idx] = filter_table_reduce(
+				filter_table_hash(keys[idx], seed + 1),
+				table->slot_count);
+			if (used[slots[idx]])
+				break;
+			used[slots[idx]] = 1;
+		}
+
+		if (idx == count)
+			return seed;
+
+		while (idx-- > 0)
+			used[slots[idx]] = 0;
+	}
+	return -1;
+}
+
+/*
+ * Builds sparse table from `count` unique key pairs and values. Slot count
+ * starts equal to the key count and grows a bit each time some bucket
+ * could not be placed.
+ */
+static inline int
+filter_table_init_sparse(
+	struct filter_table *table,
+	uint32_t first_dim,
+	uint32_t second_dim,
+	const uint64_t *keys,
+	const uint32_t *values,
+	uint32_t count,
+	uint32_t default_value)
+{
+	table->first_dim = first_dim;
+	table->second_dim = second_dim;
+	table->default_value = default_value;
+	table->bucket_count = count / FILTER_TABLE_BUCKET_SIZE + 1;
+	table->slot_count = count ? count : 1;
+
+	table->seeds = (uint32_t *)
+		calloc(table->bucket_count, sizeof(uint32_t));
+	table->keys = NULL;
+	table->values = NULL;
+
+	// Keys and values ordered by bucket with bucket start index
+	uint32_t *bucket_from = (uint32_t *)
+		calloc(table->bucket_count + 1, sizeof(uint32_t));
+	uint64_t *bucket_keys = (uint64_t *)
+		malloc(sizeof(uint64_t) * (count + 1));
+	uint32_t *bucket_values = (uint32_t *)
+		malloc(sizeof(uint32_t) * (count + 1));
+	uint32_t *order = (uint32_t *)
+		malloc(sizeof(uint32_t) * table->bucket_count);
+	uint32_t *slots = (uint32_t *)malloc(sizeof(uint32_t) * (count + 1));
+	uint8_t *used = NULL;
+
+	if (table->seeds == NULL || bucket_from == NULL ||
+	    bucket_keys == NULL || bucket_values == NULL ||
+	    order == NULL || slots == NULL)
+		goto error;
+
+	// Counting sort of keys by bucket
+	for (uint32_t idx = 0; idx < count; ++idx) {
+		uint32_t bucket = filter_table_reduce(
+			filter_table_hash(keys[idx], 0), table->bucket_count);
+		bucket_from[bucket + 1]++;
+	}
+	uint32_t max_size = 0;
+	for (uint32_t bucket = 0; bucket < table->bucket_count; ++bucket) {
+		if (bucket_from[bucket + 1] > max_size)
+			max_size = bucket_from[bucket + 1];
+		bucket_from[bucket + 1] += bucket_from[bucket];
+	}
+	memcpy(order, bucket_from, sizeof(uint32_t) * table->bucket_count);
+	for (uint32_t idx = 0; idx < count; ++idx) {
+		uint32_t bucket = filter_table_reduce(
+			filter_table_hash(keys[idx], 0), table->bucket_count);
+		bucket_keys[order[bucket]] = keys[idx];
+		bucket_values[order[bucket]] = values[idx];
+		order[bucket]++;
+	}
+
+	// Place the biggest buckets first while there are many free slots
+	uint32_t order_count = 0;
+	for (uint32_t size = max_size; size > 0; --size) {
+		for (uint32_t bucket = 0;
+		     bucket < table->bucket_count;
+		     ++bucket) {
+			if (bucket_from[bucket + 1] - bucket_from[bucket] == size)
+				order[order_count++] = bucket;
+		}
+	}
+
+	while (1) {
+		used = (uint8_t *)calloc(table->slot_count, sizeof(uint8_t));
+		if (used == NULL)
+			goto error;
+
+		uint32_t idx;
+		for (idx = 0; idx < order_count; ++idx) {
+			uint32_t bucket = order[idx];
+			int64_t seed = filter_table_place_bucket(
+				table,
+				bucket_keys + bucket_from[bucket],
+				bucket_from[bucket + 1] - bucket_from[bucket],
+				used,
+				slots);
+			if (seed < 0)
+				break;
+			table->seeds[bucket] = seed;
+		}
+		if (idx == order_count)
+			break;
+
+		free(used);
+		used = NULL;
+		table->slot_count += table->slot_count / 16 + 1;
+	}
+
+	table->keys = (uint64_t *)
+		malloc(sizeof(uint64_t) * table->slot_count);
+	table->values = (uint32_t *)
+		malloc(sizeof(uint32_t) * table->slot_count);
+	if (table->keys == NULL || table->values == NULL)
+		goto error;
+	// Key pair of two invalid values could not be stored
+	memset(table->keys, 0xff, sizeof(uint64_t) * table->slot_count);
+
+	for (uint32_t bucket = 0; bucket < table->bucket_count; ++bucket) {
+		for (uint32_t idx = bucket_from[bucket];
+		     idx < bucket_from[bucket + 1];
+		     ++idx) {
+			uint32_t slot = filter_table_reduce(
+				filter_table_hash(
+					bucket_keys[idx],
+					table->seeds[bucket] + 1),
+				table->slot_count);
+			table->keys[slot] = bucket_keys[idx];
+			table->values[slot] = bucket_values[idx];
+		}
+	}
+
+	free(used);
+	free(slots);
+	free(order);
+	free(bucket_values);
+	free(bucket_keys);
+	free(bucket_from);
 	return 0;
+
+error:
+	free(used);
+	free(slots);
+	free(order);
+	free(bucket_values);
+	free(bucket_keys);
+	free(bucket_from);
+	free(table->seeds);
+	free(table->keys);
+	free(table->values);
+	return -1;
 }
 
 static inline uint32_t
@@ -85,10 +340,29 @@ filter_table_lookup(
 	const struct filter_table *table,
 	uint32_t first,
 	uint32_t second) {
-	return table->values[first * table->first_dim + second];
+	if (table->keys == NULL)
+		return table->values[second * table->first_dim + first];
+
+	uint64_t key = filter_table_key(first, second);
+	uint32_t bucket = filter_table_reduce(
+		filter_table_hash(key, 0), table->bucket_count);
+	uint32_t slot = filter_table_reduce(
+		filter_table_hash(key, table->seeds[bucket] + 1),
+		table->slot_count);
+	if (table->keys[slot] != key)
+		return table->default_value;
+	return table->values[slot];
 }
 
+/*
+ * Generation identifies the filter contents for verdict caches, zero means
+ * the filter results must not be cached.
+ */
 struct filter {
+	uint64_t generation;
+
+	filter_match match;
+
 	uint32_t classify_count;
 	filter_classify *classify;
 
@@ -98,8 +372,12 @@ struct filter {
 	struct filter_table *tables;
 };
 
+/*
+ * The routine runs classifiers and lookup tables of the filter ignoring
+ * the match routine, so match routines may extend table results.
+ */
 static inline uint32_t
-filter_process(struct filter *filter, struct packet *packet)
+filter_process_tables(const struct filter *filter, const struct packet *packet)
 {
 	uint32_t *arguments = (uint32_t *)alloca(sizeof(uint32_t) *
 						 (filter->classify_count +
@@ -120,6 +398,18 @@ filter_process(struct filter *filter, struct packet *packet)
 					    arguments[lookup->first_arg],
 					    arguments[lookup->second_arg]);
 	}
+
+	// The last one argument is the filter result
+	return arguments[filter->classify_count + filter->lookup_count - 1];
+}
+
+static inline uint32_t
+filter_process(struct filter *filter, struct packet *packet)
+{
+	if (filter->match != NULL)
+		return filter->match(filter, packet);
+
+	return filter_process_tables(filter, packet);
 }
 
 #endif
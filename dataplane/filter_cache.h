@@ -0,0 +1,162 @@
+#ifndef FILTER_CACHE_H
+#define FILTER_CACHE_H
+
+/*
+ * Verdict cache keeps filter results of recently seen flows in front of
+ * filter_process. The cache is set-associative: a hash of the flow key
+ * and the filter generation selects a set of FILTER_CACHE_WAYS ways.
+ *
+ * A set is one cache line of way tags and values so a lookup probes the
+ * line only and compares the full key of a way whose tag matches. Keys
+ * are kept apart in the entry array at the same position.
+ *
+ * Each entry remembers the generation of the filter which computed the
+ * result. Filters sharing a cache get distinct sets and tags for the same
+ * flow and never evict each other by generation, entries of replaced
+ * filters are never hit and age out with round-robin eviction.
+ * Generations must be unique among filters sharing a cache and filters
+ * with zero generation bypass the cache.
+ *
+ * The cache is intended to be owned by one worker so it requires no
+ * synchronization. It is valid only for filters whose results depend on
+ * flow key fields and nothing else and the key extracted by the parser is
+ * used as is.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "packet/packet.h"
+
+#define FILTER_CACHE_WAYS 8
+
+// Zero tag marks an empty way
+#define FILTER_CACHE_TAG_EMPTY 0
+
+struct filter_cache_set {
+	uint32_t tags[FILTER_CACHE_WAYS];
+	uint32_t values[FILTER_CACHE_WAYS];
+} __attribute__((aligned(64)));
+
+struct filter_cache_entry {
+	struct packet_flow_key key;
+	uint64_t generation;
+};
+
+struct filter_cache {
+	struct filter_cache_set *sets;
+	struct filter_cache_entry *entries;
+	uint32_t set_mask;
+	// Round-robin way to evict when the whole set is taken
+	uint32_t victim;
+
+	uint64_t hits;
+	uint64_t misses;
+};
+
+/*
+ * The routine allocates the cache of at least set_count sets, the count is
+ * rounded up to a power of two.
+ */
+static inline int
+filter_cache_init(struct filter_cache *cache, uint32_t set_count)
+{
+	memset(cache, 0, sizeof(struct filter_cache));
+
+	uint32_t count = 1;
+	while (count < set_count)
+		count *= 2;
+
+	cache->sets = (struct filter_cache_set *)aligned_alloc(
+		64, sizeof(struct filter_cache_set) * count);
+	cache->entries = (struct filter_cache_entry *)malloc(
+		sizeof(struct filter_cache_entry) * count * FILTER_CACHE_WAYS);
+	if (cache->sets == NULL || cache->entries == NULL) {
+		free(cache->sets);
+		free(cache->entries);
+		return -1;
+	}
+	memset(cache->sets, 0, sizeof(struct filter_cache_set) * count);
+	cache->set_mask = count - 1;
+	return 0;
+}
+
+static inline void
+filter_cache_free(struct filter_cache *cache)
+{
+	free(cache->sets);
+	free(cache->entries);
+}
+
+static inline uint64_t
+filter_cache_hash(const struct packet_flow_key *key, uint64_t generation)
+{
+	uint64_t words[sizeof(struct packet_flow_key) / sizeof(uint64_t)];
+	memcpy(words, key, sizeof(words));
+
+	uint64_t hash = generation * 0xc4ceb9fe1a85ec53;
+	for (uint32_t idx = 0; idx < sizeof(words) / sizeof(uint64_t); ++idx) {
+		hash ^= words[idx];
+		hash *= 0xff51afd7ed558ccd;
+		hash ^= hash >> 33;
+	}
+	return hash;
+}
+
+// Tags take the hash bits not used by the set index
+static inline uint32_t
+filter_cache_tag(uint64_t hash)
+{
+	return (uint32_t)(hash >> 32) | 1;
+}
+
+static inline uint32_t
+filter_cache_process(
+	struct filter_cache *cache,
+	struct filter *filter,
+	struct packet *packet)
+{
+	if (filter->generation == 0)
+		return filter_process(filter, packet);
+
+	const struct packet_flow_key *key = &packet->flow_key;
+	uint64_t hash = filter_cache_hash(key, filter->generation);
+	uint32_t tag = filter_cache_tag(hash);
+	uint32_t set_idx = hash & cache->set_mask;
+	struct filter_cache_set *set = cache->sets + set_idx;
+	struct filter_cache_entry *entries =
+		cache->entries + set_idx * FILTER_CACHE_WAYS;
+
+	for (uint32_t way = 0; way < FILTER_CACHE_WAYS; ++way) {
+		if (set->tags[way] == tag &&
+		    entries[way].generation == filter->generation &&
+		    !memcmp(&entries[way].key, key, sizeof(*key))) {
+			cache->hits++;
+			return set->values[way];
+		}
+	}
+
+	cache->misses++;
+	uint32_t value = filter_process(filter, packet);
+	if (value == FILTER_INVALID)
+		return value;
+
+	// Empty ways are taken first
+	uint32_t way;
+	for (way = 0; way < FILTER_CACHE_WAYS; ++way) {
+		if (set->tags[way] == FILTER_CACHE_TAG_EMPTY)
+			break;
+	}
+	if (way == FILTER_CACHE_WAYS)
+		way = cache->victim++ % FILTER_CACHE_WAYS;
+
+	set->tags[way] = tag;
+	set->values[way] = value;
+	entries[way].key = *key;
+	entries[way].generation = filter->generation;
+	return value;
+}
+
+#endif
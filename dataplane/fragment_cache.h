@@ -0,0 +1,224 @@
+#ifndef FRAGMENT_CACHE_H
+#define FRAGMENT_CACHE_H
+
+/*
+ * Fragment cache keeps verdicts of first fragments so later fragments of
+ * the same datagram get the verdict computed with the transport ports
+ * they do not carry. Fragments are matched by addresses and IP
+ * identification and are never reassembled nor copied.
+ *
+ * Like the verdict cache, entries remember the generation of the filter
+ * which computed the verdict and filters with zero generation bypass the
+ * cache. Entries also expire after the timeout since the identification
+ * is reused by senders. The time is up to the caller, TSC cycles for
+ * instance, as long as now and the timeout are in the same units.
+ *
+ * Fragments arriving ahead of the first one or whose entry was evicted
+ * are classified as is, that is with zero ports.
+ *
+ * The cache is intended to be owned by one worker so it requires no
+ * synchronization.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "filter_cache.h"
+#include "packet/packet.h"
+
+#define FRAGMENT_CACHE_WAYS 4
+
+struct fragment_cache_entry {
+	// Flow key with zero ports and transport type for IPv6
+	struct packet_flow_key key;
+	uint32_t fragment_id;
+	uint32_t value;
+	uint64_t generation;
+	uint64_t time;
+} __attribute__((aligned(64)));
+
+struct fragment_cache {
+	struct fragment_cache_entry *entries;
+	uint32_t set_mask;
+	uint32_t victim;
+	uint64_t timeout;
+
+	uint64_t hits;
+	uint64_t misses;
+};
+
+/*
+ * The routine allocates the cache of at least set_count sets, the count is
+ * rounded up to a power of two.
+ */
+static inline int
+fragment_cache_init(
+	struct fragment_cache *cache,
+	uint32_t set_count,
+	uint64_t timeout)
+{
+	memset(cache, 0, sizeof(struct fragment_cache));
+
+	uint32_t count = 1;
+	while (count < set_count)
+		count *= 2;
+
+	size_t size = sizeof(struct fragment_cache_entry) * count *
+		      FRAGMENT_CACHE_WAYS;
+	// Zero generation entries never match
+	cache->entries =
+		(struct fragment_cache_entry *)aligned_alloc(64, size);
+	if (cache->entries == NULL)
+		return -1;
+	memset(cache->entries, 0, size);
+	cache->set_mask = count - 1;
+	cache->timeout = timeout;
+	return 0;
+}
+
+static inline void
+fragment_cache_free(struct fragment_cache *cache)
+{
+	free(cache->entries);
+}
+
+/*
+ * Each IPv4 fragment carries the protocol so the transport type is kept in
+ * the key. Later IPv6 fragments know only the header following the
+ * fragment one which may be an extension, so the type is cleared for them.
+ */
+static inline void
+fragment_cache_key(const struct packet *packet, struct packet_flow_key *key)
+{
+	*key = packet->flow_key;
+	key->src_port = 0;
+	key->dst_port = 0;
+	if (key->network_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6))
+		key->transport_type = 0;
+}
+
+static inline struct fragment_cache_entry *
+fragment_cache_set(
+	const struct fragment_cache *cache,
+	const struct packet_flow_key *key,
+	uint32_t fragment_id,
+	uint64_t generation)
+{
+	uint64_t hash = filter_cache_hash(key, generation) ^
+			fragment_id * 0xc4ceb9fe1a85ec53;
+	hash ^= hash >> 29;
+	return cache->entries +
+	       (hash & cache->set_mask) * FRAGMENT_CACHE_WAYS;
+}
+
+/*
+ * The routine returns the verdict recorded for the datagram of the packet
+ * or FILTER_INVALID if there is no one.
+ */
+static inline uint32_t
+fragment_cache_lookup(
+	struct fragment_cache *cache,
+	const struct packet *packet,
+	uint64_t generation,
+	uint64_t now)
+{
+	struct packet_flow_key key;
+	fragment_cache_key(packet, &key);
+
+	struct fragment_cache_entry *set =
+		fragment_cache_set(
+			cache, &key, packet->fragment_id, generation);
+
+	for (uint32_t way = 0; way < FRAGMENT_CACHE_WAYS; ++way) {
+		if (set[way].generation == generation &&
+		    set[way].fragment_id == packet->fragment_id &&
+		    now - set[way].time <= cache->timeout &&
+		    !memcmp(&set[way].key, &key, sizeof(key))) {
+			cache->hits++;
+			return set[way].value;
+		}
+	}
+
+	cache->misses++;
+	return FILTER_INVALID;
+}
+
+/*
+ * The routine records the verdict of the first fragment of a datagram.
+ */
+static inline void
+fragment_cache_update(
+	struct fragment_cache *cache,
+	const struct packet *packet,
+	uint64_t generation,
+	uint32_t value,
+	uint64_t now)
+{
+	struct packet_flow_key key;
+	fragment_cache_key(packet, &key);
+
+	struct fragment_cache_entry *set =
+		fragment_cache_set(
+			cache, &key, packet->fragment_id, generation);
+
+	/*
+	 * Repeated first fragments refresh the entry of the datagram, then
+	 * empty and expired entries are evicted first. Entries of other
+	 * filters are not stale as filters share the cache.
+	 */
+	uint32_t way;
+	for (way = 0; way < FRAGMENT_CACHE_WAYS; ++way) {
+		if (set[way].generation == generation &&
+		    set[way].fragment_id == packet->fragment_id &&
+		    !memcmp(&set[way].key, &key, sizeof(key)))
+			break;
+	}
+	if (way == FRAGMENT_CACHE_WAYS) {
+		for (way = 0; way < FRAGMENT_CACHE_WAYS; ++way) {
+			if (set[way].generation == 0 ||
+			    now - set[way].time > cache->timeout)
+				break;
+		}
+	}
+	if (way == FRAGMENT_CACHE_WAYS)
+		way = cache->victim++ % FRAGMENT_CACHE_WAYS;
+
+	set[way].key = key;
+	set[way].fragment_id = packet->fragment_id;
+	set[way].value = value;
+	set[way].generation = generation;
+	set[way].time = now;
+}
+
+/*
+ * The routine processes the packet by the filter applying the verdict of
+ * the first fragment to the later fragments of a datagram.
+ */
+static inline uint32_t
+fragment_cache_process(
+	struct fragment_cache *cache,
+	struct filter *filter,
+	struct packet *packet,
+	uint64_t now)
+{
+	if (!(packet->flags & NETWORK_FLAG_FRAGMENT) || filter->generation == 0)
+		return filter_process(filter, packet);
+
+	if (packet->flags & NETWORK_FLAG_NOT_FIRST_FRAGMENT) {
+		uint32_t value = fragment_cache_lookup(
+			cache, packet, filter->generation, now);
+		if (value != FILTER_INVALID)
+			return value;
+		return filter_process(filter, packet);
+	}
+
+	uint32_t value = filter_process(filter, packet);
+	if (value != FILTER_INVALID)
+		fragment_cache_update(
+			cache, packet, filter->generation, value, now);
+	return value;
+}
+
+#endif
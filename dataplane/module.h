@@ -13,10 +13,12 @@ struct pipeline_front;
 
 /*
  * Module handler called for a pipeline front.
- * Module should go through the front and handle packets.
- * For each input packet module should put into output or drop list of the
- * front.
- * Also module may create new packet and put the into output queue.
+ * Module should go through the input vector of the front and handle
+ * packets by index, so packets ahead may be prefetched and the burst
+ * processed in bulk.
+ * For each input packet module should put into output or drop vector of
+ * the front.
+ * Also module may create new packet and put the into output vector.
  */
 typedef void (*module_handler)(
 	struct module *module,
@@ -32,6 +34,11 @@ typedef void (*module_handler)(
  * The handler is responsible for:
  *  - checking if the configuration is same
  *  - preserving runtime parameters and variables
+ *
+ * The handler must return a fresh configuration and must not modify the
+ * old one in place as workers may still process packets with it until the
+ * pipeline reconfiguration frees it. Returning the old configuration
+ * as is keeps it in use.
  */
 
 typedef int (*module_config_handler)(
@@ -41,10 +48,20 @@ typedef int (*module_config_handler)(
 	struct module_config **new_config
 );
 
+/*
+ * The handler frees the instance configuration replaced or removed by
+ * pipeline reconfiguration once no worker references it.
+ */
+typedef void (*module_config_free_handler)(
+	struct module *module,
+	struct module_config *config
+);
+
 struct module {
 	char name[MODULE_NAME_LEN];
 	module_handler handler;
 	module_config_handler config_handler;
+	module_config_free_handler config_free_handler;
 };
 
 struct module_config {
@@ -68,6 +85,13 @@ module_configure(struct module *module, const void *config_data, struct module_c
 	return module->config_handler(module, config_data, old_config, new_config);
 }
 
+static inline void
+module_config_free(struct module *module, struct module_config *config)
+{
+	if (module->config_free_handler != NULL)
+		module->config_free_handler(module, config);
+}
+
 struct module *
 module_lookup(const char *name);
 
@@ -35,13 +35,14 @@ balancer_route(
 static void
 balancer_handle_packet(
 	struct balancer_module *balancer,
-	struct pipeline *pipeline,
+	struct pipeline_front *pipeline_front,
 	struct packet *packet)
 {
 
-	uint32_t action = filter_check(&balancer->filter, packet);
+	uint32_t action = pipeline_front_filter(
+		pipeline_front, &balancer->filter, packet);
 	if (action == FILTER_BYPASS) {
-		pipeline_packet_output(pipeline, packet);
+		pipeline_front_output(pipeline_front, packet);
 		return;
 	}
 
@@ -49,37 +50,41 @@ balancer_handle_packet(
 
 	if (vs == NULL) {
 		// invalid configuration
-		pipeline_packet_drop(pipeline, packet);
+		pipeline_front_drop(pipeline_front, packet);
 		return;
 	}
 
 	struct balancer_rs *rs = balancer_rs_lookup(balancer, vs, packet);
 	if (rs == NULL) {
 		// real lookup failed
-		pipeline_packet_drop(pipeline, packet);
+		pipeline_front_drop(pipeline_front, packet);
 		return;
 	}
 
 	if (balancer_route(balancer, vs, rs, packet) != 0) {
-		pipeline_packet_drop(pipeline, packet);
+		pipeline_front_drop(pipeline_front, packet);
 		return;
 	}
 
-	pipeline_packet_output(pipeline, packet);
+	pipeline_front_output(pipeline_front, packet);
 }
 
 static void
-balancer_handle(struct module *module, struct pipeline *pipeline)
+balancer_handle(
+	struct module *module,
+	struct module_config *module_config,
+	struct pipeline_front *pipeline_front)
 {
 	struct balancer_module *balancer =
 		container_of(module, struct balancer_module, module);
 
-	struct packet_list input = pipeline_packet_input(pipeline);
+	(void) module_config;
 
-	for (struct packet *packet == packet_list_first(&input);
-	     packet != NULL;
-	     packet = packet->next) {
-		balancer_handle_packet(balancer, pipeline, packet);
+	struct packet_vector *input = pipeline_front->input;
+
+	for (uint32_t idx = 0; idx < input->count; ++idx) {
+		balancer_handle_packet(
+			balancer, pipeline_front, input->packets[idx]);
 	}
 }
 
@@ -4,37 +4,42 @@
 static void
 decap_handle_packet(
 	struct decap_module *decap,
-	struct pipeline *pipeline,
+	struct pipeline_front *pipeline_front,
 	struct packet *packet)
 {
 
-	uint32_t action = filter_check(&decap->filter, packet);
+	uint32_t action = pipeline_front_filter(
+		pipeline_front, &decap->filter, packet);
 	if (action == FILTER_BYPASS) {
-		pipeline_packet_output(pipeline, packet);
+		pipeline_front_output(pipeline_front, packet);
 		return;
 	}
 
 	if (packet_decap(packet) != 0) {
-		pipeline_packet_drop(pipeline, packet);
+		pipeline_front_drop(pipeline_front, packet);
 		return;
 	}
 
-	pipeline_packet_output(pipeline, packet);
+	pipeline_front_output(pipeline_front, packet);
 }
 
 
 static void
-decap_handle(struct module *module, struct pipeline *pipeline)
+decap_handle(
+	struct module *module,
+	struct module_config *module_config,
+	struct pipeline_front *pipeline_front)
 {
 	struct decap_module *decap =
 		container_of(module, struct decap_module, module);
 
-	struct packet_list input = pipeline_packet_input(pipeline);
+	(void) module_config;
 
-	for (struct packet *packet == packet_list_first(&input);
-	     packet != NULL;
-	     packet = packet->next) {
-		decap_handle_packet(decap, pipeline, packet);
+	struct packet_vector *input = pipeline_front->input;
+
+	for (uint32_t idx = 0; idx < input->count; ++idx) {
+		decap_handle_packet(
+			decap, pipeline_front, input->packets[idx]);
 	}
 }
 
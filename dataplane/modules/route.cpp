@@ -3,20 +3,21 @@
 static void
 route_handle_packet(
 	struct route_module *route,
-	struct pipeline *pipeline,
+	struct pipeline_front *pipeline_front,
 	struct packet *packet)
 {
 
-	uint32_t action = filter_check(&route->filter, packet);
+	uint32_t action = pipeline_front_filter(
+		pipeline_front, &route->filter, packet);
 	if (action == FILTER_BYPASS) {
-		pipeline_packet_output(pipeline, packet);
+		pipeline_front_output(pipeline_front, packet);
 		return;
 	}
 
 	struct route *route = route_lookup(route, packet);
 
 	if (route == NULL) {
-		pipeline_packet_drop(pipeline, packet);
+		pipeline_front_drop(pipeline_front, packet);
 		return;
 	}
 
@@ -31,26 +32,30 @@ route_handle_packet(
 	}
 
 	default:
-		pipeline_packet_drop(pipeline, packet);
+		pipeline_front_drop(pipeline_front, packet);
 		return;
 	}
 
-	pipeline_packet_output(pipeline, packet);
+	pipeline_front_output(pipeline_front, packet);
 }
 
 
 static void
-route_handle(struct module *module, struct pipeline *pipeline)
+route_handle(
+	struct module *module,
+	struct module_config *module_config,
+	struct pipeline_front *pipeline_front)
 {
 	struct route_module *route =
 		container_of(module, struct route_module, module);
 
-	struct packet_list input = pipeline_packet_input(pipeline);
+	(void) module_config;
 
-	for (struct packet *packet == packet_list_first(&input);
-	     packet != NULL;
-	     packet = packet->next) {
-		route_handle_packet(route, pipeline, packet);
+	struct packet_vector *input = pipeline_front->input;
+
+	for (uint32_t idx = 0; idx < input->count; ++idx) {
+		route_handle_packet(
+			route, pipeline_front, input->packets[idx]);
 	}
 }
 
@@ -1,8 +1,12 @@
 #include "packet.h"
 
 #include <stdint.h>
+#include <string.h>
 
 #include <rte_ether.h>
+#include <rte_prefetch.h>
+#include <rte_tcp.h>
+#include <rte_udp.h>
 
 /*
  * TODO: analyze if the valid packet parsing may
@@ -20,8 +24,9 @@ parse_ether_header(struct packet *packet, uint16_t *type, uint16_t *offset)
 		return -1;
 	}
 
-	const struct rte_ether_hdr* etherHeader =
-		rte_pktmbuf_mtod_offset(mbuf, struct rte_ether_hdr*, *offset);
+	struct rte_ether_hdr scratch;
+	const struct rte_ether_hdr* etherHeader = packet_read(
+		packet, *offset, sizeof(struct rte_ether_hdr), &scratch);
 	*type = etherHeader->ether_type;
 	*offset += sizeof(struct rte_ether_hdr);
 	return 0;
@@ -38,8 +43,9 @@ parse_vlan_header(struct packet *packet, uint16_t *type, uint16_t *offset)
 		return -1;
 	}
 
-	const struct rte_vlan_hdr* vlanHeader =
-		rte_pktmbuf_mtod_offset(mbuf, struct rte_vlan_hdr*, *offset);
+	struct rte_vlan_hdr scratch;
+	const struct rte_vlan_hdr* vlanHeader = packet_read(
+		packet, *offset, sizeof(struct rte_vlan_hdr), &scratch);
 
 	packet->vlan = rte_be_to_cpu_16(vlanHeader->vlan_tci);
 
@@ -59,8 +65,9 @@ parse_ipv4_header(struct packet *packet, uint16_t *type, uint16_t *offset)
 		return -1;
 	}
 
-	const struct rte_ipv4_hdr* ipv4Header =
-		rte_pktmbuf_mtod_offset(mbuf, struct rte_ipv4_hdr*, *offset);
+	struct rte_ipv4_hdr scratch;
+	const struct rte_ipv4_hdr* ipv4Header = packet_read(
+		packet, *offset, sizeof(struct rte_ipv4_hdr), &scratch);
 
 	if (rte_pktmbuf_pkt_len(mbuf) <
 	    (uint32_t)*offset + rte_be_to_cpu_16(ipv4Header->total_length)) {
@@ -79,8 +86,17 @@ parse_ipv4_header(struct packet *packet, uint16_t *type, uint16_t *offset)
 		return -1;
 	}
 
-	//FIXME: check if fragmented
-	//FIXME: process extensions
+	uint16_t fragment_offset = rte_be_to_cpu_16(ipv4Header->fragment_offset);
+	if (fragment_offset & (RTE_IPV4_HDR_MF_FLAG | RTE_IPV4_HDR_OFFSET_MASK)) {
+		packet->flags |= NETWORK_FLAG_FRAGMENT;
+		if (fragment_offset & RTE_IPV4_HDR_OFFSET_MASK)
+			packet->flags |= NETWORK_FLAG_NOT_FIRST_FRAGMENT;
+		packet->fragment_id = ipv4Header->packet_id;
+	}
+
+	// Options are skipped
+	if ((ipv4Header->version_ihl & 0x0F) > 0x05)
+		packet->flags |= NETWORK_FLAG_HAS_EXTENSION;
 
 	*type = ipv4Header->next_proto_id;
 	*offset += 4 * (ipv4Header->version_ihl & 0x0F);
@@ -99,8 +115,9 @@ parse_ipv6_header(struct packet *packet, uint16_t *type, uint16_t *offset)
 		return -1;
 	}
 
-	const struct rte_ipv6_hdr* ipv6Header =
-		rte_pktmbuf_mtod_offset(mbuf, struct rte_ipv6_hdr*, *offset);
+	struct rte_ipv6_hdr scratch;
+	const struct rte_ipv6_hdr* ipv6Header = packet_read(
+		packet, *offset, sizeof(struct rte_ipv6_hdr), &scratch);
 
 	if (rte_pktmbuf_pkt_len(mbuf) <
 	    *offset + sizeof(struct rte_ipv6_hdr) +
@@ -121,49 +138,59 @@ parse_ipv6_header(struct packet *packet, uint16_t *type, uint16_t *offset)
 				return -1;
 			}
 
-			const struct ipv6_ext_2byte *ext =
-				rte_pktmbuf_mtod_offset(mbuf,
-							struct ipv6_ext_2byte *,
-							*offset);
+			struct ipv6_ext_2byte ext_scratch;
+			const struct ipv6_ext_2byte *ext = packet_read(
+				packet,
+				*offset,
+				sizeof(struct ipv6_ext_2byte),
+				&ext_scratch);
 
 			ext_type = ext->next_type;
 			*offset += (1 + ext->size) * 8;
 
-			//FIXME: packet->network_flags |= NETWORK_FLAG_HAS_EXTENSION;
+			packet->flags |= NETWORK_FLAG_HAS_EXTENSION;
 		} else if (ext_type == IPPROTO_AH) {
 			if (max_offset < *offset + 8) {
 				return -1;
 			}
 
-			const struct ipv6_ext_2byte *ext =
-				rte_pktmbuf_mtod_offset(mbuf,
-							struct ipv6_ext_2byte *,
-							*offset);
+			struct ipv6_ext_2byte ext_scratch;
+			const struct ipv6_ext_2byte *ext = packet_read(
+				packet,
+				*offset,
+				sizeof(struct ipv6_ext_2byte),
+				&ext_scratch);
 
 			ext_type = ext->next_type;
 			*offset += (2 + ext->size) * 4;
-			//FIXME: packet->network_flags |= NETWORK_FLAG_HAS_EXTENSION;
+			packet->flags |= NETWORK_FLAG_HAS_EXTENSION;
 		} else if (ext_type == IPPROTO_FRAGMENT) {
 			if (max_offset < *offset + 8) {
 				return -1;
 			}
 
-			const struct ipv6_ext_fragment *ext =
-				rte_pktmbuf_mtod_offset(mbuf,
-							struct ipv6_ext_fragment *,
-							*offset);
-
-			if ((ext->offset_flag & 0xF9FF) != 0x0000) {
-				//FIXME: NETWORK_FLAG_FRAGMENT
-				if ((ext->offset_flag & 0xF8FF) != 0x0000) {
-					//FIXME: NETWORK_FLAG_NOT_FIRST_FRAGMENT;
-				}
-			}
+			struct ipv6_ext_fragment ext_scratch;
+			const struct ipv6_ext_fragment *ext = packet_read(
+				packet,
+				*offset,
+				sizeof(struct ipv6_ext_fragment),
+				&ext_scratch);
 
 			ext_type = ext->next_type;
 			*offset += RTE_IPV6_FRAG_HDR_SIZE;
+			packet->flags |= NETWORK_FLAG_HAS_EXTENSION;
 
-			//FIXME: packet->network_flags |= NETWORK_FLAG_HAS_EXTENSION;
+			uint16_t offset_flag = rte_be_to_cpu_16(ext->offset_flag);
+			if (offset_flag &
+			    (RTE_IPV6_EHDR_MF_MASK | RTE_IPV6_EHDR_FO_MASK)) {
+				packet->flags |= NETWORK_FLAG_FRAGMENT;
+				packet->fragment_id = ext->identification;
+			}
+			// Data of a non-first fragment are not headers
+			if (offset_flag & RTE_IPV6_EHDR_FO_MASK) {
+				packet->flags |= NETWORK_FLAG_NOT_FIRST_FRAGMENT;
+				break;
+			}
 		} else {
 			break;
 		}
@@ -180,6 +207,71 @@ parse_ipv6_header(struct packet *packet, uint16_t *type, uint16_t *offset)
 
 
 
+/*
+ * The routine extracts the flow key of the packet whose headers are
+ * parsed. Header lines were just touched by the parser so the key is
+ * filled without extra cache misses.
+ */
+static inline int
+parse_flow_key(struct packet *packet)
+{
+	struct packet_flow_key *key = &packet->flow_key;
+
+	memset(key, 0, sizeof(struct packet_flow_key));
+	key->network_type = packet->network_header.type;
+	key->transport_type = packet->transport_header.type;
+
+	if (packet->network_header.type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
+		struct rte_ipv4_hdr scratch;
+		const struct rte_ipv4_hdr* ipv4Header = packet_read(
+			packet,
+			packet->network_header.offset,
+			sizeof(struct rte_ipv4_hdr),
+			&scratch);
+		if (ipv4Header == NULL)
+			return -1;
+
+		memcpy(key->src_addr, &ipv4Header->src_addr, 4);
+		memcpy(key->dst_addr, &ipv4Header->dst_addr, 4);
+	} else if (packet->network_header.type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6)) {
+		struct rte_ipv6_hdr scratch;
+		const struct rte_ipv6_hdr* ipv6Header = packet_read(
+			packet,
+			packet->network_header.offset,
+			sizeof(struct rte_ipv6_hdr),
+			&scratch);
+		if (ipv6Header == NULL)
+			return -1;
+
+		memcpy(key->src_addr, ipv6Header->src_addr, 16);
+		memcpy(key->dst_addr, ipv6Header->dst_addr, 16);
+	} else {
+		return -1;
+	}
+
+	// Non-first fragments carry no transport header
+	if (packet->flags & NETWORK_FLAG_NOT_FIRST_FRAGMENT)
+		return 0;
+
+	// Ports are at the same place of TCP and UDP headers
+	if (packet->transport_header.type == IPPROTO_TCP ||
+	    packet->transport_header.type == IPPROTO_UDP) {
+		struct rte_udp_hdr scratch;
+		const struct rte_udp_hdr* udpHeader = packet_read(
+			packet,
+			packet->transport_header.offset,
+			sizeof(struct rte_udp_hdr),
+			&scratch);
+		if (udpHeader == NULL)
+			return -1;
+
+		key->src_port = udpHeader->src_port;
+		key->dst_port = udpHeader->dst_port;
+	}
+
+	return 0;
+}
+
 int
 parse_packet(struct packet *packet)
 {
@@ -196,6 +288,9 @@ parse_packet(struct packet *packet)
 
 	}
 
+	packet->network_header.type = type;
+	packet->network_header.offset = offset;
+
 	if (type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
 		if (parse_ipv4_header(packet, &type, &offset)) {
 			return -1;
@@ -213,7 +308,92 @@ parse_packet(struct packet *packet)
 	packet->transport_header.type = type;
 	packet->transport_header.offset = offset;
 
-	return 0;
+	return parse_flow_key(packet);
 }
 
+/*
+ * Header lengths are implied by the packet types trusted: no VLAN, IPv4
+ * options or IPv6 extension headers. Length hints are only checked to
+ * agree if the PMD fills them. Packet length is not validated against
+ * the IP header as the PMD already recognized the packet.
+ */
+int
+parse_packet_ptype(struct packet *packet)
+{
+	const struct rte_mbuf *mbuf = packet_to_mbuf(packet);
+	uint32_t ptype = mbuf->packet_type;
+
+	if ((ptype & RTE_PTYPE_L2_MASK) != RTE_PTYPE_L2_ETHER)
+		return parse_packet(packet);
+
+	uint16_t type;
+	uint16_t l3_len;
+	switch (ptype & RTE_PTYPE_L3_MASK) {
+	case RTE_PTYPE_L3_IPV4:
+		type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+		l3_len = sizeof(struct rte_ipv4_hdr);
+		break;
+	case RTE_PTYPE_L3_IPV6:
+		type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6);
+		l3_len = sizeof(struct rte_ipv6_hdr);
+		break;
+	default:
+		return parse_packet(packet);
+	}
 
+	// Fragments and other protocols are left to the software walk
+	uint16_t proto;
+	switch (ptype & RTE_PTYPE_L4_MASK) {
+	case RTE_PTYPE_L4_TCP:
+		proto = IPPROTO_TCP;
+		break;
+	case RTE_PTYPE_L4_UDP:
+		proto = IPPROTO_UDP;
+		break;
+	default:
+		return parse_packet(packet);
+	}
+
+	uint16_t l2_len = sizeof(struct rte_ether_hdr);
+	if ((mbuf->l2_len && mbuf->l2_len != l2_len) ||
+	    (mbuf->l3_len && mbuf->l3_len != l3_len) ||
+	    rte_pktmbuf_pkt_len(mbuf) < (uint32_t)l2_len + l3_len)
+		return parse_packet(packet);
+
+	packet->network_header.type = type;
+	packet->network_header.offset = l2_len;
+	packet->transport_header.type = proto;
+	packet->transport_header.offset = l2_len + l3_len;
+	return parse_flow_key(packet);
+}
+
+static inline void
+packet_prefetch_headers(struct packet *packet)
+{
+	const uint8_t *data =
+		rte_pktmbuf_mtod(packet_to_mbuf(packet), const uint8_t *);
+	// IPv6 with transport ports crosses the first cache line
+	rte_prefetch0(data);
+	rte_prefetch0(data + RTE_CACHE_LINE_SIZE);
+}
+
+void
+parse_packet_burst(
+	struct packet **packets,
+	uint32_t count,
+	bool ptype,
+	int *results)
+{
+	for (uint32_t idx = 0;
+	     idx < count && idx < PACKET_PREFETCH_DISTANCE;
+	     ++idx)
+		packet_prefetch_headers(packets[idx]);
+
+	for (uint32_t idx = 0; idx < count; ++idx) {
+		if (idx + PACKET_PREFETCH_DISTANCE < count)
+			packet_prefetch_headers(
+				packets[idx + PACKET_PREFETCH_DISTANCE]);
+		results[idx] = ptype ? parse_packet_ptype(packets[idx])
+				     : parse_packet(packets[idx]);
+	}
+}
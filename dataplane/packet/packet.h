@@ -1,6 +1,8 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 
@@ -10,6 +12,30 @@
 
 #define PACKET_HEADER_TYPE_UNKNOWN 0
 
+// Network flags of the packet flags set by the parser
+#define NETWORK_FLAG_FRAGMENT 0x0001
+#define NETWORK_FLAG_NOT_FIRST_FRAGMENT 0x0002
+#define NETWORK_FLAG_HAS_EXTENSION 0x0004
+
+/*
+ * Flow key is a packed 5-tuple extracted by the parser so classifiers and
+ * modules need not read packet headers again. IPv4 addresses occupy the
+ * first 4 bytes of address fields and ports are zero for packets other than
+ * TCP and UDP ones and for non-first fragments. Unused bytes are zeroed so
+ * keys may be compared and hashed as is. VLAN and flags are kept next to the
+ * key in the packet metadata.
+ *
+ * The key is valid only for packets parsed successfully.
+ */
+struct packet_flow_key {
+	uint8_t src_addr[16];
+	uint8_t dst_addr[16];
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint16_t network_type;
+	uint16_t transport_type;
+};
+
 struct network_header {
 	uint16_t type;
 	uint16_t offset;
@@ -20,55 +46,142 @@ struct transport_header {
 	uint16_t offset;
 };
 
+/*
+ * Packet metadata lives in the private area of the mbuf just after the
+ * mbuf structure, so it never overlaps the headroom where headers are
+ * prepended and the mbuf is found by the packet address. Mempools must be
+ * created with at least PACKET_MBUF_PRIV_SIZE private size.
+ *
+ * The flow key and header offsets are placed into the first cache line
+ * which is the only one initialized on RX. The flow key goes first so
+ * addresses are 8-byte aligned.
+ */
 struct packet {
-	struct packet *next;
-	struct rte_mbuf *mbuf;
+	struct packet_flow_key flow_key;
 	uint16_t flags;
 	uint16_t vlan;
 	struct network_header network_header;
 	struct transport_header transport_header;
-};
-
-struct packet_list {
-	struct packet *first;
-	struct packet **last;
+	// IP identification of fragments in network byte order
+	uint32_t fragment_id;
+	// Pipeline of the logical device the packet is read from
+	uint16_t pipeline_idx;
+} __rte_cache_aligned;
+
+#define PACKET_MBUF_PRIV_SIZE \
+	RTE_ALIGN(sizeof(struct packet), RTE_MBUF_PRIV_ALIGN)
+
+// Private area of cache-aligned mbuf starts at a cache line
+_Static_assert(sizeof(struct rte_mbuf) % RTE_CACHE_LINE_SIZE == 0,
+	       "packet metadata is not cache-aligned");
+_Static_assert(offsetof(struct packet, pipeline_idx) + sizeof(uint16_t) <=
+		       RTE_CACHE_LINE_SIZE,
+	       "packet hot fields cross a cache line");
+
+#define PACKET_VECTOR_SIZE 256
+
+/*
+ * Packet vector is a fixed-capacity array of packets so a burst is walked
+ * by index allowing to prefetch packets ahead and to process them in bulk.
+ */
+struct packet_vector {
+	uint32_t count;
+	struct packet *packets[PACKET_VECTOR_SIZE];
 };
 
 static inline void
-packet_list_init(struct packet_list *list)
+packet_vector_init(struct packet_vector *vector)
 {
-	list->first = NULL;
-	list->last = &list->first;
+	vector->count = 0;
 }
 
-static inline void
-packet_list_add(struct packet_list *list, struct packet *packet)
-{
-	if (*list->last != NULL)
-		(*list->last)->next = packet;
-	*list->last = packet;
-	packet->next = NULL;
-}
-
-static inline struct packet *
-packet_list_first(struct packet_list *list)
+/*
+ * The routine appends the packet to the vector and returns -1 if the
+ * vector is full.
+ */
+static inline int
+packet_vector_add(struct packet_vector *vector, struct packet *packet)
 {
-	return list->first;
+	if (vector->count == PACKET_VECTOR_SIZE)
+		return -1;
+	vector->packets[vector->count++] = packet;
+	return 0;
 }
 
 int
 parse_packet(struct packet *packet);
 
+/*
+ * The routine takes headers of plain IPv4 and IPv6 TCP/UDP packets from
+ * the packet type recognized by the PMD and falls back to parse_packet
+ * for any other packet. So header walking is skipped on the common path.
+ */
+int
+parse_packet_ptype(struct packet *packet);
+
+/*
+ * Count of packets ahead of the parsed one whose headers are prefetched
+ * while parsing a burst.
+ */
+#define PACKET_PREFETCH_DISTANCE 4
+
+/*
+ * The routine parses the burst of packets as parse_packet or
+ * parse_packet_ptype if ptype is set storing the result of each packet
+ * into the results array. Headers of following packets are prefetched
+ * so their cache misses overlap with parsing of the current packet.
+ */
+void
+parse_packet_burst(
+	struct packet **packets,
+	uint32_t count,
+	bool ptype,
+	int *results);
+
 static inline struct rte_mbuf *
 packet_to_mbuf(const struct packet *packet)
 {
-	return packet->mbuf;
+	return (struct rte_mbuf *)
+		((uintptr_t)packet - sizeof(struct rte_mbuf));
 }
 
 static inline struct packet *
 mbuf_to_packet(struct rte_mbuf *mbuf)
 {
-	return (struct packet *)((void*)mbuf->buf_addr);
+	return (struct packet *)rte_mbuf_to_priv(mbuf);
+}
+
+/*
+ * The routine returns the pointer to size bytes of packet data at the
+ * offset or NULL if the packet is shorter. Data within one segment are
+ * read in place while data spanning segments are copied into the scratch
+ * of at least size bytes, so chained mbufs are never linearized. Callers
+ * keep a scratch per header on the stack.
+ */
+static inline const void *
+packet_read(
+	const struct packet *packet,
+	uint32_t offset,
+	uint32_t size,
+	void *scratch)
+{
+	return rte_pktmbuf_read(packet_to_mbuf(packet), offset, size, scratch);
+}
+
+/*
+ * The routine initializes RX packet metadata writing the first cache line
+ * only. The flow key is left to the parser.
+ */
+static inline void
+packet_init(struct packet *packet)
+{
+	packet->flags = 0;
+	packet->vlan = 0;
+	packet->network_header =
+		(struct network_header){PACKET_HEADER_TYPE_UNKNOWN, 0};
+	packet->transport_header =
+		(struct transport_header){PACKET_HEADER_TYPE_UNKNOWN, 0};
+	packet->fragment_id = 0;
 }
 
 struct ipv6_ext_2byte {
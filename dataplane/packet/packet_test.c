@@ -0,0 +1,231 @@
+#include "packet.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
+
+/*
+ * Packets are built in heap mbufs with the packet metadata in the private
+ * area. Each packet is parsed with the packet type of the case and checked
+ * against the expected headers and against parse_packet of the same
+ * packet, so the packet type path never differs from the software walk.
+ */
+#define TEST_DATA_SIZE 256
+#define TEST_TRANSPORT_SIZE 20
+#define TEST_SRC_PORT 1234
+#define TEST_DST_PORT 80
+#define TEST_VLAN 100
+#define TEST_FRAGMENT_ID 0x1234
+
+#define TEST_PTYPE(l2, l3, l4) (RTE_PTYPE_##l2 | RTE_PTYPE_##l3 | RTE_PTYPE_##l4)
+
+struct test_mbuf {
+	struct rte_mbuf mbuf;
+	struct packet packet;
+	uint8_t data[TEST_DATA_SIZE];
+};
+
+struct test_case {
+	const char *name;
+	uint32_t ptype;
+	// Length hints of the PMD, zero if not filled
+	uint8_t l2_len;
+	uint16_t l3_len;
+
+	bool vlan;
+	bool ipv6;
+	uint8_t proto;
+	// Bytes of IPv4 options or of the IPv6 hop-by-hop extension
+	uint8_t options;
+	// IPv4 fragment offset field
+	uint16_t fragment;
+
+	uint16_t transport_offset;
+	uint16_t flags;
+};
+
+static const struct test_case test_cases[] = {
+	{"ipv4 tcp", TEST_PTYPE(L2_ETHER, L3_IPV4, L4_TCP), 0, 0,
+	 false, false, IPPROTO_TCP, 0, 0, 34, 0},
+	{"ipv4 udp with hints", TEST_PTYPE(L2_ETHER, L3_IPV4, L4_UDP), 14, 20,
+	 false, false, IPPROTO_UDP, 0, 0, 34, 0},
+	{"ipv6 tcp", TEST_PTYPE(L2_ETHER, L3_IPV6, L4_TCP), 0, 0,
+	 false, true, IPPROTO_TCP, 0, 0, 54, 0},
+	{"ipv6 udp with hints", TEST_PTYPE(L2_ETHER, L3_IPV6, L4_UDP), 14, 40,
+	 false, true, IPPROTO_UDP, 0, 0, 54, 0},
+
+	// Hints disagreeing with the packet type are not trusted
+	{"ipv4 options under l3 hint", TEST_PTYPE(L2_ETHER, L3_IPV4, L4_TCP),
+	 14, 24, false, false, IPPROTO_TCP, 4, 0, 38,
+	 NETWORK_FLAG_HAS_EXTENSION},
+	{"vlan under l2 hint", TEST_PTYPE(L2_ETHER, L3_IPV4, L4_UDP), 18, 20,
+	 true, false, IPPROTO_UDP, 0, 0, 38, 0},
+
+	// Packet types other than plain TCP/UDP fall back to parse_packet
+	{"ipv4 first fragment", TEST_PTYPE(L2_ETHER, L3_IPV4, L4_FRAG), 0, 0,
+	 false, false, IPPROTO_UDP, 0, RTE_IPV4_HDR_MF_FLAG, 34,
+	 NETWORK_FLAG_FRAGMENT},
+	{"ipv4 non-first fragment", TEST_PTYPE(L2_ETHER, L3_IPV4, L4_FRAG), 0, 0,
+	 false, false, IPPROTO_UDP, 0, 16, 34,
+	 NETWORK_FLAG_FRAGMENT | NETWORK_FLAG_NOT_FIRST_FRAGMENT},
+	{"vlan", TEST_PTYPE(L2_ETHER_VLAN, L3_IPV6, L4_TCP), 0, 0,
+	 true, true, IPPROTO_TCP, 0, 0, 58, 0},
+	{"ipv6 extension", TEST_PTYPE(L2_ETHER, L3_IPV6_EXT, L4_UDP), 0, 0,
+	 false, true, IPPROTO_UDP, 8, 0, 62, NETWORK_FLAG_HAS_EXTENSION},
+};
+
+static void
+test_build(struct test_mbuf *test, const struct test_case *test_case)
+{
+	uint8_t *data = test->data;
+	memset(data, 0, TEST_DATA_SIZE);
+
+	uint16_t network_type = test_case->ipv6 ? RTE_ETHER_TYPE_IPV6
+						: RTE_ETHER_TYPE_IPV4;
+	struct rte_ether_hdr *ether = (struct rte_ether_hdr *)data;
+	uint32_t offset = sizeof(struct rte_ether_hdr);
+	if (test_case->vlan) {
+		ether->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN);
+		struct rte_vlan_hdr *vlan =
+			(struct rte_vlan_hdr *)(data + offset);
+		vlan->vlan_tci = rte_cpu_to_be_16(TEST_VLAN);
+		vlan->eth_proto = rte_cpu_to_be_16(network_type);
+		offset += sizeof(struct rte_vlan_hdr);
+	} else {
+		ether->ether_type = rte_cpu_to_be_16(network_type);
+	}
+
+	if (test_case->ipv6) {
+		struct rte_ipv6_hdr *ipv6 = (struct rte_ipv6_hdr *)(data + offset);
+		ipv6->vtc_flow = rte_cpu_to_be_32(6 << 28);
+		ipv6->payload_len = rte_cpu_to_be_16(
+			test_case->options + TEST_TRANSPORT_SIZE);
+		ipv6->proto = test_case->options ? IPPROTO_HOPOPTS
+						 : test_case->proto;
+		ipv6->hop_limits = 64;
+		memset(ipv6->src_addr, 0x11, sizeof(ipv6->src_addr));
+		memset(ipv6->dst_addr, 0x22, sizeof(ipv6->dst_addr));
+		offset += sizeof(struct rte_ipv6_hdr);
+
+		if (test_case->options) {
+			struct ipv6_ext_2byte *ext =
+				(struct ipv6_ext_2byte *)(data + offset);
+			ext->next_type = test_case->proto;
+			ext->size = test_case->options / 8 - 1;
+		}
+	} else {
+		struct rte_ipv4_hdr *ipv4 = (struct rte_ipv4_hdr *)(data + offset);
+		uint32_t header_size =
+			sizeof(struct rte_ipv4_hdr) + test_case->options;
+		ipv4->version_ihl = 0x40 | header_size / 4;
+		ipv4->total_length =
+			rte_cpu_to_be_16(header_size + TEST_TRANSPORT_SIZE);
+		ipv4->packet_id = rte_cpu_to_be_16(TEST_FRAGMENT_ID);
+		ipv4->fragment_offset = rte_cpu_to_be_16(test_case->fragment);
+		ipv4->time_to_live = 64;
+		ipv4->next_proto_id = test_case->proto;
+		ipv4->src_addr = rte_cpu_to_be_32(0x0a000001);
+		ipv4->dst_addr = rte_cpu_to_be_32(0x0a000002);
+		offset += sizeof(struct rte_ipv4_hdr);
+	}
+	offset += test_case->options;
+
+	// Ports are at the same place of TCP and UDP headers
+	struct rte_udp_hdr *udp = (struct rte_udp_hdr *)(data + offset);
+	udp->src_port = rte_cpu_to_be_16(TEST_SRC_PORT);
+	udp->dst_port = rte_cpu_to_be_16(TEST_DST_PORT);
+	offset += TEST_TRANSPORT_SIZE;
+
+	struct rte_mbuf *mbuf = &test->mbuf;
+	memset(mbuf, 0, sizeof(struct rte_mbuf));
+	mbuf->buf_addr = data;
+	mbuf->buf_len = TEST_DATA_SIZE;
+	mbuf->data_off = 0;
+	mbuf->data_len = offset;
+	mbuf->pkt_len = offset;
+	mbuf->nb_segs = 1;
+	mbuf->priv_size = PACKET_MBUF_PRIV_SIZE;
+	mbuf->packet_type = test_case->ptype;
+	mbuf->l2_len = test_case->l2_len;
+	mbuf->l3_len = test_case->l3_len;
+
+	packet_init(&test->packet);
+}
+
+static int
+test_check(struct test_mbuf *test, const struct test_case *test_case)
+{
+	test_build(test, test_case);
+	int res = parse_packet_ptype(&test->packet);
+	struct packet result = test->packet;
+
+	packet_init(&test->packet);
+	int expected_res = parse_packet(&test->packet);
+	const struct packet *expected = &test->packet;
+
+	uint16_t network_type = test_case->ipv6 ? RTE_ETHER_TYPE_IPV6
+						: RTE_ETHER_TYPE_IPV4;
+	uint16_t src_port = rte_cpu_to_be_16(TEST_SRC_PORT);
+	uint16_t dst_port = rte_cpu_to_be_16(TEST_DST_PORT);
+	// Non-first fragments carry no ports
+	if (test_case->flags & NETWORK_FLAG_NOT_FIRST_FRAGMENT) {
+		src_port = 0;
+		dst_port = 0;
+	}
+
+	if (res || expected_res ||
+	    result.network_header.type != rte_cpu_to_be_16(network_type) ||
+	    result.network_header.offset !=
+		    (test_case->vlan ? 18 : 14) ||
+	    result.transport_header.type != test_case->proto ||
+	    result.transport_header.offset != test_case->transport_offset ||
+	    result.flags != test_case->flags ||
+	    result.vlan != (test_case->vlan ? TEST_VLAN : 0) ||
+	    result.flow_key.src_port != src_port ||
+	    result.flow_key.dst_port != dst_port) {
+		fprintf(stderr, "%s: unexpected headers\n", test_case->name);
+		return -1;
+	}
+
+	if (memcmp(&result.flow_key, &expected->flow_key,
+		   sizeof(struct packet_flow_key)) ||
+	    result.network_header.type != expected->network_header.type ||
+	    result.network_header.offset != expected->network_header.offset ||
+	    result.transport_header.type != expected->transport_header.type ||
+	    result.transport_header.offset !=
+		    expected->transport_header.offset ||
+	    result.flags != expected->flags ||
+	    result.vlan != expected->vlan ||
+	    result.fragment_id != expected->fragment_id) {
+		fprintf(stderr, "%s: differs from parse_packet\n",
+			test_case->name);
+		return -1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	(void) argc;
+	(void) argv;
+
+	struct test_mbuf *test = (struct test_mbuf *)
+		aligned_alloc(RTE_CACHE_LINE_SIZE, sizeof(struct test_mbuf));
+	if (test == NULL)
+		return -1;
+
+	int res = 0;
+	for (uint32_t idx = 0;
+	     idx < sizeof(test_cases) / sizeof(test_cases[0]);
+	     ++idx) {
+		if (test_check(test, test_cases + idx))
+			res = -1;
+	}
+
+	free(test);
+	return res;
+}
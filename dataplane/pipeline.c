@@ -1,13 +1,16 @@
 #include "pipeline.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "module.h"
 
 int
-pipeline_init(struct pipeline *pipeline)
+pipeline_init(struct pipeline *pipeline, struct epoch *epoch)
 {
-	pipeline->module_configs = NULL;
+	pipeline->graph = NULL;
+	pipeline->epoch = epoch;
 
 	return 0;
 }
@@ -19,22 +22,35 @@ pipeline_process(
 {
 	pipeline_front->pipeline = pipeline;
 
-	/*
-	 * TODO: 8-byte aligned read and write should be atomic but we
-	 * have to ensure it.
-	 */
-	for (struct pipeline_module_config *module_config = pipeline->module_configs;
-             module_config != NULL;
-	     module_config = module_config->next) {
-
-		// Connect previous output to the next input. */
-		pipeline_front_switch(pipeline_front);
+	// The graph is kept until the worker passes a quiescent point
+	const struct pipeline_graph *graph =
+		__atomic_load_n(&pipeline->graph, __ATOMIC_ACQUIRE);
+	if (graph == NULL)
+		return;
+	pipeline_front->node_count = graph->node_count;
+
+	for (uint32_t idx = 0; idx < graph->node_count; ++idx) {
+		struct packet_vector *input = pipeline_front->vectors + idx;
+		if (input->count == 0)
+			continue;
+
+		// Connect the node input and edges to the front
+		const struct pipeline_module_config *node = graph->nodes + idx;
+		pipeline_front->input = input;
+		pipeline_front->edge_count = node->edge_count;
+		for (uint32_t edge = 0; edge < node->edge_count; ++edge) {
+			pipeline_front->edges[edge] =
+				pipeline_front->vectors + node->edges[edge];
+		}
 
 		// Invoke module instance.
-		module_process(
-			module_config->module, module_config->config,
-			pipeline_front);
+		module_process(node->module, node->config, pipeline_front);
+
+		packet_vector_init(input);
 	}
+
+	pipeline_front->input = NULL;
+	pipeline_front->edge_count = 0;
 }
 
 /*
@@ -47,10 +63,13 @@ pipeline_find_module_config(
 	const char *module_name,
 	const char *config_name)
 {
+	struct pipeline_graph *graph = pipeline->graph;
+	if (graph == NULL)
+		return NULL;
+
 	//FIXME: linear scan is not the best choice but is enough right now.
-	for (struct pipeline_module_config *module_config = pipeline->module_configs;
-             module_config != NULL;
-	     module_config = module_config->next) {
+	for (uint32_t idx = 0; idx < graph->node_count; ++idx) {
+		struct pipeline_module_config *module_config = graph->nodes + idx;
 		const struct module *module = module_config->module;
 		const struct module_config *config = module_config->config;
 
@@ -62,27 +81,118 @@ pipeline_find_module_config(
 	return NULL;
 }
 
+static bool
+pipeline_graph_has_config(
+	const struct pipeline_graph *graph,
+	uint32_t count,
+	const struct module_config *config)
+{
+	for (uint32_t idx = 0; idx < count; ++idx) {
+		if (graph->nodes[idx].config == config)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * The routine frees the graph along with module configurations not
+ * referenced by the keep graph which may be NULL.
+ */
+static void
+pipeline_graph_free(
+	struct pipeline_graph *graph,
+	const struct pipeline_graph *keep)
+{
+	for (uint32_t idx = 0; idx < graph->node_count; ++idx) {
+		struct pipeline_module_config *node = graph->nodes + idx;
+
+		// Instances may be listed twice
+		if (pipeline_graph_has_config(graph, idx, node->config))
+			continue;
+		if (keep != NULL &&
+		    pipeline_graph_has_config(keep, keep->node_count, node->config))
+			continue;
+		module_config_free(node->module, node->config);
+	}
+	free(graph);
+}
+
+/*
+ * The routine resolves edges of the node to indices of following nodes
+ * looking them up by configuration names.
+ */
+static int
+pipeline_resolve_edges(
+	struct pipeline_module_config_data *module_config_datas,
+	uint32_t config_size,
+	uint32_t node_idx,
+	struct pipeline_module_config *node)
+{
+	struct pipeline_module_config_data *module_config_data =
+		module_config_datas + node_idx;
+
+	if (module_config_data->edge_count > PIPELINE_NODE_EDGE_MAX)
+		return -1;
+
+	if (module_config_data->edge_count == 0) {
+		node->edge_count = 1;
+		node->edges[0] = node_idx + 1;
+		return 0;
+	}
+
+	node->edge_count = module_config_data->edge_count;
+	for (uint32_t edge = 0; edge < node->edge_count; ++edge) {
+		const char *name = module_config_data->edges[edge];
+		if (name == NULL) {
+			node->edges[edge] = config_size;
+			continue;
+		}
+
+		// Edges leading backward would break one pass processing
+		uint32_t target;
+		for (target = node_idx + 1; target < config_size; ++target) {
+			if (!strncmp(name,
+				     module_config_datas[target].config_name,
+				     MODULE_CONFIG_NAME_LEN))
+				break;
+		}
+		if (target == config_size)
+			return -1;
+		node->edges[edge] = target;
+	}
+	return 0;
+}
+
 int
 pipeline_configure(
 	struct pipeline *pipeline,
 	struct pipeline_module_config_data *module_config_datas,
 	uint32_t config_size) {
 
+	if (config_size > PIPELINE_NODE_MAX) {
+		return -1;
+	}
+
 	/*
-	 * New pipeline configuration chain placed into continuous
-	 * memory chunk.
+	 * New pipeline graph placed into continuous memory chunk.
 	 */
-	struct pipeline_module_config *first_module_config =
-		(struct pipeline_module_config *)malloc(sizeof(struct pipeline_module_config) * config_size);
-	if (first_module_config == NULL) {
+	struct pipeline_graph *graph = (struct pipeline_graph *)malloc(
+		sizeof(struct pipeline_graph) +
+		sizeof(struct pipeline_module_config) * config_size);
+	if (graph == NULL) {
 		return -1;
 	}
-
-	struct pipeline_module_config *last_module_config = first_module_config;
+	graph->node_count = 0;
 
 	for (uint32_t idx = 0; idx < config_size; ++idx) {
 		struct pipeline_module_config_data *module_config_data =
 			module_config_datas + idx;
+		struct pipeline_module_config *node = graph->nodes + idx;
+
+		if (pipeline_resolve_edges(
+			module_config_datas, config_size, idx, node)) {
+			goto error;
+		}
 
 		// Module handle and existing configuration
 		struct module *module = NULL;
@@ -94,7 +204,7 @@ pipeline_configure(
 		 *    the module is in duty to preserve existing runtime
 		 *    values, tables, counters, etc.
 		 *  - if not found create new module instance and insert into
-		 *    th chain.
+		 *    th graph.
 		 */
 		struct pipeline_module_config *configured =
 			pipeline_find_module_config(
@@ -113,32 +223,33 @@ pipeline_configure(
 
 		if (module_configure(
 			module, module_config_data->data,
-			config, &last_module_config->config)) {
+			config, &node->config)) {
 			goto error;
 		}
 
-		last_module_config->module = configured->module;
-		last_module_config->next = last_module_config + 1;
-		++last_module_config;
+		node->module = module;
+		++graph->node_count;
 	}
 
 	/*
 	 * Now all modules are configured so it is high time to replace
-	 * the pipeline chain.
+	 * the pipeline graph. Workers may still process fronts with the
+	 * previous graph so it is freed after each worker passed a
+	 * quiescent point.
 	 */
-	pipeline->module_configs = first_module_config;
-	//FIXME: free the previous pipeline module chain
+	struct pipeline_graph *old_graph = pipeline->graph;
+	__atomic_store_n(&pipeline->graph, graph, __ATOMIC_RELEASE);
+
+	if (old_graph != NULL) {
+		epoch_synchronize(pipeline->epoch);
+		pipeline_graph_free(old_graph, graph);
+	}
 
 	return 0;
 
 error:
-	for (struct pipeline_module_config *module_config = first_module_config;
-	     module_config != last_module_config;
-	     module_config = module_config->next) {
-
-		//FIXME: free module config
-	}
-
+	// Configurations created for the graph were never published
+	pipeline_graph_free(graph, pipeline->graph);
 
 	return -1;
 }
@@ -1,59 +1,133 @@
 #ifndef PIPELINE_H
 #define PIPELINE_H
 
+#include "epoch.h"
+#include "filter_cache.h"
+#include "fragment_cache.h"
 #include "module.h"
 #include "packet/packet.h"
 
 struct pipeline;
 
+// Limits of pipeline graph nodes and edges of a node
+#define PIPELINE_NODE_MAX 16
+#define PIPELINE_NODE_EDGE_MAX 8
+
 /*
  * The structure enumerated packets processed by pipeline modules.
- * Each module reads a packet from an input list and then writes result to
- * an output list or bypass the pipeline landing the packet to a drop list.
+ * Each pipeline node has its own input vector. A module reads packets from
+ * the input vector of its node and then writes results to vectors of the
+ * node edges or bypass the pipeline landing the packet to a drop vector.
+ * The edge 0 is the node output and outputs to edges not connected are
+ * dropped.
  *
- * Before module invocation input and output exchange packets so ouptut of
- * one module connects with input of the following.
+ * Input vectors follow node order and the vector after the last node one
+ * is the TX input.
  *
  * RX and TX are considered as separated stages of packet processing working
- * before and after pipeline processing.
+ * before and after pipeline processing: RX outputs to the first node input.
  */
 struct pipeline_front {
-	struct packet_list input;
-	struct packet_list output;
-	struct packet_list drop;
+	struct packet_vector *input;
+	uint32_t edge_count;
+	struct packet_vector *edges[PIPELINE_NODE_EDGE_MAX];
+	struct packet_vector drop;
 	// TODO: check the field is required
 	struct pipeline *pipeline;
+
+	// Verdict caches of the worker running the front or NULL
+	struct filter_cache *filter_cache;
+	struct fragment_cache *fragment_cache;
+	// Time of the front in TSC cycles for fragment cache timeouts
+	uint64_t now;
+
+	uint32_t node_count;
+	struct packet_vector vectors[PIPELINE_NODE_MAX + 1];
 };
 
 static inline void
 pipeline_front_init(struct pipeline_front *pipeline_front)
 {
-	packet_list_init(&pipeline_front->input);
-	packet_list_init(&pipeline_front->output);
-	packet_list_init(&pipeline_front->drop);
+	pipeline_front->input = NULL;
+	pipeline_front->edge_count = 1;
+	pipeline_front->edges[0] = pipeline_front->vectors;
+	packet_vector_init(&pipeline_front->drop);
+	pipeline_front->pipeline = NULL;
+	pipeline_front->filter_cache = NULL;
+	pipeline_front->fragment_cache = NULL;
+	pipeline_front->now = 0;
+
+	pipeline_front->node_count = 0;
+	for (uint32_t idx = 0; idx <= PIPELINE_NODE_MAX; ++idx)
+		packet_vector_init(pipeline_front->vectors + idx);
 }
 
+/*
+ * The routine drops the packet. The packet is freed at once if the drop
+ * vector is full.
+ */
 static inline void
-pipeline_front_output(
+pipeline_front_drop(
 	struct pipeline_front *pipeline_front,
 	struct packet *packet)
 {
-	packet_list_add(&pipeline_front->output, packet);
+	if (packet_vector_add(&pipeline_front->drop, packet))
+		rte_pktmbuf_free(packet_to_mbuf(packet));
 }
 
+/*
+ * The routine passes the packet to the node the edge leads to, packets
+ * over the vector capacity are dropped.
+ */
 static inline void
-pipeline_front_drop(
+pipeline_front_output_edge(
 	struct pipeline_front *pipeline_front,
+	uint32_t edge,
 	struct packet *packet)
 {
-	packet_list_add(&pipeline_front->drop, packet);
+	if (edge >= pipeline_front->edge_count ||
+	    packet_vector_add(pipeline_front->edges[edge], packet))
+		pipeline_front_drop(pipeline_front, packet);
 }
 
 static inline void
-pipeline_front_switch(struct pipeline_front *pipeline_front)
+pipeline_front_output(
+	struct pipeline_front *pipeline_front,
+	struct packet *packet)
 {
-	pipeline_front->input = pipeline_front->output;
-	packet_list_init(&pipeline_front->output);
+	pipeline_front_output_edge(pipeline_front, 0, packet);
+}
+
+/*
+ * The routine processes the packet by the filter through the verdict caches
+ * of the worker running the front, so modules share caches of the worker.
+ * Fragments go through the fragment cache so later ones get the verdict
+ * of the first fragment.
+ */
+static inline uint32_t
+pipeline_front_filter(
+	struct pipeline_front *pipeline_front,
+	struct filter *filter,
+	struct packet *packet)
+{
+	if (packet->flags & NETWORK_FLAG_FRAGMENT) {
+		if (pipeline_front->fragment_cache == NULL)
+			return filter_process(filter, packet);
+		return fragment_cache_process(
+			pipeline_front->fragment_cache, filter, packet,
+			pipeline_front->now);
+	}
+
+	if (pipeline_front->filter_cache == NULL)
+		return filter_process(filter, packet);
+	return filter_cache_process(
+		pipeline_front->filter_cache, filter, packet);
+}
+
+static inline struct packet_vector *
+pipeline_front_tx(struct pipeline_front *pipeline_front)
+{
+	return pipeline_front->vectors + pipeline_front->node_count;
 }
 
 /*
@@ -65,6 +139,13 @@ struct pipeline_module_config_data {
 	char module_name[MODULE_NAME_LEN];
 	char config_name[MODULE_CONFIG_NAME_LEN];
 	const void *data;
+	/*
+	 * Edges are named by configuration names of following instances,
+	 * NULL name leads to TX. No edges means the only edge to the next
+	 * instance or to TX for the last one.
+	 */
+	uint32_t edge_count;
+	const char *edges[PIPELINE_NODE_EDGE_MAX];
 };
 
 struct pipeline_module_config;
@@ -77,35 +158,74 @@ struct pipeline_module_config;
  * Each module could have multiple instances differing in configuration
  * runtime parameters and data so the module configuration contains all data
  * required to manage the module instance.
+ *
+ * The instance is a node of the pipeline graph and its edges are indices
+ * of following nodes, the node count index is TX.
  */
 struct pipeline_module_config {
-	struct pipeline_module_config *next;
 	struct module *module;
 	struct module_config *config;
+	uint32_t edge_count;
+	uint32_t edges[PIPELINE_NODE_EDGE_MAX];
+};
+
+/*
+ * Pipeline graph nodes are sorted so edges lead forward only. So one pass
+ * over nodes runs each node once per pipeline front with all packets
+ * the preceding nodes passed to it.
+ */
+struct pipeline_graph {
+	uint32_t node_count;
+	struct pipeline_module_config nodes[];
 };
 
 /*
- * Pipeline contains module instances list calling one by one for
- * each pipeline front of packets.
+ * Pipeline contains the graph of module instances run for each pipeline
+ * front of packets.
+ *
+ * The graph is published with release semantics and workers take it with
+ * acquire once per front. Workers announce quiescent points of the epoch
+ * between bursts, so the replaced graph and module configurations are
+ * freed once each worker passed one.
  **/
 struct pipeline {
-	struct pipeline_module_config *module_configs;
+	struct pipeline_graph *graph;
+	struct epoch *epoch;
 };
 
 
+/*
+ * Pipeline map binds logical devices to pipelines so virtual routers with
+ * different configurations share workers. Packets of a logical device are
+ * processed by the pipeline the device is bound to and packets of unbound
+ * devices are dropped.
+ */
+struct pipeline_map {
+	uint32_t pipeline_count;
+	struct pipeline **pipelines;
+	uint32_t device_count;
+	// Pipeline index of each logical device
+	const uint16_t *device_pipelines;
+	// Epoch shared by pipelines and workers of the map
+	struct epoch *epoch;
+};
+
 struct pipeline *
 pipeline_create();
 
 int
-pipeline_init(struct pipeline *pipeline);
+pipeline_init(struct pipeline *pipeline, struct epoch *epoch);
 
 /*
  * Pipeline configuration routine.
- * The function rebuilds the pipeline with new module list and module
- * configuration.
+ * The function rebuilds the pipeline with new module graph and module
+ * configuration. Instances are listed in the node order and edges must
+ * lead forward.
  *
  * NOTE:
- * Pipeline front processing shoulnd not be affected by the routine.
+ * Pipeline front processing is not affected by the routine: fronts in
+ * flight complete with the previous graph while the routine waits for
+ * them to free it.
  */
 int
 pipeline_configure(
@@ -114,12 +234,13 @@ pipeline_configure(
 	uint32_t config_size);
 
 /*
- * Drives piepline front through pipeline modules.
+ * Drives piepline front through pipeline graph. Nodes without input
+ * packets are skipped.
  *
- * NOTE: Pipeline processing assumes all RX are placed to output list of
+ * NOTE: Pipeline processing assumes all RX are placed to output of
  * pipeline front as the RX is a stage of the pipeline. Also pipeline outputs
- * will be placed to output list and packet dropped while processing to
- * drop list.
+ * will be placed to TX vector and packet dropped while processing to
+ * drop vector.
  */
 void pipeline_process(
 	struct pipeline *pipeline,
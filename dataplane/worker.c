@@ -35,44 +35,92 @@
 
 #include "worker.h"
 
+#include "rte_cycles.h"
 #include "rte_ethdev.h"
+#include "rte_prefetch.h"
 
 #include "pipeline.h"
 
+/*
+ * Burst arrays are allocated once per worker loop. Packets of the burst
+ * are grouped by pipelines: the group of pipeline idx ends at
+ * ends[idx] and starts at the end of the previous group.
+ */
+struct worker_burst {
+	struct rte_mbuf **mbufs;
+	struct packet **packets;
+	int *results;
+	struct packet **sorted;
+	uint32_t *ends;
+};
+
 /*
  * This routine is artifact of previous worker model.
  */
 static void
-worker_read(struct worker *worker, struct pipeline_front *pipeline_front)
+worker_read(struct worker *worker, struct worker_burst *burst)
 {
-	// Allocate on-stack array and read mbufs into it
-	struct rte_mbuf **mbufs =
-		(struct rte_mbuf **)alloca(sizeof(struct rte_mbuf *) * worker->read_size);
-	if (mbufs == NULL) {
-		//TODO: log error
-		return;
-	}
+	const struct pipeline_map *pipeline_map = worker->pipeline_map;
+	struct rte_mbuf **mbufs = burst->mbufs;
+	struct packet **packets = burst->packets;
+	int *results = burst->results;
+	uint32_t *ends = burst->ends;
 
 	uint16_t rxSize = worker->read_func(
 		worker->read_data,
 	        mbufs,
 	        worker->read_size);
 
+	/*
+	 * Packets are processed in passes over the burst so memory accesses
+	 * of a pass are issued ahead with prefetches instead of one packet
+	 * waiting for its cache misses at a time.
+	 */
 	for (uint32_t rxIdx = 0; rxIdx < rxSize; ++rxIdx) {
-		// Initialize packet metadata and put it into pipeline front
+		// Metadata address is known without touching the mbuf
+		if (rxIdx + PACKET_PREFETCH_DISTANCE < rxSize)
+			rte_prefetch0(mbuf_to_packet(
+				mbufs[rxIdx + PACKET_PREFETCH_DISTANCE]));
+
 		struct packet *packet = mbuf_to_packet(mbufs[rxIdx]);
-		memset(packet, 0, sizeof(struct packet));
-		packet->mbuf = mbufs[rxIdx];
-		if (parse_packet(packet)) {
-			//TODO: should the packet be freed right now?
-			pipeline_front_drop(pipeline_front, packet);
+		packet_init(packet);
+		packets[rxIdx] = packet;
+	}
+
+	parse_packet_burst(packets, rxSize, worker->parse_ptype, results);
+
+	/*
+	 * Packets are stamped with pipelines of their logical devices and
+	 * clustered with a counting sort. The sort is stable so packets of
+	 * a flow keep their order.
+	 */
+	for (uint32_t idx = 0; idx <= pipeline_map->pipeline_count; ++idx)
+		ends[idx] = 0;
+
+	uint32_t count = 0;
+	for (uint32_t rxIdx = 0; rxIdx < rxSize; ++rxIdx) {
+		uint16_t device = mbufs[rxIdx]->port;
+		uint16_t pipeline_idx = device < pipeline_map->device_count ?
+			pipeline_map->device_pipelines[device] :
+			pipeline_map->pipeline_count;
+		if (results[rxIdx] ||
+		    pipeline_idx >= pipeline_map->pipeline_count) {
+			// No pipeline front exists yet
+			rte_pktmbuf_free(mbufs[rxIdx]);
 			continue;
 		}
 
-		pipeline_front_output(pipeline_front, packet);
+		packets[rxIdx]->pipeline_idx = pipeline_idx;
+		packets[count++] = packets[rxIdx];
+		++ends[pipeline_idx + 1];
 	}
 
-	return;
+	// Group starts which become group ends while packets are placed
+	for (uint32_t idx = 0; idx < pipeline_map->pipeline_count; ++idx)
+		ends[idx + 1] += ends[idx];
+
+	for (uint32_t idx = 0; idx < count; ++idx)
+		burst->sorted[ends[packets[idx]->pipeline_idx]++] = packets[idx];
 }
 
 /*
@@ -81,6 +129,9 @@ worker_read(struct worker *worker, struct pipeline_front *pipeline_front)
 static void
 worker_write(struct worker *worker, struct pipeline_front *pipeline_front)
 {
+	// TX is a stage taking the pipeline output as input
+	struct packet_vector *input = pipeline_front_tx(pipeline_front);
+
 	/*
 	 * Allocate on-stack array to put packet into it before
 	 * submitting to a device
@@ -89,36 +140,31 @@ worker_write(struct worker *worker, struct pipeline_front *pipeline_front)
 		(struct rte_mbuf **)alloca(sizeof(struct rte_mbuf *) * worker->write_size);
 	if (mbufs == NULL) {
 		//TODO: log error
-		for (struct packet *packet = packet_list_first(&pipeline_front->input);
-		     packet != NULL;
-		     packet = packet->next) {
-			pipeline_front_drop(pipeline_front, packet);
-		}
+		for (uint32_t idx = 0; idx < input->count; ++idx)
+			pipeline_front_drop(pipeline_front, input->packets[idx]);
 
 		return;
 	}
 
-	uint16_t txSize = 0;
-	for (struct packet *packet = packet_list_first(&pipeline_front->input);
-	     packet != NULL;
-	     packet = packet->next) {
+	for (uint32_t first = 0; first < input->count; first += worker->write_size) {
+		uint16_t txSize = worker->write_size;
+		if (txSize > input->count - first)
+			txSize = input->count - first;
 
-		mbufs[txSize++] = packet_to_mbuf(packet);
-		if (txSize < worker->write_size &&
-		    packet->next != NULL)
-			continue;
+		for (uint16_t txIdx = 0; txIdx < txSize; ++txIdx)
+			mbufs[txIdx] = packet_to_mbuf(input->packets[first + txIdx]);
 
-		// On stack array is full or last packet is ready
 		uint16_t sent = worker->write_func(
 			worker->write_data,
 		        mbufs,
 			txSize);
 
 		for (uint16_t dropIdx = sent; dropIdx < txSize; ++dropIdx) {
-			// Move packet in drop list in case of TX error
-			pipeline_front_drop(pipeline_front, mbuf_to_packet(mbufs[dropIdx]));
+			// Move packet in drop vector in case of TX error
+			pipeline_front_drop(
+				pipeline_front,
+				input->packets[first + dropIdx]);
 		}
-		txSize = 0;
 	}
 }
 
@@ -127,50 +173,118 @@ worker_drop(struct worker *worker, struct pipeline_front *pipeline_front)
 {
 	(void) worker;
 
-	for (struct packet *packet = packet_list_first(&pipeline_front->drop);
-	     packet != NULL;
-	     packet = packet->next) {
-		struct rte_mbuf *mbuf = packet_to_mbuf(packet);
-		rte_pktmbuf_free(mbuf);
-	}
+	struct packet_vector *drop = &pipeline_front->drop;
+	for (uint32_t idx = 0; idx < drop->count; ++idx)
+		rte_pktmbuf_free(packet_to_mbuf(drop->packets[idx]));
 }
 
 static void
-worker_loop(struct worker *worker, struct pipeline *pipeline)
+worker_loop(struct worker *worker)
 {
+	const struct pipeline_map *pipeline_map = worker->pipeline_map;
+
+	// Allocate on-stack arrays reused by each burst
+	struct worker_burst burst;
+	burst.mbufs =
+		(struct rte_mbuf **)alloca(sizeof(struct rte_mbuf *) * worker->read_size);
+	burst.packets =
+		(struct packet **)alloca(sizeof(struct packet *) * worker->read_size);
+	burst.results = (int *)alloca(sizeof(int) * worker->read_size);
+	burst.sorted =
+		(struct packet **)alloca(sizeof(struct packet *) * worker->read_size);
+	burst.ends = (uint32_t *)alloca(
+		sizeof(uint32_t) * (pipeline_map->pipeline_count + 1));
+	if (burst.mbufs == NULL || burst.packets == NULL ||
+	    burst.results == NULL || burst.sorted == NULL ||
+	    burst.ends == NULL) {
+		//TODO: log error
+		return;
+	}
+
+	struct pipeline_front pipeline_front;
+
 	/*
 	 * The worker loop is simple and consists of following stages:
 	 * - read
 	 * - process
 	 * - write
 	 * - drop
+	 * where the read burst is processed as a separate pipeline front for
+	 * each pipeline. No pipeline data is referenced between bursts so
+	 * each burst starts with a quiescent point.
 	 */
 	while (!worker->stop) {
-		struct pipeline_front pipeline_front;
-		pipeline_front_init(&pipeline_front);
+		epoch_quiescent(pipeline_map->epoch, worker->epoch_idx);
+
+		worker_read(worker, &burst);
+		uint64_t now = rte_rdtsc();
 
-		worker_read(worker, &pipeline_front);
-		pipeline_process(pipeline, &pipeline_front);
-		worker_write(worker, &pipeline_front);
-		worker_drop(worker, &pipeline_front);
+		uint32_t first = 0;
+		for (uint32_t idx = 0; idx < pipeline_map->pipeline_count; ++idx) {
+			uint32_t last = burst.ends[idx];
+			if (first == last)
+				continue;
+
+			pipeline_front_init(&pipeline_front);
+			pipeline_front.filter_cache = &worker->filter_cache;
+			pipeline_front.fragment_cache = &worker->fragment_cache;
+			pipeline_front.now = now;
+			for (uint32_t pos = first; pos < last; ++pos) {
+				pipeline_front_output(
+					&pipeline_front, burst.sorted[pos]);
+			}
+
+			pipeline_process(
+				pipeline_map->pipelines[idx], &pipeline_front);
+			worker_write(worker, &pipeline_front);
+			worker_drop(worker, &pipeline_front);
+			first = last;
+		}
 	}
+
+	epoch_offline(pipeline_map->epoch, worker->epoch_idx);
 }
 
 void
 worker_exec(
-	struct pipeline *pipeline,
+	const struct pipeline_map *pipeline_map,
+	uint32_t epoch_idx,
 	worker_read_func read_func, void *read_data,
-	worker_write_func write_func, void *write_data)
+	worker_write_func write_func, void *write_data,
+	bool parse_ptype)
 {
 	struct worker worker;
 
+	worker.pipeline_map = pipeline_map;
+	worker.epoch_idx = epoch_idx;
+
+	// Read burst must fit into the pipeline front vector
 	worker.read_size = 16;
 	worker.read_func = read_func;
 	worker.read_data = read_data;
+	worker.parse_ptype = parse_ptype;
 
 	worker.write_size = 16;
 	worker.write_func = write_func;
 	worker.write_data = write_data;
 
-	worker_loop(&worker, pipeline);
+	worker.stop = false;
+
+	if (filter_cache_init(&worker.filter_cache, WORKER_FILTER_CACHE_SETS)) {
+		//TODO: log error
+		return;
+	}
+	if (fragment_cache_init(
+		&worker.fragment_cache,
+		WORKER_FRAGMENT_CACHE_SETS,
+		rte_get_tsc_hz() * WORKER_FRAGMENT_CACHE_TIMEOUT_MS / 1000)) {
+		//TODO: log error
+		filter_cache_free(&worker.filter_cache);
+		return;
+	}
+
+	worker_loop(&worker);
+
+	fragment_cache_free(&worker.fragment_cache);
+	filter_cache_free(&worker.filter_cache);
 }
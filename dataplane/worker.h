@@ -1,9 +1,21 @@
 #ifndef WORKER_H
 #define WORKER_H
 
+#include "filter_cache.h"
+#include "fragment_cache.h"
 #include "pipeline.h"
 
-// Read callback provided by dataplane
+// Sets of the per-worker verdict caches
+#define WORKER_FILTER_CACHE_SETS 4096
+#define WORKER_FRAGMENT_CACHE_SETS 1024
+// Fragments of a datagram arrive within the timeout after the first one
+#define WORKER_FRAGMENT_CACHE_TIMEOUT_MS 1000
+
+/*
+ * Read callback provided by dataplane. The dataplane is responsible for
+ * mapping devices so it stores logical device identifier of each read mbuf
+ * into the mbuf port field.
+ */
 typedef uint16_t (*worker_read_func)(
 	void *data,
 	struct rte_mbuf **mbufs,
@@ -16,6 +28,10 @@ typedef uint16_t (*worker_write_func)(
 	uint16_t mbuf_count);
 
 struct worker {
+	const struct pipeline_map *pipeline_map;
+	// Worker index in the pipeline map epoch
+	uint32_t epoch_idx;
+
 	worker_read_func read_func;
 	void *read_data;
 	worker_write_func write_func;
@@ -24,14 +40,23 @@ struct worker {
 	uint16_t read_size;
 	uint16_t write_size;
 
+	// Read mbufs have packet types recognized by the PMD
+	bool parse_ptype;
+
+	// Verdict caches used by modules of each pipeline the worker runs
+	struct filter_cache filter_cache;
+	struct fragment_cache fragment_cache;
+
 	bool stop;
 
 };
 
 void
 worker_exec(
-	struct pipeline *pipeline,
+	const struct pipeline_map *pipeline_map,
+	uint32_t epoch_idx,
 	worker_read_func read_func, void *read_data,
-	worker_write_func write_func, void *write_data);
+	worker_write_func write_func, void *write_data,
+	bool parse_ptype);
 
 #endif
@@ -0,0 +1,215 @@
+#ifndef FILTER_ACTION_LIST_H
+#define FILTER_ACTION_LIST_H
+
+/*
+ * Action list registry interns lists of rule actions. Each list is
+ * identified by an unsigned value and denoted by its parent list and the
+ * last action appended, so lists form a prefix tree with the empty list
+ * as the root with zero identifier.
+ *
+ * Appending an action to a list returns identifier of the child list
+ * creating it only if there is no such one. So identical lists always
+ * share the same identifier and the registry size is proportional to the
+ * count of distinct lists.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ACTION_LIST_EMPTY 0
+#define ACTION_LIST_INVALID 0xffffffff
+
+struct action_list_node {
+	uint32_t parent;
+	uint32_t action;
+};
+
+struct action_list_registry {
+	struct action_list_node *nodes;
+	uint32_t node_count;
+	uint32_t node_capacity;
+
+	// Open-addressing hash of (parent, action) pairs into node ids
+	uint32_t *buckets;
+	uint32_t bucket_count;
+};
+
+static inline int
+action_list_registry_init(struct action_list_registry *registry)
+{
+	registry->node_capacity = 64;
+	registry->nodes = (struct action_list_node *)
+		malloc(sizeof(struct action_list_node) *
+		       registry->node_capacity);
+	if (registry->nodes == NULL)
+		return -1;
+
+	registry->bucket_count = 128;
+	registry->buckets = (uint32_t *)
+		malloc(sizeof(uint32_t) * registry->bucket_count);
+	if (registry->buckets == NULL) {
+		free(registry->nodes);
+		return -1;
+	}
+	memset(registry->buckets,
+	       0xff,
+	       sizeof(uint32_t) * registry->bucket_count);
+
+	// The empty list is the tree root
+	registry->nodes[ACTION_LIST_EMPTY] =
+		(struct action_list_node){ACTION_LIST_INVALID, 0};
+	registry->node_count = 1;
+
+	return 0;
+}
+
+static inline void
+action_list_registry_free(struct action_list_registry *registry)
+{
+	free(registry->buckets);
+	free(registry->nodes);
+}
+
+static inline uint32_t
+action_list_bucket(
+	const struct action_list_registry *registry,
+	uint32_t parent,
+	uint32_t action)
+{
+	uint64_t hash = (((uint64_t)parent << 32) | action) *
+			0x9e3779b97f4a7c15;
+	return (hash >> 32) & (registry->bucket_count - 1);
+}
+
+/*
+ * The routine returns bucket containing the list or the first empty
+ * bucket where the list should be placed.
+ */
+static inline uint32_t
+action_list_find(
+	const struct action_list_registry *registry,
+	uint32_t parent,
+	uint32_t action)
+{
+	uint32_t bucket = action_list_bucket(registry, parent, action);
+	while (registry->buckets[bucket] != ACTION_LIST_INVALID) {
+		const struct action_list_node *node =
+			registry->nodes + registry->buckets[bucket];
+		if (node->parent == parent && node->action == action)
+			break;
+		bucket = (bucket + 1) & (registry->bucket_count - 1);
+	}
+	return bucket;
+}
+
+static inline int
+action_list_registry_grow(struct action_list_registry *registry)
+{
+	uint32_t *buckets = (uint32_t *)
+		malloc(sizeof(uint32_t) * registry->bucket_count * 2);
+	if (buckets == NULL)
+		return -1;
+	memset(buckets, 0xff, sizeof(uint32_t) * registry->bucket_count * 2);
+
+	free(registry->buckets);
+	registry->buckets = buckets;
+	registry->bucket_count *= 2;
+
+	for (uint32_t list = 1; list < registry->node_count; ++list) {
+		const struct action_list_node *node = registry->nodes + list;
+		registry->buckets[action_list_find(
+			registry, node->parent, node->action)] = list;
+	}
+	return 0;
+}
+
+/*
+ * The routine appends the action to the list and returns identifier of
+ * the resulting list.
+ */
+static inline int
+action_list_append(
+	struct action_list_registry *registry,
+	uint32_t list,
+	uint32_t action,
+	uint32_t *child)
+{
+	uint32_t bucket = action_list_find(registry, list, action);
+	if (registry->buckets[bucket] != ACTION_LIST_INVALID) {
+		*child = registry->buckets[bucket];
+		return 0;
+	}
+
+	if (registry->node_count == registry->node_capacity) {
+		struct action_list_node *nodes = (struct action_list_node *)
+			realloc(registry->nodes,
+				sizeof(struct action_list_node) *
+				registry->node_capacity * 2);
+		if (nodes == NULL)
+			return -1;
+		registry->nodes = nodes;
+		registry->node_capacity *= 2;
+	}
+
+	if ((registry->node_count + 1) * 2 > registry->bucket_count) {
+		if (action_list_registry_grow(registry))
+			return -1;
+		bucket = action_list_find(registry, list, action);
+	}
+
+	*child = registry->node_count++;
+	registry->nodes[*child] = (struct action_list_node){list, action};
+	registry->buckets[bucket] = *child;
+	return 0;
+}
+
+/*
+ * The routine returns identifier of the list with the action appended or
+ * ACTION_LIST_INVALID if there is no such list. Unlike appending the
+ * routine does not modify the registry.
+ */
+static inline uint32_t
+action_list_child(
+	const struct action_list_registry *registry,
+	uint32_t list,
+	uint32_t action)
+{
+	return registry->buckets[action_list_find(registry, list, action)];
+}
+
+static inline uint32_t
+action_list_registry_count(const struct action_list_registry *registry)
+{
+	return registry->node_count;
+}
+
+static inline uint64_t
+action_list_registry_size(const struct action_list_registry *registry)
+{
+	return (uint64_t)registry->node_capacity *
+		       sizeof(struct action_list_node) +
+	       (uint64_t)registry->bucket_count * sizeof(uint32_t);
+}
+
+/*
+ * The routine returns the last action of a non-empty list.
+ */
+static inline uint32_t
+action_list_last(const struct action_list_registry *registry, uint32_t list)
+{
+	return registry->nodes[list].action;
+}
+
+/*
+ * The routine returns the list without its last action.
+ */
+static inline uint32_t
+action_list_parent(
+	const struct action_list_registry *registry,
+	uint32_t list)
+{
+	return registry->nodes[list].parent;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef FILTER_ARENA_H
+#define FILTER_ARENA_H
+
+/*
+ * Arena allocates short-living scratch from big blocks. Allocations are
+ * never freed one by one: the arena is either rewound to a mark taken
+ * earlier, releasing everything allocated after the mark, or dropped as
+ * a whole.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+struct arena_block {
+	struct arena_block *prev;
+	size_t size;
+	size_t used;
+};
+
+// Block data follows the aligned block header
+#define ARENA_BLOCK_HEADER_SIZE \
+	((sizeof(struct arena_block) + ARENA_ALIGN - 1) & \
+	 ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena {
+	// The last block, allocations are taken from it only
+	struct arena_block *block;
+	size_t block_size;
+};
+
+struct arena_mark {
+	struct arena_block *block;
+	size_t used;
+};
+
+static inline void
+arena_init(struct arena *arena, size_t block_size)
+{
+	arena->block = NULL;
+	arena->block_size = block_size;
+}
+
+static inline void *
+arena_block_data(struct arena_block *block)
+{
+	return (uint8_t *)block + ARENA_BLOCK_HEADER_SIZE;
+}
+
+static inline void *
+arena_alloc(struct arena *arena, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	struct arena_block *block = arena->block;
+	if (block == NULL || block->size - block->used < size) {
+		size_t block_size = arena->block_size;
+		if (block_size < size)
+			block_size = size;
+		block = (struct arena_block *)malloc(
+			ARENA_BLOCK_HEADER_SIZE + block_size);
+		if (block == NULL)
+			return NULL;
+		block->prev = arena->block;
+		block->size = block_size;
+		block->used = 0;
+		arena->block = block;
+	}
+
+	void *data = (uint8_t *)arena_block_data(block) + block->used;
+	block->used += size;
+	return data;
+}
+
+static inline struct arena_mark
+arena_mark(const struct arena *arena)
+{
+	struct arena_mark mark;
+	mark.block = arena->block;
+	mark.used = arena->block != NULL ? arena->block->used : 0;
+	return mark;
+}
+
+/*
+ * The routine releases allocations made after the mark freeing blocks
+ * allocated after the mark.
+ */
+static inline void
+arena_rewind(struct arena *arena, struct arena_mark mark)
+{
+	while (arena->block != mark.block) {
+		struct arena_block *prev = arena->block->prev;
+		free(arena->block);
+		arena->block = prev;
+	}
+	if (arena->block != NULL)
+		arena->block->used = mark.used;
+}
+
+static inline void
+arena_free(struct arena *arena)
+{
+	arena_rewind(arena, (struct arena_mark){NULL, 0});
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef FILTER_BITVECTOR_H
+#define FILTER_BITVECTOR_H
+
+/*
+ * Bit-vector matcher maps each classifier value of each field into a
+ * bitmap of rules containing the value. Rules matching a packet are the
+ * bitmaps of its classifier values ANDed together and the first set bits
+ * are the first matched rules. So the matcher takes
+ * fields * values * rules / 8 bytes and a lookup costs one pass through
+ * the bitmaps of the packet values at most.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "action_list.h"
+
+#define BITVECTOR_FIELD_COUNT 6
+
+struct bitvector_matcher {
+	// Bitmap of value v of field f starts at word v * word_count
+	uint64_t *fields[BITVECTOR_FIELD_COUNT];
+	uint32_t value_counts[BITVECTOR_FIELD_COUNT];
+	// Rules with terminal action
+	uint64_t *terminal;
+	uint32_t word_count;
+	uint32_t rule_count;
+};
+
+static inline void
+bitvector_matcher_free(struct bitvector_matcher *matcher)
+{
+	for (uint32_t idx = 0; idx < BITVECTOR_FIELD_COUNT; ++idx)
+		free(matcher->fields[idx]);
+	free(matcher->terminal);
+}
+
+static inline int
+bitvector_matcher_init(
+	struct bitvector_matcher *matcher,
+	uint32_t rule_count,
+	const uint32_t *value_counts)
+{
+	memset(matcher, 0, sizeof(struct bitvector_matcher));
+	matcher->rule_count = rule_count;
+	matcher->word_count = (rule_count + 63) / 64;
+
+	matcher->terminal = (uint64_t *)
+		calloc(matcher->word_count + 1, sizeof(uint64_t));
+	if (matcher->terminal == NULL)
+		return -1;
+
+	for (uint32_t idx = 0; idx < BITVECTOR_FIELD_COUNT; ++idx) {
+		matcher->value_counts[idx] = value_counts[idx];
+		matcher->fields[idx] = (uint64_t *)calloc(
+			(size_t)value_counts[idx] * matcher->word_count + 1,
+			sizeof(uint64_t));
+		if (matcher->fields[idx] == NULL) {
+			bitvector_matcher_free(matcher);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static inline uint64_t *
+bitvector_matcher_bitmap(
+	const struct bitvector_matcher *matcher,
+	uint32_t field,
+	uint32_t value)
+{
+	return matcher->fields[field] + (size_t)value * matcher->word_count;
+}
+
+static inline void
+bitvector_matcher_set(
+	struct bitvector_matcher *matcher,
+	uint32_t field,
+	uint32_t value,
+	uint32_t rule)
+{
+	bitvector_matcher_bitmap(matcher, field, value)[rule / 64] |=
+		(uint64_t)1 << (rule % 64);
+}
+
+static inline int
+bitvector_matcher_test(
+	const struct bitvector_matcher *matcher,
+	uint32_t field,
+	uint32_t value,
+	uint32_t rule)
+{
+	return (bitvector_matcher_bitmap(matcher, field, value)[rule / 64] >>
+		(rule % 64)) & 1;
+}
+
+/*
+ * The routine converts rules matching classifier values into the action
+ * list consisting of matched rules up to the first terminal one. All such
+ * lists must be registered in advance.
+ */
+static inline uint32_t
+bitvector_matcher_list(
+	const struct bitvector_matcher *matcher,
+	const struct action_list_registry *registry,
+	const uint32_t *values)
+{
+	const uint64_t *bitmaps[BITVECTOR_FIELD_COUNT];
+	for (uint32_t idx = 0; idx < BITVECTOR_FIELD_COUNT; ++idx) {
+		// Values out of any rule match nothing
+		if (values[idx] >= matcher->value_counts[idx])
+			return ACTION_LIST_EMPTY;
+		bitmaps[idx] =
+			bitvector_matcher_bitmap(matcher, idx, values[idx]);
+	}
+
+	uint32_t list = ACTION_LIST_EMPTY;
+	for (uint32_t word = 0; word < matcher->word_count; ++word) {
+		uint64_t matched = ~(uint64_t)0;
+		for (uint32_t idx = 0; idx < BITVECTOR_FIELD_COUNT; ++idx)
+			matched &= bitmaps[idx][word];
+
+		while (matched) {
+			uint64_t bit = matched & -matched;
+			list = action_list_child(
+				registry,
+				list,
+				word * 64 + __builtin_ctzll(matched));
+			if (matcher->terminal[word] & bit)
+				return list;
+			matched ^= bit;
+		}
+	}
+	return list;
+}
+
+#endif
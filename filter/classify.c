@@ -2,206 +2,257 @@
 
 #include "dataplane/packet/packet.h"
 
-#include "rte_mbuf.h"
 #include "rte_ether.h"
-#include "rte_ip.h"
-#include "rte_tcp.h"
-#include "rte_udp.h"
 
 #include "ipfw.h"
 
 #include "lpm.h"
 
+#include <endian.h>
+#include <stdbool.h>
+#include <string.h>
 
 
-uint32_t
-filter_classify_src_net_hi(
+
+/*
+ * Address chunks are looked up aligned to the most significant bits of the
+ * LPM key the same way as the chunk networks are inserted. Hosts are
+ * looked up in the host table before the LPM. Packet fields are taken from
+ * the flow key so packet headers are not touched.
+ */
+static inline uint32_t
+filter_classify_net6_chunk(
 	const struct filter *filter,
-	const struct packet *packet)
+	const struct packet *packet,
+	bool dst,
+	uint32_t chunk)
 {
-	struct rte_mbuf *mbuf = packet_to_mbuf(packet);
-
-	if (packet->network_header.type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
-		struct rte_ipv4_hdr* ipv4Header = NULL;
-		ipv4Header = rte_pktmbuf_mtod_offset(
-			mbuf,
-			struct rte_ipv4_hdr*,
-			packet->network_header.offset);
+	const struct packet_flow_key *flow_key = &packet->flow_key;
 
-		(void) ipv4Header;
+	if (flow_key->network_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6))
 		return 0;
-	}
-
-	struct rte_ipv6_hdr* ipv6Header = NULL;
-	ipv6Header = rte_pktmbuf_mtod_offset(
-		mbuf,
-		struct rte_ipv6_hdr*,
-		packet->network_header.offset);
 
 	const struct ipfw_packet_filter *ipfw_filter =
 		(const struct ipfw_packet_filter *)filter;
 
-	return lpm64_lookup(&ipfw_filter->src_net6_hi, *(uint64_t *)ipv6Header->src_addr);
+	uint32_t size = ipfw_filter->net6_chunk_width / 8;
+	const uint8_t *addr = dst ? flow_key->dst_addr : flow_key->src_addr;
+	const struct lpm64 *lpm =
+		dst ? ipfw_filter->dst_net6 : ipfw_filter->src_net6;
+	const struct host_table *hosts =
+		dst ? ipfw_filter->dst_net6_hosts : ipfw_filter->src_net6_hosts;
+
+	uint64_t key = 0;
+	memcpy(&key, addr + chunk * size, size);
+
+	uint32_t value = host_table_lookup(hosts + chunk, key);
+	if (value != HOST_TABLE_VALUE_INVALID)
+		return value;
+	return lpm64_lookup(lpm + chunk, key);
 }
 
+#define FILTER_CLASSIFY_NET6_CHUNK(name, dst, chunk)			\
+	static uint32_t							\
+	filter_classify_##name##_net6_##chunk(				\
+		const struct filter *filter,				\
+		const struct packet *packet)				\
+	{								\
+		return filter_classify_net6_chunk(			\
+			filter, packet, dst, chunk);			\
+	}
 
+FILTER_CLASSIFY_NET6_CHUNK(src, false, 0)
+FILTER_CLASSIFY_NET6_CHUNK(src, false, 1)
+FILTER_CLASSIFY_NET6_CHUNK(src, false, 2)
+FILTER_CLASSIFY_NET6_CHUNK(src, false, 3)
+FILTER_CLASSIFY_NET6_CHUNK(src, false, 4)
+FILTER_CLASSIFY_NET6_CHUNK(src, false, 5)
+FILTER_CLASSIFY_NET6_CHUNK(src, false, 6)
+FILTER_CLASSIFY_NET6_CHUNK(src, false, 7)
+
+FILTER_CLASSIFY_NET6_CHUNK(dst, true, 0)
+FILTER_CLASSIFY_NET6_CHUNK(dst, true, 1)
+FILTER_CLASSIFY_NET6_CHUNK(dst, true, 2)
+FILTER_CLASSIFY_NET6_CHUNK(dst, true, 3)
+FILTER_CLASSIFY_NET6_CHUNK(dst, true, 4)
+FILTER_CLASSIFY_NET6_CHUNK(dst, true, 5)
+FILTER_CLASSIFY_NET6_CHUNK(dst, true, 6)
+FILTER_CLASSIFY_NET6_CHUNK(dst, true, 7)
+
+const filter_classify filter_classify_src_net6[IPFW_NET6_CHUNK_MAX] = {
+	filter_classify_src_net6_0,
+	filter_classify_src_net6_1,
+	filter_classify_src_net6_2,
+	filter_classify_src_net6_3,
+	filter_classify_src_net6_4,
+	filter_classify_src_net6_5,
+	filter_classify_src_net6_6,
+	filter_classify_src_net6_7,
+};
+
+const filter_classify filter_classify_dst_net6[IPFW_NET6_CHUNK_MAX] = {
+	filter_classify_dst_net6_0,
+	filter_classify_dst_net6_1,
+	filter_classify_dst_net6_2,
+	filter_classify_dst_net6_3,
+	filter_classify_dst_net6_4,
+	filter_classify_dst_net6_5,
+	filter_classify_dst_net6_6,
+	filter_classify_dst_net6_7,
+};
+
+// Ports of protocols without ports are zero in the flow key
 uint32_t
-filter_classify_src_net_lo(
+filter_classify_src_port(
 	const struct filter *filter,
 	const struct packet *packet)
 {
-	struct rte_mbuf *mbuf = packet_to_mbuf(packet);
-
-	if (packet->network_header.type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
-		struct rte_ipv4_hdr* ipv4Header = NULL;
-		ipv4Header = rte_pktmbuf_mtod_offset(
-			mbuf,
-			struct rte_ipv4_hdr*,
-			packet->network_header.offset);
-
-		(void) ipv4Header;
-		return 0;
-	}
-
-	struct rte_ipv6_hdr* ipv6Header = NULL;
-	ipv6Header = rte_pktmbuf_mtod_offset(
-		mbuf,
-		struct rte_ipv6_hdr*,
-		packet->network_header.offset);
-
 	const struct ipfw_packet_filter *ipfw_filter =
 		(const struct ipfw_packet_filter *)filter;
 
-	return lpm64_lookup(&ipfw_filter->src_net6_hi, *(uint64_t *)(ipv6Header->src_addr + 8));
-
+	return ipfw_filter->src_port[packet->flow_key.src_port];
 }
 
 uint32_t
-filter_classify_dst_net_hi(
+filter_classify_dst_port(
 	const struct filter *filter,
 	const struct packet *packet)
 {
-	struct rte_mbuf *mbuf = packet_to_mbuf(packet);
+	const struct ipfw_packet_filter *ipfw_filter =
+		(const struct ipfw_packet_filter *)filter;
 
-	if (packet->network_header.type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
-		struct rte_ipv4_hdr* ipv4Header = NULL;
-		ipv4Header = rte_pktmbuf_mtod_offset(
-			mbuf,
-			struct rte_ipv4_hdr*,
-			packet->network_header.offset);
+	return ipfw_filter->dst_port[packet->flow_key.dst_port];
+}
 
-		(void) ipv4Header;
-		return 0;
-	}
 
-	struct rte_ipv6_hdr* ipv6Header = NULL;
-	ipv6Header = rte_pktmbuf_mtod_offset(
-		mbuf,
-		struct rte_ipv6_hdr*,
-		packet->network_header.offset);
 
-	const struct ipfw_packet_filter *ipfw_filter =
-		(const struct ipfw_packet_filter *)filter;
+/*
+ * Rules have IPv6 networks only so other packets match no rule. Network
+ * classifiers return no class for them and class zero is a valid one, so
+ * each match routine checks the packet first.
+ */
+static inline bool
+ipfw_packet_is_ipv6(const struct packet *packet)
+{
+	return packet->flow_key.network_type ==
+	       rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6);
+}
 
-	return lpm64_lookup(&ipfw_filter->src_net6_hi, *(uint64_t *)ipv6Header->src_addr);
+/*
+ * The routine encodes packet fields the same way as classifiers do.
+ */
+static void
+ipfw_packet_tuple_key(const struct packet *packet, struct tuple_key *key)
+{
+	const struct packet_flow_key *flow_key = &packet->flow_key;
+
+	memcpy(&key->fields[0], flow_key->src_addr, 16);
+	memcpy(&key->fields[2], flow_key->dst_addr, 16);
+	key->fields[4] = flow_key->src_port;
+	key->fields[5] = flow_key->dst_port;
 }
 
+uint32_t
+ipfw_tables_process(
+	const struct filter *filter,
+	const struct packet *packet)
+{
+	if (!ipfw_packet_is_ipv6(packet))
+		return ACTION_LIST_EMPTY;
+
+	return filter_process_tables(filter, packet);
+}
 
 uint32_t
-filter_classify_dst_net_lo(
+ipfw_hybrid_process(
 	const struct filter *filter,
 	const struct packet *packet)
 {
-	struct rte_mbuf *mbuf = packet_to_mbuf(packet);
+	const struct ipfw_packet_filter *ipfw_filter =
+		(const struct ipfw_packet_filter *)filter;
 
-	if (packet->network_header.type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
-		struct rte_ipv4_hdr* ipv4Header = NULL;
-		ipv4Header = rte_pktmbuf_mtod_offset(
-			mbuf,
-			struct rte_ipv4_hdr*,
-			packet->network_header.offset);
+	if (!ipfw_packet_is_ipv6(packet))
+		return ACTION_LIST_EMPTY;
 
-		(void) ipv4Header;
-		return 0;
-	}
+	uint32_t list = filter_process_tables(filter, packet);
+	if (ipfw_filter->fallback.tuple_count == 0 || list == FILTER_INVALID)
+		return list;
 
-	struct rte_ipv6_hdr* ipv6Header = NULL;
-	ipv6Header = rte_pktmbuf_mtod_offset(
-		mbuf,
-		struct rte_ipv6_hdr*,
-		packet->network_header.offset);
+	// No fallback rule precedes the terminal rule of the list
+	uint32_t limit = ipfw_filter->fallback_limits[list];
+	if (!limit)
+		return list;
 
-	const struct ipfw_packet_filter *ipfw_filter =
-		(const struct ipfw_packet_filter *)filter;
+	struct tuple_key key;
+	ipfw_packet_tuple_key(packet, &key);
 
-	return lpm64_lookup(&ipfw_filter->src_net6_hi, *(uint64_t *)(ipv6Header->dst_addr + 8));
+	uint32_t pos = tuple_space_lookup(&ipfw_filter->fallback, &key, limit);
+	if (pos == TUPLE_RULE_INVALID)
+		return list;
 
+	return filter_table_lookup(&ipfw_filter->fallback_lists, list, pos);
 }
 
 uint32_t
-filter_classify_src_port(
+ipfw_packet_filter_process(
+	struct ipfw_packet_filter *filter,
+	struct packet *packet)
+{
+	return filter_process(&filter->filter, packet);
+}
+
+uint32_t
+ipfw_linear_process(
 	const struct filter *filter,
 	const struct packet *packet)
 {
-	struct rte_mbuf *mbuf = packet_to_mbuf(packet);
-	// TODO: what about protocols whithout port defined?
-	uint16_t src_port = 0;
-
-	if (packet->transport_header.type == IPPROTO_TCP) {
-		struct rte_tcp_hdr* tcpHeader = NULL;
-		tcpHeader = rte_pktmbuf_mtod_offset(
-			mbuf,
-			struct rte_tcp_hdr*,
-			packet->transport_header.offset);
-
-		src_port = tcpHeader->src_port;
-	} else if (packet->transport_header.type == IPPROTO_UDP) {
-		struct rte_udp_hdr* udpHeader = NULL;
-		udpHeader = rte_pktmbuf_mtod_offset(
-			mbuf,
-			struct rte_udp_hdr*,
-			packet->transport_header.offset);
-
-		src_port = udpHeader->src_port;
-	}
-
 	const struct ipfw_packet_filter *ipfw_filter =
 		(const struct ipfw_packet_filter *)filter;
 
-	return ipfw_filter->src_port[src_port];
+	if (!ipfw_packet_is_ipv6(packet))
+		return ACTION_LIST_EMPTY;
+
+	struct tuple_key tuple_key;
+	ipfw_packet_tuple_key(packet, &tuple_key);
+
+	// Addresses are compared as numbers
+	uint64_t key[LINEAR_FIELD_COUNT] = {
+		be64toh(tuple_key.fields[0]),
+		be64toh(tuple_key.fields[1]),
+		be64toh(tuple_key.fields[2]),
+		be64toh(tuple_key.fields[3]),
+		tuple_key.fields[4],
+		tuple_key.fields[5],
+	};
+
+	return linear_matcher_list(
+		&ipfw_filter->linear,
+		&ipfw_filter->action_lists,
+		linear_matcher_lookup(&ipfw_filter->linear, key));
 }
 
 uint32_t
-filter_classify_dst_port(
+ipfw_bitvector_process(
 	const struct filter *filter,
 	const struct packet *packet)
 {
-	struct rte_mbuf *mbuf = packet_to_mbuf(packet);
-	// TODO: what about protocols whithout port defined?
-	uint16_t dst_port = 0;
-
-	if (packet->transport_header.type == IPPROTO_TCP) {
-		struct rte_tcp_hdr* tcpHeader = NULL;
-		tcpHeader = rte_pktmbuf_mtod_offset(
-			mbuf,
-			struct rte_tcp_hdr*,
-			packet->transport_header.offset);
-
-		dst_port = tcpHeader->dst_port;
-	} else if (packet->transport_header.type == IPPROTO_UDP) {
-		struct rte_udp_hdr* udpHeader = NULL;
-		udpHeader = rte_pktmbuf_mtod_offset(
-			mbuf,
-			struct rte_udp_hdr*,
-			packet->transport_header.offset);
-
-		dst_port = udpHeader->dst_port;
-	}
-
 	const struct ipfw_packet_filter *ipfw_filter =
 		(const struct ipfw_packet_filter *)filter;
 
-	return ipfw_filter->dst_port[dst_port];
+	if (!ipfw_packet_is_ipv6(packet))
+		return ACTION_LIST_EMPTY;
+
+	uint32_t values[BITVECTOR_FIELD_COUNT] = {
+		filter_classify_src_net6_0(filter, packet),
+		filter_classify_src_net6_1(filter, packet),
+		filter_classify_dst_net6_0(filter, packet),
+		filter_classify_dst_net6_1(filter, packet),
+		filter_classify_src_port(filter, packet),
+		filter_classify_dst_port(filter, packet),
+	};
+
+	return bitvector_matcher_list(
+		&ipfw_filter->bitvector,
+		&ipfw_filter->action_lists,
+		values);
 }
-
-
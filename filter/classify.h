@@ -3,36 +3,57 @@
 
 #include <stdint.h>
 
-struct filter;
+#include "dataplane/filter.h"
+
 struct packet;
 
+/*
+ * Network classifiers of IPv6 address chunks indexed by the chunk. Chunk
+ * width is taken from the ipfw filter.
+ */
+extern const filter_classify filter_classify_src_net6[];
+extern const filter_classify filter_classify_dst_net6[];
+
 uint32_t
-filter_classify_src_net_hi(
+filter_classify_src_port(
 	const struct filter *filter,
 	const struct packet *packet);
 
 uint32_t
-filter_classify_src_net_lo(
+filter_classify_dst_port(
 	const struct filter *filter,
 	const struct packet *packet);
 
+/*
+ * Match routine of ipfw filters using cross-product tables only.
+ */
 uint32_t
-filter_classify_dst_net_hi(
+ipfw_tables_process(
 	const struct filter *filter,
 	const struct packet *packet);
 
+/*
+ * Match routine of ipfw filters using the linear matcher.
+ */
 uint32_t
-filter_classify_dst_net_lo(
+ipfw_linear_process(
 	const struct filter *filter,
 	const struct packet *packet);
 
+/*
+ * Match routine of hybrid ipfw filters running the tables and then the
+ * fallback tuple space.
+ */
 uint32_t
-filter_classify_src_port(
+ipfw_hybrid_process(
 	const struct filter *filter,
 	const struct packet *packet);
 
+/*
+ * Match routine of ipfw filters using the bit-vector matcher.
+ */
 uint32_t
-filter_classify_dst_port(
+ipfw_bitvector_process(
 	const struct filter *filter,
 	const struct packet *packet);
 
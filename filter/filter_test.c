@@ -1,9 +1,602 @@
 #include "ipfw.h"
 
+#include "dataplane/packet/packet.h"
+
+#include "rte_ether.h"
+
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <endian.h>
 
+/*
+ * Rulesets are compiled with each strategy and chunk width and verdicts
+ * are checked against the first match over the original rules. Addresses
+ * and ports are drawn from small pools so rules overlap and packets hit
+ * them. Ports are compared as stored in the flow key.
+ */
+#define TEST_RULE_COUNT 96
+#define TEST_LINEAR_RULE_COUNT 48
+#define TEST_PACKET_COUNT 4096
+#define TEST_PORT_MAX 1200
+#define TEST_LIST_MAX 64
+#define TEST_OPTIMIZE_GROUP_COUNT 12
+/*
+ * Bit-vector lists of leading non-terminal catch-all rules are all their
+ * subsets, so this many rules exceed the bit-vector list limit.
+ */
+#define TEST_HYBRID_NON_TERMINATE_COUNT 21
+
+// Sparse tables are built from random pairs of a square table
+#define TEST_SPARSE_DIM 1024
+#define TEST_SPARSE_COUNT 131072
+#define TEST_SPARSE_DEFAULT 7
+
+static uint64_t test_seed = 0x9e3779b97f4a7c15;
+static uint64_t test_pool[4];
+
+static uint64_t
+test_random(void)
+{
+	test_seed ^= test_seed << 13;
+	test_seed ^= test_seed >> 7;
+	test_seed ^= test_seed << 17;
+	return test_seed;
+}
+
+// Prefix mask of the address half as stored in memory
+static uint64_t
+test_prefix_mask(uint32_t len)
+{
+	static const uint32_t lens[] = {0, 8, 16, 24, 32, 48, 64};
+	len = lens[len % 7];
+	return len ? htobe64(~(uint64_t)0 << (64 - len)) : 0;
+}
+
+static void
+test_net(struct ipfw_net6 *net)
+{
+	net->mask_hi = test_prefix_mask(test_random());
+	net->mask_lo = test_prefix_mask(test_random());
+	net->addr_hi = test_pool[test_random() % 4] & net->mask_hi;
+	net->addr_lo = test_pool[test_random() % 4] & net->mask_lo;
+}
+
+static void
+test_port_range(struct ipfw_port_range *range)
+{
+	if (test_random() % 4 == 0) {
+		*range = (struct ipfw_port_range){0, 65535};
+		return;
+	}
+	range->from = test_random() % 8 * 100;
+	range->to = range->from + test_random() % 300;
+}
+
+// Catch-all rule matches IPv6 packets only
+static void
+test_catch_all(struct ipfw_filter_action *action, uint32_t value)
+{
+	action->action = value;
+	action->filter.net6.srcs[0] = (struct ipfw_net6){0, 0, 0, 0};
+	action->filter.net6.dsts[0] = (struct ipfw_net6){0, 0, 0, 0};
+	action->filter.transport.srcs[0] = (struct ipfw_port_range){0, 65535};
+	action->filter.transport.dsts[0] = (struct ipfw_port_range){0, 65535};
+}
+
+static struct ipfw_filter_action *
+test_ruleset(uint32_t count)
+{
+	struct ipfw_filter_action *actions = (struct ipfw_filter_action *)
+		calloc(count, sizeof(struct ipfw_filter_action));
+
+	for (uint32_t rule = 0; rule < count; ++rule) {
+		struct ipfw_filter *filter = &actions[rule].filter;
+
+		filter->net6.src_count = 1 + test_random() % 2;
+		filter->net6.srcs = (struct ipfw_net6 *)
+			malloc(sizeof(struct ipfw_net6) * 2);
+		filter->net6.dst_count = 1 + test_random() % 2;
+		filter->net6.dsts = (struct ipfw_net6 *)
+			malloc(sizeof(struct ipfw_net6) * 2);
+		for (uint32_t idx = 0; idx < 2; ++idx) {
+			test_net(filter->net6.srcs + idx);
+			test_net(filter->net6.dsts + idx);
+		}
+
+		filter->transport.src_count = 1;
+		filter->transport.srcs = (struct ipfw_port_range *)
+			malloc(sizeof(struct ipfw_port_range));
+		test_port_range(filter->transport.srcs);
+		filter->transport.dst_count = 1 + test_random() % 2;
+		filter->transport.dsts = (struct ipfw_port_range *)
+			malloc(sizeof(struct ipfw_port_range) * 2);
+		test_port_range(filter->transport.dsts);
+		test_port_range(filter->transport.dsts + 1);
+
+		// Actions are unique so the optimizer merges no rules
+		actions[rule].action = rule;
+		if (test_random() % 16 == 0)
+			actions[rule].action |= IPFW_ACTION_NON_TERMINATE;
+	}
+
+	test_catch_all(actions + count - 1, count - 1);
+
+	return actions;
+}
+
+static void
+test_packet(struct packet *packet)
+{
+	memset(packet, 0, sizeof(struct packet));
+
+	struct packet_flow_key *flow_key = &packet->flow_key;
+	uint64_t addrs[4];
+	for (uint32_t idx = 0; idx < 4; ++idx) {
+		uint64_t mask = test_prefix_mask(test_random());
+		addrs[idx] = (test_pool[test_random() % 4] & mask) |
+			     (test_random() & ~mask);
+	}
+
+	if (test_random() % 8 == 0) {
+		flow_key->network_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+		memcpy(flow_key->src_addr, addrs, 4);
+		memcpy(flow_key->dst_addr, addrs + 2, 4);
+	} else {
+		flow_key->network_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6);
+		memcpy(flow_key->src_addr, addrs, 16);
+		memcpy(flow_key->dst_addr, addrs + 2, 16);
+	}
+	flow_key->src_port = test_random() % TEST_PORT_MAX;
+	flow_key->dst_port = test_random() % TEST_PORT_MAX;
+}
+
+/*
+ * Address halves are matched against networks of the rule independently
+ * the same way the network classifiers do.
+ */
+static int
+test_net_match(const struct ipfw_net6 *nets, uint32_t count, const uint8_t *addr)
+{
+	uint64_t hi;
+	uint64_t lo;
+	memcpy(&hi, addr, 8);
+	memcpy(&lo, addr + 8, 8);
+
+	int hi_match = 0;
+	int lo_match = 0;
+	for (uint32_t idx = 0; idx < count; ++idx) {
+		hi_match |= (hi & nets[idx].mask_hi) == nets[idx].addr_hi;
+		lo_match |= (lo & nets[idx].mask_lo) == nets[idx].addr_lo;
+	}
+	return hi_match && lo_match;
+}
+
+static int
+test_port_match(
+	const struct ipfw_port_range *ranges, uint32_t count, uint16_t port)
+{
+	for (uint32_t idx = 0; idx < count; ++idx) {
+		if (port >= ranges[idx].from && port <= ranges[idx].to)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * The routine fills actions of rules matched by the packet in the rule
+ * order up to the first terminal one and returns their count.
+ */
+static uint32_t
+test_reference(
+	const struct ipfw_filter_action *actions,
+	uint32_t count,
+	const struct packet *packet,
+	uint32_t *list)
+{
+	const struct packet_flow_key *flow_key = &packet->flow_key;
+	if (flow_key->network_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6))
+		return 0;
+
+	uint32_t list_count = 0;
+	for (uint32_t rule = 0; rule < count; ++rule) {
+		const struct ipfw_filter *filter = &actions[rule].filter;
+		if (!test_net_match(filter->net6.srcs, filter->net6.src_count,
+				    flow_key->src_addr) ||
+		    !test_net_match(filter->net6.dsts, filter->net6.dst_count,
+				    flow_key->dst_addr) ||
+		    !test_port_match(filter->transport.srcs,
+				     filter->transport.src_count,
+				     flow_key->src_port) ||
+		    !test_port_match(filter->transport.dsts,
+				     filter->transport.dst_count,
+				     flow_key->dst_port))
+			continue;
+
+		list[list_count++] = actions[rule].action;
+		if (!(actions[rule].action & IPFW_ACTION_NON_TERMINATE))
+			break;
+	}
+	return list_count;
+}
+
+/*
+ * The routine decodes the action list returned by the filter into actions
+ * of the optimized rules and returns their count.
+ */
+static uint32_t
+test_decode(
+	const struct ipfw_packet_filter *filter,
+	const struct ipfw_filter_action *optimized,
+	uint32_t value,
+	uint32_t *list)
+{
+	uint32_t list_count = 0;
+	for (uint32_t node = value; node != ACTION_LIST_EMPTY;
+	     node = action_list_parent(&filter->action_lists, node))
+		++list_count;
+
+	uint32_t idx = list_count;
+	for (uint32_t node = value; node != ACTION_LIST_EMPTY;
+	     node = action_list_parent(&filter->action_lists, node)) {
+		list[--idx] = optimized[action_list_last(
+			&filter->action_lists, node)].action;
+	}
+	return list_count;
+}
+
+/*
+ * The routine compiles the ruleset and checks verdicts of random packets.
+ * It returns 1 if the compilation exceeds the memory budget.
+ */
+static int
+test_verdicts(
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	const struct ipfw_compile_config *config,
+	struct ipfw_compile_report *report)
+{
+	uint32_t *rule_map = (uint32_t *)malloc(sizeof(uint32_t) * count);
+	struct ipfw_filter_action *optimized;
+	uint32_t optimized_count;
+	struct ipfw_optimize_report optimize_report;
+	if (ipfw_filter_optimize(
+		actions, count, &optimized, &optimized_count, rule_map,
+		&optimize_report))
+		return -1;
+	free(rule_map);
+
+	struct ipfw_packet_filter *filter = (struct ipfw_packet_filter *)
+		malloc(sizeof(struct ipfw_packet_filter));
+	if (ipfw_packet_filter_create(
+		optimized, optimized_count, config, report, filter)) {
+		int res = errno == E2BIG ? 1 : -1;
+		if (res < 0)
+			fprintf(stderr, "compile failed: %s\n", report->error);
+		ipfw_filter_actions_free(optimized, optimized_count);
+		free(filter);
+		return res;
+	}
+
+	int res = 0;
+	for (uint32_t idx = 0; idx < TEST_PACKET_COUNT; ++idx) {
+		struct packet packet;
+		test_packet(&packet);
+
+		uint32_t expected[TEST_LIST_MAX];
+		uint32_t expected_count =
+			test_reference(actions, count, &packet, expected);
+
+		uint32_t value = ipfw_packet_filter_process(filter, &packet);
+		uint32_t list[TEST_LIST_MAX];
+		uint32_t list_count =
+			test_decode(filter, optimized, value, list);
+
+		if (list_count != expected_count ||
+		    memcmp(list, expected, sizeof(uint32_t) * list_count)) {
+			fprintf(stderr,
+				"strategy %d chunk %u: packet %u matched %u "
+				"actions, expected %u\n",
+				report->strategy, config->net6_chunk_width,
+				idx, list_count,
+				expected_count);
+			res = -1;
+			break;
+		}
+	}
+
+	ipfw_filter_actions_free(optimized, optimized_count);
+	ipfw_packet_filter_free(filter);
+	free(filter);
+	return res;
+}
+
+/*
+ * The routine compiles the ruleset with decreasing memory budgets so the
+ * compilation falls back from cross-product tables to the bit-vector and
+ * hybrid matchers. Strategies of filters compiled are collected as bits.
+ */
+static int
+test_budgets(
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	uint8_t chunk_width,
+	uint32_t *strategies)
+{
+	struct ipfw_compile_config config = {chunk_width, 0};
+	for (;;) {
+		struct ipfw_compile_report report;
+		int res = test_verdicts(actions, count, &config, &report);
+		if (res)
+			return res > 0 && config.memory_budget ? 0 : -1;
+
+		*strategies |= 1 << report.strategy;
+
+		// Peak counts abandoned attempts and may exceed the budget
+		uint64_t bytes = report.peak_bytes;
+		if (config.memory_budget && config.memory_budget < bytes)
+			bytes = config.memory_budget;
+		config.memory_budget = bytes - bytes / 8;
+	}
+}
+
+/*
+ * Bit-vector matcher takes less memory than the hybrid one for the random
+ * ruleset, so the hybrid matcher is reached with a ruleset exceeding the
+ * bit-vector list limit and a budget below the cross-product tables.
+ */
+static int
+test_hybrid(uint32_t *strategies)
+{
+	struct ipfw_filter_action *actions = test_ruleset(TEST_RULE_COUNT);
+	for (uint32_t rule = 0; rule < TEST_HYBRID_NON_TERMINATE_COUNT; ++rule)
+		test_catch_all(actions + rule, rule | IPFW_ACTION_NON_TERMINATE);
+
+	int res = -1;
+	struct ipfw_compile_config config = {64, 0};
+	struct ipfw_compile_report report;
+	if (test_verdicts(actions, TEST_RULE_COUNT, &config, &report))
+		goto out;
+	*strategies |= 1 << report.strategy;
+
+	config.memory_budget = report.peak_bytes - report.peak_bytes / 8;
+	if (test_verdicts(actions, TEST_RULE_COUNT, &config, &report))
+		goto out;
+	*strategies |= 1 << report.strategy;
+	res = 0;
+
+out:
+	ipfw_filter_actions_free(actions, TEST_RULE_COUNT);
+	return res;
+}
+
+static int
+test_strategies(void)
+{
+	for (uint32_t idx = 0; idx < 4; ++idx)
+		test_pool[idx] = test_random();
+
+	struct ipfw_filter_action *actions = test_ruleset(TEST_RULE_COUNT);
+
+	// Leading rules with the catch-all one are small enough to be linear
+	struct ipfw_filter_action linear[TEST_LINEAR_RULE_COUNT];
+	memcpy(linear, actions,
+	       sizeof(struct ipfw_filter_action) * (TEST_LINEAR_RULE_COUNT - 1));
+	linear[TEST_LINEAR_RULE_COUNT - 1] = actions[TEST_RULE_COUNT - 1];
+
+	uint32_t strategies = 0;
+	for (uint8_t chunk_width = 16; chunk_width <= 64; chunk_width *= 2) {
+		struct ipfw_compile_config config = {chunk_width, 0};
+		struct ipfw_compile_report report;
+		if (test_verdicts(linear, TEST_LINEAR_RULE_COUNT, &config,
+				  &report))
+			return -1;
+		strategies |= 1 << report.strategy;
+
+		if (test_budgets(actions, TEST_RULE_COUNT, chunk_width,
+				 &strategies))
+			return -1;
+	}
+
+	ipfw_filter_actions_free(actions, TEST_RULE_COUNT);
+
+	if (test_hybrid(&strategies))
+		return -1;
+
+	uint32_t expected = 1 << IPFW_COMPILE_LINEAR |
+			    1 << IPFW_COMPILE_CROSS_PRODUCT |
+			    1 << IPFW_COMPILE_BITVECTOR |
+			    1 << IPFW_COMPILE_HYBRID;
+	if (strategies != expected) {
+		fprintf(stderr, "strategies %x, expected %x\n",
+			strategies, expected);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The routine fills the rule matching the source high half network of the
+ * pool value and the destination port range.
+ */
+static void
+test_optimize_rule(
+	struct ipfw_filter_action *action,
+	uint64_t addr_hi,
+	uint16_t port_from,
+	uint16_t port_to,
+	uint32_t value)
+{
+	struct ipfw_filter *filter = &action->filter;
+
+	filter->net6.src_count = 1;
+	filter->net6.srcs = (struct ipfw_net6 *)malloc(sizeof(struct ipfw_net6));
+	filter->net6.srcs[0] = (struct ipfw_net6){
+		addr_hi & test_prefix_mask(2), 0, test_prefix_mask(2), 0};
+	filter->net6.dst_count = 1;
+	filter->net6.dsts = (struct ipfw_net6 *)malloc(sizeof(struct ipfw_net6));
+	filter->net6.dsts[0] = (struct ipfw_net6){0, 0, 0, 0};
+
+	filter->transport.src_count = 1;
+	filter->transport.srcs = (struct ipfw_port_range *)
+		malloc(sizeof(struct ipfw_port_range));
+	filter->transport.srcs[0] = (struct ipfw_port_range){0, 65535};
+	filter->transport.dst_count = 1;
+	filter->transport.dsts = (struct ipfw_port_range *)
+		malloc(sizeof(struct ipfw_port_range));
+	filter->transport.dsts[0] =
+		(struct ipfw_port_range){port_from, port_to};
+
+	action->action = value;
+}
+
+/*
+ * Each group of the ruleset has a rule, the next rule with the same action
+ * differing in the destination port range only and a copy of the first
+ * rule with another action. The optimizer merges the second rule into the
+ * first one and removes the copy as shadowed. Groups take disjoint port
+ * ranges so they neither merge nor shadow each other.
+ */
+static int
+test_optimize(void)
+{
+	uint32_t count = TEST_OPTIMIZE_GROUP_COUNT * 3;
+	struct ipfw_filter_action *actions = (struct ipfw_filter_action *)
+		calloc(count, sizeof(struct ipfw_filter_action));
+	if (actions == NULL)
+		return -1;
+
+	for (uint32_t group = 0; group < TEST_OPTIMIZE_GROUP_COUNT; ++group) {
+		struct ipfw_filter_action *rules = actions + group * 3;
+		uint64_t addr_hi = test_pool[group % 4];
+		uint16_t port = group * 100;
+		test_optimize_rule(rules + 0, addr_hi, port, port + 49, group);
+		test_optimize_rule(
+			rules + 1, addr_hi, port + 50, port + 99, group);
+		test_optimize_rule(
+			rules + 2, addr_hi, port, port + 49,
+			group + TEST_OPTIMIZE_GROUP_COUNT);
+	}
+
+	int res = -1;
+	uint32_t rule_map[TEST_OPTIMIZE_GROUP_COUNT * 3];
+	struct ipfw_filter_action *optimized;
+	uint32_t optimized_count;
+	struct ipfw_optimize_report report;
+	if (ipfw_filter_optimize(
+		actions, count, &optimized, &optimized_count, rule_map,
+		&report))
+		goto out;
+	ipfw_filter_actions_free(optimized, optimized_count);
+
+	if (report.merged_count != TEST_OPTIMIZE_GROUP_COUNT ||
+	    report.shadowed_count != TEST_OPTIMIZE_GROUP_COUNT ||
+	    optimized_count != TEST_OPTIMIZE_GROUP_COUNT) {
+		fprintf(stderr,
+			"optimizer merged %u and shadowed %u rules into %u, "
+			"expected %u each\n",
+			report.merged_count, report.shadowed_count,
+			optimized_count, TEST_OPTIMIZE_GROUP_COUNT);
+		goto out;
+	}
+
+	for (uint8_t chunk_width = 16; chunk_width <= 64; chunk_width *= 2) {
+		struct ipfw_compile_config config = {chunk_width, 0};
+		struct ipfw_compile_report compile_report;
+		if (test_verdicts(actions, count, &config, &compile_report))
+			goto out;
+	}
+	res = 0;
+
+out:
+	ipfw_filter_actions_free(actions, count);
+	return res;
+}
+
+/*
+ * The routine builds a sparse table of random pairs and checks populated
+ * pairs return their values while other pairs return the default one.
+ * Slots are as many as keys at first and the keys are many enough for
+ * the seed search of the last buckets to fail, so the build grows slots.
+ */
+static int
+test_sparse_table(void)
+{
+	uint8_t *populated = (uint8_t *)
+		calloc(TEST_SPARSE_DIM * TEST_SPARSE_DIM, sizeof(uint8_t));
+	uint64_t *keys = (uint64_t *)
+		malloc(sizeof(uint64_t) * TEST_SPARSE_COUNT);
+	uint32_t *values = (uint32_t *)
+		malloc(sizeof(uint32_t) * TEST_SPARSE_COUNT);
+	if (populated == NULL || keys == NULL || values == NULL)
+		return -1;
+
+	for (uint32_t idx = 0; idx < TEST_SPARSE_COUNT; ++idx) {
+		uint32_t first;
+		uint32_t second;
+		do {
+			first = test_random() % TEST_SPARSE_DIM;
+			second = test_random() % TEST_SPARSE_DIM;
+		} while (populated[second * TEST_SPARSE_DIM + first]);
+		populated[second * TEST_SPARSE_DIM + first] = 1;
+
+		keys[idx] = filter_table_key(first, second);
+		// Populated pairs never hold the default value
+		values[idx] = TEST_SPARSE_DEFAULT + 1 + idx;
+	}
+
+	int res = -1;
+	struct filter_table table;
+	if (filter_table_init_sparse(
+		&table, TEST_SPARSE_DIM, TEST_SPARSE_DIM, keys, values,
+		TEST_SPARSE_COUNT, TEST_SPARSE_DEFAULT))
+		goto out;
+
+	if (table.slot_count <= TEST_SPARSE_COUNT) {
+		fprintf(stderr, "sparse table of %u slots did not grow\n",
+			table.slot_count);
+		goto free;
+	}
+
+	for (uint32_t idx = 0; idx < TEST_SPARSE_COUNT; ++idx) {
+		uint32_t first = keys[idx] & 0xffffffff;
+		uint32_t second = keys[idx] >> 32;
+		uint32_t value = filter_table_lookup(&table, first, second);
+		if (value != values[idx]) {
+			fprintf(stderr, "sparse pair %u:%u is %u, expected %u\n",
+				first, second, value, values[idx]);
+			goto free;
+		}
+	}
+
+	for (uint32_t second = 0; second < TEST_SPARSE_DIM; ++second) {
+		for (uint32_t first = 0; first < TEST_SPARSE_DIM; ++first) {
+			if (populated[second * TEST_SPARSE_DIM + first])
+				continue;
+			uint32_t value =
+				filter_table_lookup(&table, first, second);
+			if (value != TEST_SPARSE_DEFAULT) {
+				fprintf(stderr,
+					"sparse pair %u:%u is %u, expected "
+					"default\n",
+					first, second, value);
+				goto free;
+			}
+		}
+	}
+	res = 0;
+
+free:
+	filter_table_free(&table);
+out:
+	free(values);
+	free(keys);
+	free(populated);
+	return res;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -72,9 +665,33 @@ main(int argc, char **argv)
 	actions[1].action = 1;
 
 
+	struct ipfw_filter_action *optimized;
+	uint32_t optimized_count;
+	uint32_t rule_map[2];
+	struct ipfw_optimize_report report;
+
+	if (ipfw_filter_optimize(
+		actions, 2, &optimized, &optimized_count, rule_map, &report))
+		return -1;
+	ipfw_filter_actions_free(actions, 2);
+
 	struct ipfw_packet_filter filter;
 
-	ipfw_packet_filter_create(actions, 2, &filter);
+	if (ipfw_packet_filter_create(
+		optimized, optimized_count, NULL, NULL, &filter))
+		return -1;
+
+	ipfw_filter_actions_free(optimized, optimized_count);
+	ipfw_packet_filter_free(&filter);
+
+	if (test_sparse_table())
+		return -1;
+
+	if (test_strategies())
+		return -1;
+
+	if (test_optimize())
+		return -1;
 
 	return 0;
 }
@@ -0,0 +1,192 @@
+#ifndef FILTER_HOST_TABLE_H
+#define FILTER_HOST_TABLE_H
+
+/*
+ * Host table maps exact 8-byte keys into 4-byte values. It is intended to
+ * keep host entries away from the LPM where each host takes a full page
+ * path.
+ *
+ * Slots are organized into groups of 8 with a control byte per slot as
+ * in Swiss tables. A control byte is either empty or 7 hash bits of the
+ * slot key, so a probe compares control bytes of the whole group at once
+ * and reads keys of matched slots only. Probing stops at the first group
+ * having an empty slot.
+ *
+ * The table is built once and does not allow to delete keys.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HOST_TABLE_GROUP_SIZE 8
+#define HOST_TABLE_CTRL_EMPTY 0x80
+#define HOST_TABLE_VALUE_INVALID 0xffffffff
+
+struct host_table {
+	uint8_t *ctrls;
+	uint64_t *keys;
+	uint32_t *values;
+	uint32_t group_count;
+	uint32_t count;
+};
+
+static inline uint64_t
+host_table_hash(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccd;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53;
+	key ^= key >> 33;
+	return key;
+}
+
+static inline uint8_t
+host_table_ctrl(uint64_t hash)
+{
+	return hash >> 57;
+}
+
+static inline uint32_t
+host_table_group(const struct host_table *table, uint64_t hash)
+{
+	return hash & (table->group_count - 1);
+}
+
+static inline uint64_t
+host_table_group_ctrls(const struct host_table *table, uint32_t group)
+{
+	uint64_t ctrls;
+	memcpy(&ctrls, table->ctrls + group * HOST_TABLE_GROUP_SIZE,
+	       sizeof(uint64_t));
+	return ctrls;
+}
+
+/*
+ * The routine returns mask with the high bit set in each byte equal to
+ * the control byte. Bytes following a matched one may be set falsely so
+ * matched slots must be checked.
+ */
+static inline uint64_t
+host_table_group_match(uint64_t ctrls, uint8_t ctrl)
+{
+	uint64_t bytes = ctrls ^ (0x0101010101010101 * ctrl);
+	return (bytes - 0x0101010101010101) & ~bytes & 0x8080808080808080;
+}
+
+static inline void
+host_table_init(struct host_table *table)
+{
+	memset(table, 0, sizeof(struct host_table));
+}
+
+static inline void
+host_table_free(struct host_table *table)
+{
+	free(table->values);
+	free(table->keys);
+	free(table->ctrls);
+}
+
+static inline uint64_t
+host_table_size(const struct host_table *table)
+{
+	return (uint64_t)table->group_count * HOST_TABLE_GROUP_SIZE *
+	       (sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t));
+}
+
+/*
+ * The routine allocates empty table for the count of keys keeping load
+ * factor at most 3/4.
+ */
+static inline int
+host_table_alloc(struct host_table *table, uint32_t count)
+{
+	host_table_init(table);
+
+	table->group_count = 1;
+	while ((uint64_t)table->group_count * HOST_TABLE_GROUP_SIZE * 3 <
+	       (uint64_t)count * 4)
+		table->group_count *= 2;
+
+	uint32_t slot_count = table->group_count * HOST_TABLE_GROUP_SIZE;
+	table->ctrls = (uint8_t *)malloc(slot_count);
+	table->keys = (uint64_t *)calloc(slot_count, sizeof(uint64_t));
+	table->values = (uint32_t *)malloc(sizeof(uint32_t) * slot_count);
+	if (table->ctrls == NULL || table->keys == NULL ||
+	    table->values == NULL) {
+		host_table_free(table);
+		host_table_init(table);
+		return -1;
+	}
+	memset(table->ctrls, HOST_TABLE_CTRL_EMPTY, slot_count);
+	return 0;
+}
+
+/*
+ * The routine inserts the key which must be absent in the table.
+ */
+static inline void
+host_table_insert(struct host_table *table, uint64_t key, uint32_t value)
+{
+	uint64_t hash = host_table_hash(key);
+	uint32_t group = host_table_group(table, hash);
+
+	while (1) {
+		uint64_t empty = host_table_group_ctrls(table, group) &
+				 0x8080808080808080;
+		if (empty) {
+			uint32_t slot = group * HOST_TABLE_GROUP_SIZE +
+					__builtin_ctzll(empty) / 8;
+			table->ctrls[slot] = host_table_ctrl(hash);
+			table->keys[slot] = key;
+			table->values[slot] = value;
+			table->count++;
+			return;
+		}
+		group = (group + 1) & (table->group_count - 1);
+	}
+}
+
+static inline uint32_t
+host_table_lookup(const struct host_table *table, uint64_t key)
+{
+	if (table->count == 0)
+		return HOST_TABLE_VALUE_INVALID;
+
+	uint64_t hash = host_table_hash(key);
+	uint8_t ctrl = host_table_ctrl(hash);
+	uint32_t group = host_table_group(table, hash);
+
+	while (1) {
+		uint64_t ctrls = host_table_group_ctrls(table, group);
+		uint64_t matched = host_table_group_match(ctrls, ctrl);
+		while (matched) {
+			uint32_t slot = group * HOST_TABLE_GROUP_SIZE +
+					__builtin_ctzll(matched) / 8;
+			if (table->ctrls[slot] == ctrl &&
+			    table->keys[slot] == key)
+				return table->values[slot];
+			matched &= matched - 1;
+		}
+		if (ctrls & 0x8080808080808080)
+			return HOST_TABLE_VALUE_INVALID;
+		group = (group + 1) & (table->group_count - 1);
+	}
+}
+
+/*
+ * The routine rewrites each stored value using the map.
+ */
+static inline void
+host_table_remap(struct host_table *table, const uint32_t *map)
+{
+	uint32_t slot_count = table->group_count * HOST_TABLE_GROUP_SIZE;
+	for (uint32_t slot = 0; slot < slot_count; ++slot) {
+		if (table->ctrls[slot] != HOST_TABLE_CTRL_EMPTY)
+			table->values[slot] = map[table->values[slot]];
+	}
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include "ipfw.h"
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,10 +11,18 @@
 
 #include "registry.h"
 #include "value.h"
+#include "action_list.h"
+#include "tuple.h"
+#include "linear.h"
+#include "bitvector.h"
+#include "host_table.h"
+#include "arena.h"
 
 #include "classify.h"
 
+#include <stdarg.h>
 #include <stdio.h>
+#include <time.h>
 
 
 static inline uint64_t
@@ -45,6 +54,13 @@ net6_collector_init(struct net6_collector *collector)
 	return 0;
 }
 
+static void
+net6_collector_free(struct net6_collector *collector)
+{
+	radix64_free(&collector->radix64);
+	free(collector->masks);
+}
+
 static int
 net6_collector_add_mask(struct net6_collector *collector, uint32_t *mask_index)
 {
@@ -85,7 +101,7 @@ net6_collector_add(
 	}
 
 	uint8_t prefix = __builtin_popcountll(mask);
-	collector->masks[mask_index] |= 1 << (prefix - 1);
+	collector->masks[mask_index] |= 1ull << (prefix - 1);
 
 	return 0;
 }
@@ -194,10 +210,9 @@ net6_collector_add_network(
 		    !(net6_next(ctx->last_to) == from)) {
 			net6_collector_emit_range(
 					net6_next(ctx->last_to),
-					net6_prev(ctx->stack[ctx->stack_depth - 1].from),
+					net6_prev(from),
 					net6_collect_ctx_top_value(ctx),
 					ctx);
-				ctx->last_to = net6_prev(ctx->stack[ctx->stack_depth - 1].from);
 		}
 
 		ctx->last_to = net6_prev(from);
@@ -221,7 +236,7 @@ net6_collector_iterate(
 		uint64_t from = key;
 		uint64_t to = from | be64toh(0x7fffffffffffffff >> shift); // big endian
 		net6_collector_add_network(from, to, ctx);
-		mask ^= 0x01 << shift;
+		mask ^= 0x01ull << shift;
 	}
 }
 
@@ -284,27 +299,32 @@ action_get_net6_dst(
 	*count = action->filter.net6.dst_count;
 }
 
-typedef void (*net6_get_part_func)(
-	struct ipfw_net6 *net,
-	uint64_t *addr,
-	uint64_t *mask);
-
-static void
-net6_get_hi_part(struct ipfw_net6 *net,
-	uint64_t *addr,
-	uint64_t *mask)
-{
-	*addr = net->addr_hi;
-	*mask = net->mask_hi;
-}
-
+/*
+ * The routine returns the address chunk of the network aligned to the most
+ * significant bits of the LPM key. Key bits following the chunk are zero
+ * in both the address and the mask so the LPM tree of the chunk is only as
+ * deep as the chunk is wide.
+ */
 static void
-net6_get_lo_part(struct ipfw_net6 *net,
+net6_get_chunk(
+	struct ipfw_net6 *net,
+	uint32_t chunk,
+	uint8_t width,
 	uint64_t *addr,
 	uint64_t *mask)
 {
-	*addr = net->addr_lo;
-	*mask = net->mask_lo;
+	uint8_t addrs[16];
+	uint8_t masks[16];
+	memcpy(addrs, &net->addr_hi, sizeof(uint64_t));
+	memcpy(addrs + 8, &net->addr_lo, sizeof(uint64_t));
+	memcpy(masks, &net->mask_hi, sizeof(uint64_t));
+	memcpy(masks + 8, &net->mask_lo, sizeof(uint64_t));
+
+	uint32_t size = width / 8;
+	*addr = 0;
+	*mask = 0;
+	memcpy(addr, addrs + chunk * size, size);
+	memcpy(mask, masks + chunk * size, size);
 }
 
 
@@ -318,58 +338,158 @@ lpm64_value_iterator(uint64_t key, uint32_t value, void *data)
 }
 
 static void
-net6_collect_values(
-	struct ipfw_net6 *start,
-	uint32_t count,
-	net6_get_part_func get_part,
-	struct lpm64 *lpm,
-	struct value_table *table)
+lpm64_registry_iterator(uint64_t key, uint32_t value, void *data)
 {
-	for (struct ipfw_net6 *net6 = start; net6 < start + count; ++net6) {
-		uint64_t addr;
-		uint64_t mask;
-		get_part(net6, &addr, &mask);
-		lpm64_walk(
-			lpm,
-			addr,
-			addr | ~mask,
-			lpm64_value_iterator,
-			table);
-	}
+	(void) key;
+
+	struct value_registry *registry = (struct value_registry *)data;
+	value_registry_collect(registry, value);
 }
 
-struct net_collect_cxt {
-	struct value_table *table;
-	struct value_registry *registry;
+/*
+ * Host parts of networks having all chunk bits set in the mask are kept
+ * in the host table instead of the LPM if the chunk is wide enough to make
+ * LPM paths of hosts long. Each host gets its own classifier value and
+ * networks containing the host collect the host value along with LPM
+ * values of the network.
+ */
+#define IPFW_HOST_CHUNK_WIDTH_MIN 32
+
+struct net6_host {
+	uint64_t key;
+	uint32_t value;
+};
+
+struct net6_hosts {
+	// Hosts ordered by key
+	struct net6_host *items;
+	uint32_t count;
+	uint32_t capacity;
+	// Mask of host parts, zero if hosts are kept in the LPM
+	uint64_t mask;
 };
 
+static int
+net6_host_cmp(const void *first, const void *second)
+{
+	uint64_t key1 = be64toh(((const struct net6_host *)first)->key);
+	uint64_t key2 = be64toh(((const struct net6_host *)second)->key);
+	return key1 < key2 ? -1 : key1 > key2;
+}
+
+static int
+net6_hosts_add(struct net6_hosts *hosts, uint64_t key)
+{
+	if (hosts->count == hosts->capacity) {
+		uint32_t capacity = hosts->capacity ? hosts->capacity * 2 : 8;
+		struct net6_host *items = (struct net6_host *)realloc(
+			hosts->items, sizeof(struct net6_host) * capacity);
+		if (items == NULL)
+			return -1;
+		hosts->items = items;
+		hosts->capacity = capacity;
+	}
+	hosts->items[hosts->count++] = (struct net6_host){key, 0};
+	return 0;
+}
+
+/*
+ * The routine orders hosts, removes duplicates and assigns values
+ * following the LPM ones.
+ */
 static void
-lpm64_registry_iterator(uint64_t key, uint32_t value, void *data)
+net6_hosts_finish(struct net6_hosts *hosts, uint32_t value)
 {
-	(void) key;
+	if (hosts->count == 0)
+		return;
+
+	qsort(hosts->items,
+	      hosts->count,
+	      sizeof(struct net6_host),
+	      net6_host_cmp);
+
+	uint32_t count = 0;
+	for (uint32_t idx = 0; idx < hosts->count; ++idx) {
+		if (count && hosts->items[count - 1].key == hosts->items[idx].key)
+			continue;
+		hosts->items[count] = hosts->items[idx];
+		hosts->items[count].value = value + count;
+		++count;
+	}
+	hosts->count = count;
+}
 
-	struct value_registry *registry = (struct value_registry *)data;
-	value_registry_collect(registry, value);
+/*
+ * The routine calls the function for each host in [from..to] key range.
+ */
+static void
+net6_hosts_walk(
+	const struct net6_hosts *hosts,
+	uint64_t from,
+	uint64_t to,
+	lpm64_iterate_func iterate_func,
+	void *iterate_func_data)
+{
+	uint32_t left = 0;
+	uint32_t right = hosts->count;
+	while (left < right) {
+		uint32_t middle = left + (right - left) / 2;
+		if (be64toh(hosts->items[middle].key) < be64toh(from))
+			left = middle + 1;
+		else
+			right = middle;
+	}
+
+	for (uint32_t idx = left;
+	     idx < hosts->count &&
+	     be64toh(hosts->items[idx].key) <= be64toh(to);
+	     ++idx)
+		iterate_func(
+			hosts->items[idx].key,
+			hosts->items[idx].value,
+			iterate_func_data);
 }
 
+/*
+ * The routine calls the function for each classifier value of networks.
+ */
 static void
-net6_collect_registry(
+net6_walk(
 	struct ipfw_net6 *start,
 	uint32_t count,
-	net6_get_part_func get_part,
+	uint32_t chunk,
+	uint8_t width,
 	struct lpm64 *lpm,
-	struct value_registry *registry)
+	const struct net6_hosts *hosts,
+	lpm64_iterate_func iterate_func,
+	void *iterate_func_data)
 {
 	for (struct ipfw_net6 *net6 = start; net6 < start + count; ++net6) {
 		uint64_t addr;
 		uint64_t mask;
-		get_part(net6, &addr, &mask);
+		net6_get_chunk(net6, chunk, width, &addr, &mask);
+		if (hosts->mask && mask == hosts->mask) {
+			net6_hosts_walk(
+				hosts,
+				addr,
+				addr,
+				iterate_func,
+				iterate_func_data);
+			continue;
+		}
+
 		lpm64_walk(
 			lpm,
 			addr,
 			addr | ~mask,
-			lpm64_registry_iterator,
-			registry);
+			iterate_func,
+			iterate_func_data);
+		net6_hosts_walk(
+			hosts,
+			addr,
+			addr | ~mask,
+			iterate_func,
+			iterate_func_data);
 	}
 }
 
@@ -383,16 +503,59 @@ value_table_touch_action(uint32_t v1, uint32_t v2, uint32_t idx, void *data)
 	return 0;
 }
 
+/*
+ * Join table is allocated sparse if it is big enough and the estimated
+ * count of populated cells is much less than the table size. The estimate
+ * is the sum of range products and never underestimates the count.
+ *
+ * Allocated cells are taken from the budget and the routine fails with
+ * E2BIG errno if the budget is exhausted.
+ */
+#define JOIN_TABLE_SPARSE_MIN_CELLS (1 << 20)
+#define JOIN_TABLE_SPARSE_RATIO 16
+
+static int
+join_table_init(
+	struct value_registry *registry1,
+	struct value_registry *registry2,
+	struct value_table *table,
+	uint64_t *budget)
+{
+	uint32_t h_dim = value_registry_capacity(registry1);
+	uint32_t v_dim = value_registry_capacity(registry2);
+
+	uint64_t pair_count = 0;
+	for (uint32_t range_idx = 0;
+	     range_idx < registry1->range_count; ++range_idx) {
+		pair_count += (uint64_t)registry1->ranges[range_idx].count *
+			      registry2->ranges[range_idx].count;
+	}
+
+	uint64_t cell_count = (uint64_t)h_dim * v_dim;
+	bool sparse = cell_count >= JOIN_TABLE_SPARSE_MIN_CELLS &&
+		      pair_count * JOIN_TABLE_SPARSE_RATIO < cell_count;
+	if (sparse)
+		cell_count = pair_count;
+
+	if (cell_count > *budget) {
+		errno = E2BIG;
+		return -1;
+	}
+	*budget -= cell_count;
+
+	if (sparse)
+		return value_table_init_sparse(table, h_dim, v_dim);
+	return value_table_init(table, h_dim, v_dim);
+}
+
 static int
 merge_registry_values(
 	struct value_registry *registry1,
 	struct value_registry *registry2,
-	struct value_table *table)
+	struct value_table *table,
+	uint64_t *budget)
 {
-	if (value_table_init(
-		table,
-		value_registry_capacity(registry1),
-		value_registry_capacity(registry2))) {
+	if (join_table_init(registry1, registry2, table, budget)) {
 		return -1;
 	}
 
@@ -456,7 +619,7 @@ collect_registry_values(
 			&collect_ctx);
 	}
 
-	return 0;
+	return value_registry_finish(registry);
 }
 
 static int
@@ -464,110 +627,143 @@ merge_and_collect_registry(
 	struct value_registry *registry1,
 	struct value_registry *registry2,
 	struct value_table *table,
-	struct value_registry *registry)
+	struct value_registry *registry,
+	uint64_t *budget)
 {
-	if (merge_registry_values(registry1, registry2, table)) {
-		return -1;
-	}
-
-	if (collect_registry_values(registry1, registry2, table, registry)) {
-		value_table_free(table);
+	if (merge_registry_values(registry1, registry2, table, budget)) {
 		return -1;
 	}
 
-	return 0;
+	return collect_registry_values(registry1, registry2, table, registry);
 }
 
 struct value_set_ctx {
 	struct value_table *table;
-	struct value_registry *registry;
+	struct action_list_registry *registry;
+	struct ipfw_filter_action *actions;
+	// Rule of each registry range, NULL if ranges are rules
+	const uint32_t *rule_map;
 };
 
+/*
+ * The list is terminal if its last rule has terminal action as no rule
+ * is appended after the terminal one.
+ */
 static int
-action_list_is_term(struct value_registry *registry, uint32_t range_idx)
+action_list_is_term(struct value_set_ctx *set_ctx, uint32_t list)
 {
-	struct value_range *range = registry->ranges + range_idx;
+	if (list == ACTION_LIST_EMPTY)
+		return 0;
 
-	for (uint32_t ridx = range->from;
-	     ridx < range->from + range->count;
-	     ++ridx) {
-		uint32_t action_id = registry->values[ridx];
-		(void) action_id;
-		return 1;
-	}
-	return 0;
+	uint32_t rule_idx = action_list_last(set_ctx->registry, list);
+	return !(set_ctx->actions[rule_idx].action &
+		 IPFW_ACTION_NON_TERMINATE);
 }
 
 static int
 value_table_set_action(uint32_t v1, uint32_t v2, uint32_t idx, void *data)
 {
 	struct value_set_ctx *set_ctx = (struct value_set_ctx *)data;
-	uint32_t prev_value = value_table_get(set_ctx->table, v1, v2);
-
-	if (!action_list_is_term(set_ctx->registry, prev_value)) {
-		int res = value_table_touch(set_ctx->table, v1, v2);
-
-		if (res <= 0)
-			return res;
-
-		value_registry_start(set_ctx->registry);
-
-		struct value_range *copy_range =
-			set_ctx->registry->ranges + prev_value;
+	uint32_t *value = value_table_cell(set_ctx->table, v1, v2);
+	if (value == NULL)
+		return -1;
 
-		for (uint32_t ridx = copy_range->from;
-		     ridx < copy_range->from + copy_range->count;
-		     ++ridx) {
-			value_registry_collect(
-				set_ctx->registry,
-				set_ctx->registry->values[ridx]);
-		}
+	// Rules following the terminal one are shadowed for the cell
+	if (action_list_is_term(set_ctx, *value))
+		return 1;
 
-		value_registry_collect(set_ctx->registry, idx);
-	}
+	uint32_t rule = set_ctx->rule_map != NULL ? set_ctx->rule_map[idx] : idx;
+	// Variants of the same rule are adjacent and may share the cell
+	if (*value != ACTION_LIST_EMPTY &&
+	    action_list_last(set_ctx->registry, *value) == rule)
+		return 0;
 
-	return 0;
+	if (action_list_append(set_ctx->registry, *value, rule, value))
+		return -1;
+	// The cell is final once its list is terminal
+	return action_list_is_term(set_ctx, *value);
 }
 
+/*
+ * The routine builds the last stage table where each cell is an interned
+ * list of actions of rules matching the cell in the rule order with
+ * first-match semantics. So cells sharing the same matched rules up to
+ * the first terminal one share the same value. Registry ranges are mapped
+ * into rules with the rule map if it is not NULL.
+ *
+ * The caller frees the table and the action list registry in case of error.
+ */
 static int
 set_registry_values(
+	struct ipfw_filter_action *actions,
+	const uint32_t *rule_map,
 	struct value_registry *registry1,
 	struct value_registry *registry2,
 	struct value_table *table,
-	struct value_registry *registry)
+	struct action_list_registry *registry,
+	uint64_t *budget)
 {
-	if (value_table_init(
-		table,
-		value_registry_capacity(registry1),
-		value_registry_capacity(registry2))) {
+	if (join_table_init(registry1, registry2, table, budget)) {
 		return -1;
 	}
 
-	if (value_registry_init(registry)) {
-		value_table_free(table);
+	if (action_list_registry_init(registry))
 		return -1;
-	}
-	// Empty action list
-	if (value_registry_start(registry)) {
-		value_registry_free(registry);
-		value_table_free(table);
-	}
 
 	struct value_set_ctx set_ctx;
 	set_ctx.table = table;
 	set_ctx.registry = registry;
+	set_ctx.actions = actions;
+	set_ctx.rule_map = rule_map;
+
+	/*
+	 * Dense tables keep a bit per cell marking cells whose list is
+	 * terminal, so ranges of later rules are combined with it word-wise
+	 * and the callback runs for open cells only. The mask lives until
+	 * the table is built and takes cells from the budget meanwhile.
+	 */
+	uint32_t *mask = NULL;
+	uint32_t *scratch = NULL;
+	uint32_t stride = (table->v_dim + 31) / 32;
+	uint64_t mask_words = (uint64_t)table->h_dim * stride + stride;
+	if (table->keys == NULL) {
+		if (mask_words > *budget) {
+			errno = E2BIG;
+			return -1;
+		}
+		mask = (uint32_t *)calloc(mask_words, sizeof(uint32_t));
+		if (mask == NULL)
+			return -1;
+		scratch = mask + (uint64_t)table->h_dim * stride;
+	}
 
+	int res = 0;
 	for (uint32_t range_idx = 0;
-	     range_idx < registry1->range_count; ++range_idx) {
-		value_table_new_gen(table);
-		value_registry_join_range(
-			registry1,
-			registry2,
-			range_idx,
-			value_table_set_action,
-			&set_ctx);
+	     range_idx < registry1->range_count && !res; ++range_idx) {
+		if (mask != NULL)
+			res = value_registry_join_range_masked(
+				registry1,
+				registry2,
+				range_idx,
+				mask,
+				stride,
+				scratch,
+				value_table_set_action,
+				&set_ctx);
+		else
+			res = value_registry_join_range(
+				registry1,
+				registry2,
+				range_idx,
+				value_table_set_action,
+				&set_ctx);
 	}
+	free(mask);
+	if (res)
+		return -1;
 
+	// Cells are assigned directly so the remap table is never used
+	remap_table_free(&table->remap_table);
 	return 0;
 }
 
@@ -576,15 +772,25 @@ collect_network_values(
 	struct ipfw_filter_action *actions,
 	uint32_t count,
 	action_get_net6_func get_net6,
-	net6_get_part_func get_part,
+	uint32_t chunk,
+	uint8_t width,
 	struct lpm64 *lpm,
+	struct host_table *host_table,
 	struct value_registry *registry)
 {
 	struct value_table table;
 
+	struct net6_hosts hosts;
+	memset(&hosts, 0, sizeof(struct net6_hosts));
+	host_table_init(host_table);
+	if (width >= IPFW_HOST_CHUNK_WIDTH_MIN)
+		memset(&hosts.mask, 0xff, width / 8);
+
 	struct net6_collector collector;
+	bool collecting = false;
 	if (net6_collector_init(&collector))
 		goto error;
+	collecting = true;
 
 	for (struct ipfw_filter_action *action = actions;
 	       action < actions + count;
@@ -598,14 +804,23 @@ collect_network_values(
 		     ++net6) {
 			uint64_t addr;
 			uint64_t mask;
-			get_part(net6, &addr, &mask);
+			net6_get_chunk(net6, chunk, width, &addr, &mask);
 
+			if (hosts.mask && mask == hosts.mask) {
+				if (net6_hosts_add(&hosts, addr))
+					goto error;
+				continue;
+			}
 			net6_collector_add(&collector, addr, mask);
 		}
 	}
 	*lpm = net6_collector_collect(&collector);
+	net6_hosts_finish(&hosts, collector.count);
+	// The LPM is built so the radix tree of networks is not needed
+	net6_collector_free(&collector);
+	collecting = false;
 
-	if (value_table_init(&table, 1, collector.count))
+	if (value_table_init(&table, 1, collector.count + hosts.count))
 		goto error_vtab;
 
 	for (struct ipfw_filter_action *action = actions;
@@ -617,19 +832,34 @@ collect_network_values(
 		uint32_t net_count;
 		get_net6(action, &nets, &net_count);
 
-		net6_collect_values(
+		net6_walk(
 			nets,
 			net_count,
-			get_part,
+			chunk,
+			width,
 			lpm,
+			&hosts,
+			lpm64_value_iterator,
 			&table);
 	}
 
 	value_table_compact(&table);
 	lpm64_compact(lpm, &table);
 
+	if (hosts.count) {
+		if (host_table_alloc(host_table, hosts.count))
+			goto error_reg;
+		for (uint32_t idx = 0; idx < hosts.count; ++idx) {
+			struct net6_host *host = hosts.items + idx;
+			host->value = value_table_get(&table, 0, host->value);
+			host_table_insert(host_table, host->key, host->value);
+		}
+	}
+	// Registry ranges are walked through compacted LPM and hosts
+	value_table_free(&table);
+
 	if (value_registry_init(registry))
-		goto error_reg;
+		goto error;
 
 	for (struct ipfw_filter_action *action = actions;
 	       action < actions + count;
@@ -640,16 +870,19 @@ collect_network_values(
 		uint32_t net_count;
 		get_net6(action, &nets, &net_count);
 
-		net6_collect_registry(
+		net6_walk(
 			nets,
 			net_count,
-			get_part,
+			chunk,
+			width,
 			lpm,
+			&hosts,
+			lpm64_registry_iterator,
 			registry);
 	}
 
-	value_table_free(&table);
-	return 0;
+	free(hosts.items);
+	return value_registry_finish(registry);
 
 
 error_reg:
@@ -658,6 +891,9 @@ error_reg:
 error_vtab:
 
 error:
+	if (collecting)
+		net6_collector_free(&collector);
+	free(hosts.items);
 	return -1;
 }
 
@@ -721,7 +957,7 @@ collect_port_values(
 	value_table_compact(table);
 
 	if (value_registry_init(registry))
-		goto error_reg;
+		return -1;
 
 	for (struct ipfw_filter_action *action = actions;
 	       action < actions + count;
@@ -744,249 +980,2003 @@ collect_port_values(
 		}
 	}
 
+	return value_registry_finish(registry);
+}
+
+static int
+filter_table_copy(
+	struct filter_table *ftab,
+	struct value_table *vtab,
+	struct arena *scratch)
+{
+	if (value_table_is_sparse(vtab)) {
+		// Only cells differing from the default value are stored
+		struct arena_mark mark = arena_mark(scratch);
+		uint64_t *keys = (uint64_t *)
+			arena_alloc(scratch, sizeof(uint64_t) * (vtab->count + 1));
+		uint32_t *values = (uint32_t *)
+			arena_alloc(scratch, sizeof(uint32_t) * (vtab->count + 1));
+		if (keys == NULL || values == NULL) {
+			arena_rewind(scratch, mark);
+			return -1;
+		}
+
+		uint32_t count = 0;
+		for (uint32_t slot = 0; slot < vtab->capacity; ++slot) {
+			if (vtab->keys[slot] == VALUE_TABLE_KEY_EMPTY ||
+			    vtab->values[slot] == vtab->default_value)
+				continue;
+			keys[count] = vtab->keys[slot];
+			values[count] = vtab->values[slot];
+			++count;
+		}
+
+		int res = filter_table_init_sparse(
+			ftab,
+			vtab->h_dim,
+			vtab->v_dim,
+			keys,
+			values,
+			count,
+			vtab->default_value);
+		arena_rewind(scratch, mark);
+		return res;
+	}
+
+	if (filter_table_init(ftab, vtab->h_dim, vtab->v_dim))
+		return -1;
+
+	memcpy(ftab->values, vtab->values, sizeof(uint32_t) * vtab->h_dim * vtab->v_dim);
 	return 0;
+}
 
-error_reg:
-	value_table_free(table);
-	return -1;
+/*
+ * Chunks of an address half are matched as a product of per-chunk value
+ * unions. The product is wider than the union of half parts if the parts
+ * differ in more than one chunk, so such half parts of a network list are
+ * split into variants of one part each. A rule is expanded into variants
+ * of all combinations of its source and destination list variants and
+ * the compiled filter matches the same packets as the 64-bit chunk one.
+ */
+struct net6_part {
+	uint64_t addr;
+	uint64_t mask;
+};
+
+struct net6_variants {
+	struct net6_part *parts[2];
+	uint32_t part_counts[2];
+	// Count of variant groups of each half, 1 if the half is not split
+	uint32_t group_counts[2];
+};
+
+static int
+net6_part_cmp(const void *first, const void *second)
+{
+	const struct net6_part *part1 = (const struct net6_part *)first;
+	const struct net6_part *part2 = (const struct net6_part *)second;
+	if (part1->addr != part2->addr)
+		return part1->addr < part2->addr ? -1 : 1;
+	if (part1->mask != part2->mask)
+		return part1->mask < part2->mask ? -1 : 1;
+	return 0;
 }
 
-static void
-print_vtab(struct value_table *vtab)
+static bool
+net6_parts_split(
+	const struct net6_part *parts,
+	uint32_t count,
+	uint8_t width)
 {
-	fprintf(stderr, "TAB\n");
-	for (uint32_t vidx = 0; vidx < vtab->v_dim; ++vidx) {
-		for (uint32_t hidx = 0; hidx < vtab->h_dim; ++hidx) {
-			fprintf(stderr, "%8u", value_table_get(vtab, hidx, vidx));
+	uint32_t size = width / 8;
+	uint32_t varying_count = 0;
+	for (uint32_t offset = 0; offset < sizeof(uint64_t); offset += size) {
+		for (uint32_t idx = 1; idx < count; ++idx) {
+			if (memcmp((const uint8_t *)&parts[idx].addr + offset,
+				   (const uint8_t *)&parts[0].addr + offset,
+				   size) ||
+			    memcmp((const uint8_t *)&parts[idx].mask + offset,
+				   (const uint8_t *)&parts[0].mask + offset,
+				   size)) {
+				++varying_count;
+				break;
+			}
 		}
-		fprintf(stderr, "\n");
 	}
+	return varying_count > 1;
 }
 
 static void
-print_vreg(struct value_registry *registry)
+net6_variants_free(struct net6_variants *variants)
+{
+	free(variants->parts[1]);
+	free(variants->parts[0]);
+}
+
+static int
+net6_variants_init(
+	struct net6_variants *variants,
+	struct ipfw_net6 *nets,
+	uint32_t count,
+	uint8_t width)
 {
-	fprintf(stderr, "REG\n");
-	for (uint32_t ridx = 0; ridx < registry->range_count; ++ridx) {
-		struct value_range *rng = registry->ranges + ridx;
-		for (uint32_t vidx = rng->from; vidx < rng->from + rng->count; ++vidx) {
-			fprintf(stderr, "%8u", registry->values[vidx]);
+	for (uint32_t half = 0; half < 2; ++half) {
+		variants->parts[half] = (struct net6_part *)
+			malloc(sizeof(struct net6_part) * (count + 1));
+		if (variants->parts[half] == NULL) {
+			if (half)
+				free(variants->parts[0]);
+			return -1;
+		}
+
+		struct net6_part *parts = variants->parts[half];
+		for (uint32_t idx = 0; idx < count; ++idx) {
+			parts[idx].addr =
+				half ? nets[idx].addr_lo : nets[idx].addr_hi;
+			parts[idx].mask =
+				half ? nets[idx].mask_lo : nets[idx].mask_hi;
+		}
+		qsort(parts, count, sizeof(struct net6_part), net6_part_cmp);
+
+		uint32_t part_count = 0;
+		for (uint32_t idx = 0; idx < count; ++idx) {
+			if (part_count == 0 ||
+			    net6_part_cmp(parts + part_count - 1, parts + idx))
+				parts[part_count++] = parts[idx];
 		}
-		fprintf(stderr, "\n");
+
+		variants->part_counts[half] = part_count;
+		variants->group_counts[half] =
+			net6_parts_split(parts, part_count, width) ?
+			part_count : 1;
 	}
+	return 0;
+}
+
+static inline uint32_t
+net6_variants_count(const struct net6_variants *variants)
+{
+	return variants->group_counts[0] * variants->group_counts[1];
 }
 
+/*
+ * The routine builds network list of the variant as a product of the half
+ * parts of the variant groups.
+ */
 static int
-filter_table_copy(
-	struct filter_table *ftab,
-	struct value_table *vtab)
+net6_variants_get(
+	const struct net6_variants *variants,
+	uint32_t variant,
+	struct ipfw_net6 **nets,
+	uint32_t *count)
 {
-	if (filter_table_init(ftab, vtab->h_dim, vtab->v_dim))
+	uint32_t from[2];
+	uint32_t to[2];
+	uint32_t groups[2] = {
+		variant / variants->group_counts[1],
+		variant % variants->group_counts[1],
+	};
+	for (uint32_t half = 0; half < 2; ++half) {
+		bool split = variants->group_counts[half] > 1;
+		from[half] = split ? groups[half] : 0;
+		to[half] = split ? groups[half] + 1 : variants->part_counts[half];
+	}
+
+	*count = (to[0] - from[0]) * (to[1] - from[1]);
+	*nets = (struct ipfw_net6 *)
+		malloc(sizeof(struct ipfw_net6) * (*count + 1));
+	if (*nets == NULL)
 		return -1;
 
-	memcpy(ftab->values, vtab->values, sizeof(uint32_t) * vtab->h_dim * vtab->v_dim);
+	struct ipfw_net6 *net = *nets;
+	for (uint32_t hi = from[0]; hi < to[0]; ++hi) {
+		for (uint32_t lo = from[1]; lo < to[1]; ++lo) {
+			*net++ = (struct ipfw_net6){
+				variants->parts[0][hi].addr,
+				variants->parts[1][lo].addr,
+				variants->parts[0][hi].mask,
+				variants->parts[1][lo].mask,
+			};
+		}
+	}
 	return 0;
 }
 
-int
-ipfw_packet_filter_create(
+static void
+ipfw_chunk_rules_free(struct ipfw_filter_action *rules, uint32_t count)
+{
+	for (uint32_t idx = 0; idx < count; ++idx) {
+		free(rules[idx].filter.net6.srcs);
+		free(rules[idx].filter.net6.dsts);
+	}
+	free(rules);
+}
+
+/*
+ * The routine expands rules into variants matched exactly with chunks
+ * of the width. Variants share transport filters of its rules and
+ * `rule_map` receives the rule of each variant.
+ */
+static int
+ipfw_chunk_rules_expand(
 	struct ipfw_filter_action *actions,
 	uint32_t count,
-	struct ipfw_packet_filter *filter)
+	uint8_t width,
+	struct ipfw_filter_action **rules,
+	uint32_t *rule_count,
+	uint32_t **rule_map)
 {
-	struct value_registry src_net6_hi_registry;
+	uint32_t capacity = count;
+	*rule_count = 0;
+	*rules = (struct ipfw_filter_action *)
+		calloc(capacity + 1, sizeof(struct ipfw_filter_action));
+	*rule_map = (uint32_t *)malloc(sizeof(uint32_t) * (capacity + 1));
+	if (*rules == NULL || *rule_map == NULL)
+		goto error;
 
-	struct value_registry src_net6_lo_registry;
+	for (uint32_t idx = 0; idx < count; ++idx) {
+		struct ipfw_filter_action *action = actions + idx;
+
+		struct net6_variants srcs;
+		struct net6_variants dsts;
+		if (net6_variants_init(
+			&srcs,
+			action->filter.net6.srcs,
+			action->filter.net6.src_count,
+			width))
+			goto error;
+		if (net6_variants_init(
+			&dsts,
+			action->filter.net6.dsts,
+			action->filter.net6.dst_count,
+			width)) {
+			net6_variants_free(&srcs);
+			goto error;
+		}
 
-	struct value_registry dst_net6_hi_registry;
+		uint32_t src_count = net6_variants_count(&srcs);
+		uint32_t dst_count = net6_variants_count(&dsts);
+		int res = 0;
+
+		if (*rule_count + src_count * dst_count > capacity) {
+			while (*rule_count + src_count * dst_count > capacity)
+				capacity *= 2;
+			struct ipfw_filter_action *grown =
+				(struct ipfw_filter_action *)realloc(
+					*rules,
+					sizeof(struct ipfw_filter_action) *
+					capacity);
+			if (grown != NULL)
+				*rules = grown;
+			uint32_t *grown_map = (uint32_t *)realloc(
+				*rule_map, sizeof(uint32_t) * capacity);
+			if (grown_map != NULL)
+				*rule_map = grown_map;
+			res = grown == NULL || grown_map == NULL;
+		}
 
-	struct value_registry dst_net6_lo_registry;
+		for (uint32_t src = 0; !res && src < src_count; ++src) {
+			for (uint32_t dst = 0; !res && dst < dst_count; ++dst) {
+				struct ipfw_filter_action *rule =
+					*rules + *rule_count;
+				*rule = *action;
+				rule->filter.net6.srcs = NULL;
+				rule->filter.net6.dsts = NULL;
+				(*rule_map)[*rule_count] = idx;
+				++*rule_count;
+
+				res = net6_variants_get(
+					&srcs,
+					src,
+					&rule->filter.net6.srcs,
+					&rule->filter.net6.src_count) ||
+				      net6_variants_get(
+					&dsts,
+					dst,
+					&rule->filter.net6.dsts,
+					&rule->filter.net6.dst_count);
+			}
+		}
 
-	collect_network_values(
-		actions,
-		count,
-		action_get_net6_src,
-		net6_get_hi_part,
-		&filter->src_net6_hi,
-		&src_net6_hi_registry);
+		net6_variants_free(&dsts);
+		net6_variants_free(&srcs);
+		if (res)
+			goto error;
+	}
 
-	collect_network_values(
-		actions,
-		count,
-		action_get_net6_src,
-		net6_get_lo_part,
-		&filter->src_net6_lo,
-		&src_net6_lo_registry);
+	return 0;
 
-	collect_network_values(
-		actions,
-		count,
-		action_get_net6_dst,
-		net6_get_hi_part,
-		&filter->dst_net6_hi,
-		&dst_net6_hi_registry);
+error:
+	if (*rules != NULL)
+		ipfw_chunk_rules_free(*rules, *rule_count);
+	free(*rule_map);
+	*rules = NULL;
+	*rule_map = NULL;
+	return -1;
+}
 
-	collect_network_values(
-		actions,
-		count,
-		action_get_net6_dst,
-		net6_get_lo_part,
-		&filter->dst_net6_lo,
-		&dst_net6_lo_registry);
+/*
+ * Compile context accounts memory of the filter and of intermediates
+ * alive at once against the budget and fills the report. Each strategy
+ * attempt starts accounting from scratch.
+ */
+struct ipfw_compile_ctx {
+	uint64_t memory_budget;
+	uint64_t memory_used;
+	struct ipfw_compile_report *report;
+};
 
-	struct value_table src_port_vtab;
-	struct value_table dst_port_vtab;
-	struct value_registry src_port_registry;
-	struct value_registry dst_port_registry;
+static uint64_t
+ipfw_compile_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-	collect_port_values(
-		actions,
-		count,
-		get_port_range_src,
-		&src_port_vtab,
-		&src_port_registry);
+static void
+ipfw_compile_error(struct ipfw_compile_ctx *ctx, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vsnprintf(ctx->report->error, sizeof(ctx->report->error), format, args);
+	va_end(args);
+}
 
-	collect_port_values(
-		actions,
-		count,
-		get_port_range_dst,
-		&dst_port_vtab,
-		&dst_port_registry);
-
-	fprintf(stderr, "SRC_HI_R\n");
-	print_vreg(&src_net6_hi_registry);
-
-	fprintf(stderr, "DST_HI_R\n");
-	print_vreg(&dst_net6_hi_registry);
-
-	fprintf(stderr, "SRC_LO_R\n");
-	print_vreg(&src_net6_lo_registry);
-
-	fprintf(stderr, "DST_LO_R\n");
-	print_vreg(&dst_net6_lo_registry);
-
-	fprintf(stderr, "SRC PORT\n");
-	print_vreg(&src_port_registry);
-	fprintf(stderr, "DST PORT\n");
-	print_vreg(&dst_port_registry);
-
-	struct value_table vtab1;
-	struct value_registry vtab1_registry;
-	merge_and_collect_registry(
-		&src_net6_hi_registry,
-		&dst_net6_hi_registry,
-		&vtab1,
-		&vtab1_registry);
-
-	fprintf(stderr, "vtab1\n");
-	print_vtab(&vtab1);
-	fprintf(stderr, "vtab1_reg\n");
-	print_vreg(&vtab1_registry);
-
-	struct value_table vtab2;
-	struct value_registry vtab2_registry;
-	merge_and_collect_registry(
-		&src_net6_lo_registry,
-		&dst_net6_lo_registry,
-		&vtab2,
-		&vtab2_registry);
-
-	fprintf(stderr, "vtab2\n");
-	print_vtab(&vtab2);
-	fprintf(stderr, "vtab2_reg\n");
-	print_vreg(&vtab2_registry);
-
-	struct value_table vtab3;
-	struct value_registry vtab3_registry;
-	merge_and_collect_registry(
-		&src_port_registry,
-		&dst_port_registry,
-		&vtab3,
-		&vtab3_registry);
-
-	fprintf(stderr, "vtab3\n");
-	print_vtab(&vtab3);
-	fprintf(stderr, "vtab3_reg\n");
-	print_vreg(&vtab3_registry);
-
-	struct value_table vtab12;
-	struct value_registry vtab12_registry;
-	merge_and_collect_registry(
-		&vtab1_registry,
-		&vtab2_registry,
-		&vtab12,
-		&vtab12_registry);
-
-	fprintf(stderr, "vtab12\n");
-	print_vtab(&vtab12);
-	fprintf(stderr, "vtab12_reg\n");
-	print_vreg(&vtab12_registry);
-
-	struct value_table vtab123;
-	struct value_registry vtab123_registry;
-	set_registry_values(
-		&vtab12_registry,
-		&vtab3_registry,
-		&vtab123,
-		&vtab123_registry);
-
-	fprintf(stderr, "vtab123\n");
-	print_vtab(&vtab123);
-	fprintf(stderr, "vtab123_reg\n");
-	print_vreg(&vtab123_registry);
-
-
-
-	filter->classify[0] = filter_classify_src_net_hi;
-	filter->classify[1] = filter_classify_src_net_lo;
-	filter->classify[2] = filter_classify_dst_net_hi;
-	filter->classify[3] = filter_classify_dst_net_lo;
-	filter->classify[4] = filter_classify_src_port;
-	filter->classify[5] = filter_classify_dst_port;
-	filter->filter.classify_count = 6;
-	filter->filter.classify = filter->classify;
+static void
+ipfw_compile_start(
+	struct ipfw_compile_ctx *ctx,
+	enum ipfw_compile_strategy strategy)
+{
+	struct ipfw_compile_report *report = ctx->report;
+	ctx->memory_used = 0;
+	report->strategy = strategy;
+	report->fallback_rule_count = 0;
+	report->classify_count = 0;
+	report->node_count = 0;
+	memset(report->nodes, 0, sizeof(report->nodes));
+	report->filter_bytes = 0;
+	report->error[0] = '\0';
+}
 
-	// src hi X dst hi
-	filter->lookups[0] = (struct filter_lookup){
-		.first_arg = 0,
-		.second_arg = 1,
-		.table_idx = 0,
-	};
-	// src lo X dst lo
-	filter->lookups[1] = (struct filter_lookup){
-		.first_arg = 2,
-		.second_arg = 3,
-		.table_idx = 1,
-	};
-	// src port X dst port
-	filter->lookups[2] = (struct filter_lookup){
-		.first_arg = 4,
-		.second_arg = 5,
-		.table_idx = 2,
-	};
-	// src X dst
-	filter->lookups[3] = (struct filter_lookup){
-		.first_arg = 6,
-		.second_arg = 7,
-		.table_idx = 3,
-	};
-	// net X port
-	filter->lookups[4] = (struct filter_lookup){
-		.first_arg = 9,
-		.second_arg = 8,
-		.table_idx = 4,
-	};
+/*
+ * The routine takes bytes from the memory budget and fails with E2BIG
+ * errno if the budget is exceeded.
+ */
+static int
+ipfw_compile_charge(
+	struct ipfw_compile_ctx *ctx,
+	uint64_t bytes,
+	const char *what)
+{
+	ctx->memory_used += bytes;
+	if (ctx->memory_used > ctx->report->peak_bytes)
+		ctx->report->peak_bytes = ctx->memory_used;
+	if (ctx->memory_used <= ctx->memory_budget)
+		return 0;
 
-	filter->filter.lookup_count = 5;
-	filter->filter.lookups = filter->lookups;
+	ipfw_compile_error(
+		ctx,
+		"%s exceeds memory budget: %llu of %llu bytes",
+		what,
+		(unsigned long long)ctx->memory_used,
+		(unsigned long long)ctx->memory_budget);
+	errno = E2BIG;
+	return -1;
+}
 
-	filter_table_copy(filter->tables + 0, &vtab1);
-	filter_table_copy(filter->tables + 1, &vtab2);
-	filter_table_copy(filter->tables + 2, &vtab3);
-	filter_table_copy(filter->tables + 3, &vtab12);
-	filter_table_copy(filter->tables + 4, &vtab123);
+static void
+ipfw_compile_release(struct ipfw_compile_ctx *ctx, uint64_t bytes)
+{
+	ctx->memory_used -= bytes;
+}
 
-	filter->filter.tables = filter->tables;
+// Stage table cells fitting into the rest of the memory budget
+static uint64_t
+ipfw_compile_cells(struct ipfw_compile_ctx *ctx)
+{
+	if (ctx->memory_used >= ctx->memory_budget)
+		return 0;
+	return (ctx->memory_budget - ctx->memory_used) / sizeof(uint32_t);
+}
+
+/*
+ * Nodes of the compiled filter DAG. The first classify_count nodes are
+ * classifiers and the rest are lookup stages joining values of two
+ * earlier nodes with the stage table.
+ */
+#define IPFW_NODE_MAX (IPFW_CLASSIFY_MAX + IPFW_LOOKUP_MAX)
+#define IPFW_NODE_CONST ((uint32_t)-1)
+
+struct ipfw_node {
+	// Classifier function, NULL for lookup stages
+	filter_classify classify;
+	// Network classifier LPM and host table
+	struct lpm64 *lpm;
+	struct host_table *hosts;
+	// Port classifier table or lookup stage table
+	struct value_table *table;
+	uint32_t first;
+	uint32_t second;
+
+	/*
+	 * Node providing the node value after pruning, the node itself if
+	 * it is kept or IPFW_NODE_CONST if the value is constant.
+	 */
+	uint32_t source;
+	uint32_t value;
+	uint32_t arg;
+};
+
+struct ipfw_dag {
+	struct ipfw_node nodes[IPFW_NODE_MAX];
+	uint32_t classify_count;
+	uint32_t node_count;
+};
+
+static inline uint32_t
+ipfw_node_source(struct ipfw_node *nodes, uint32_t node_idx)
+{
+	return nodes[node_idx].source;
+}
+
+static void
+ipfw_node_remap(struct ipfw_node *node, const uint32_t *map)
+{
+	if (node->lpm != NULL) {
+		lpm64_remap(node->lpm, map);
+		host_table_remap(node->hosts, map);
+	} else {
+		value_table_remap(node->table, map);
+	}
+}
+
+/*
+ * The routine merges equal rows and columns of a stage table and remaps
+ * values of both key producers into merged class identifiers. A producer
+ * is either an upstream stage or a classifier.
+ *
+ * Stages should be processed from the last one to the first as remapping
+ * of a producer may make equal some of its own rows or columns.
+ */
+static int
+merge_table_classes(
+	struct value_table *table,
+	struct ipfw_node *h_node,
+	struct ipfw_node *v_node,
+	struct arena *scratch)
+{
+	struct arena_mark mark = arena_mark(scratch);
+	uint32_t *h_map = (uint32_t *)
+		arena_alloc(scratch, sizeof(uint32_t) * table->h_dim);
+	uint32_t *v_map = (uint32_t *)
+		arena_alloc(scratch, sizeof(uint32_t) * table->v_dim);
+	if (h_map == NULL || v_map == NULL ||
+	    value_table_merge_classes(table, h_map, v_map)) {
+		arena_rewind(scratch, mark);
+		return -1;
+	}
+
+	ipfw_node_remap(h_node, h_map);
+	ipfw_node_remap(v_node, v_map);
+
+	arena_rewind(scratch, mark);
+	return 0;
+}
+
+static uint32_t
+ipfw_dag_add_stage(struct ipfw_dag *dag, uint32_t first, uint32_t second)
+{
+	dag->nodes[dag->node_count] = (struct ipfw_node){
+		.first = first,
+		.second = second,
+	};
+	return dag->node_count++;
+}
+
+/*
+ * The routine lays out the DAG for the chunk count. Source and destination
+ * chunks of the same position are joined first, then chunk stages are
+ * joined pairwise into the network stage which is joined with the port
+ * stage at last. So the DAG for 64-bit chunks is:
+ *  src hi X dst hi, src lo X dst lo, src port X dst port, net, net X port.
+ *
+ * Classifier functions, LPMs and tables are filled by the caller.
+ */
+static void
+ipfw_dag_init(struct ipfw_dag *dag, uint32_t chunk_count)
+{
+	memset(dag, 0, sizeof(struct ipfw_dag));
+	dag->classify_count = chunk_count * 2 + 2;
+	dag->node_count = dag->classify_count;
+
+	uint32_t stages[IPFW_NET6_CHUNK_MAX];
+	for (uint32_t chunk = 0; chunk < chunk_count; ++chunk)
+		stages[chunk] = ipfw_dag_add_stage(
+			dag, chunk, chunk_count + chunk);
+
+	uint32_t port_stage = ipfw_dag_add_stage(
+		dag, chunk_count * 2, chunk_count * 2 + 1);
+
+	for (uint32_t stage_count = chunk_count; stage_count > 1; ) {
+		uint32_t joined_count = 0;
+		for (uint32_t idx = 0; idx + 1 < stage_count; idx += 2)
+			stages[joined_count++] = ipfw_dag_add_stage(
+				dag, stages[idx], stages[idx + 1]);
+		if (stage_count % 2)
+			stages[joined_count++] = stages[stage_count - 1];
+		stage_count = joined_count;
+	}
+
+	ipfw_dag_add_stage(dag, stages[0], port_stage);
+}
+
+/*
+ * The routine prunes lookup stages having a constant argument. Such
+ * stage depends on one argument only, so its table is composed into the
+ * table of the argument producer and the stage is replaced with the
+ * producer. Classifier classes are already merged so a classifier not
+ * constrained by any rule is a constant argument of its stage and
+ * disappears together with the stage.
+ */
+static int
+ipfw_prune_nodes(struct ipfw_dag *dag, struct arena *scratch, uint32_t *result)
+{
+	struct ipfw_node *nodes = dag->nodes;
+
+	for (uint32_t node_idx = 0; node_idx < dag->classify_count; ++node_idx)
+		nodes[node_idx].source = node_idx;
+
+	for (uint32_t node_idx = dag->classify_count;
+	     node_idx < dag->node_count;
+	     ++node_idx) {
+		struct ipfw_node *node = nodes + node_idx;
+		struct value_table *table = node->table;
+
+		uint32_t first = ipfw_node_source(nodes, node->first);
+		uint32_t second = ipfw_node_source(nodes, node->second);
+		uint32_t h_idx =
+			first == IPFW_NODE_CONST ? nodes[node->first].value : 0;
+		uint32_t v_idx =
+			second == IPFW_NODE_CONST ? nodes[node->second].value : 0;
+		bool h_fixed = first == IPFW_NODE_CONST || table->h_dim == 1;
+		bool v_fixed = second == IPFW_NODE_CONST || table->v_dim == 1;
+
+		if (h_fixed && v_fixed) {
+			node->source = IPFW_NODE_CONST;
+			node->value = value_table_get(table, h_idx, v_idx);
+			continue;
+		}
+
+		if (!h_fixed && !v_fixed) {
+			node->source = node_idx;
+			node->first = first;
+			node->second = second;
+			continue;
+		}
+
+		uint32_t dim = h_fixed ? table->v_dim : table->h_dim;
+		struct arena_mark mark = arena_mark(scratch);
+		uint32_t *map = (uint32_t *)
+			arena_alloc(scratch, sizeof(uint32_t) * dim);
+		if (map == NULL)
+			return -1;
+		for (uint32_t idx = 0; idx < dim; ++idx) {
+			map[idx] = h_fixed ? value_table_get(table, h_idx, idx)
+					   : value_table_get(table, idx, v_idx);
+		}
+
+		node->source = h_fixed ? second : first;
+		ipfw_node_remap(nodes + node->source, map);
+		arena_rewind(scratch, mark);
+	}
+
+	*result = ipfw_node_source(nodes, dag->node_count - 1);
+	return 0;
+}
+
+static void
+ipfw_mark_nodes(struct ipfw_dag *dag, uint32_t node_idx, bool *used)
+{
+	used[node_idx] = true;
+	if (node_idx >= dag->classify_count) {
+		ipfw_mark_nodes(dag, dag->nodes[node_idx].first, used);
+		ipfw_mark_nodes(dag, dag->nodes[node_idx].second, used);
+	}
+}
+
+/*
+ * The routine fills filter classifiers and lookups with nodes the result
+ * depends on. Nodes are emitted in order so the result is the last one.
+ * Each stage table is released as soon as it is copied into the filter,
+ * so the peak memory is only one table above the intermediates. Emitted
+ * tables are recorded into the report.
+ */
+static int
+ipfw_emit_nodes(
+	struct ipfw_packet_filter *filter,
+	struct ipfw_dag *dag,
+	uint32_t result,
+	struct ipfw_compile_ctx *ctx,
+	struct arena *scratch)
+{
+	struct ipfw_compile_report *report = ctx->report;
+	struct ipfw_node *nodes = dag->nodes;
+
+	bool used[IPFW_NODE_MAX] = {false};
+	// The only port classifier is kept for constant result
+	if (result == IPFW_NODE_CONST)
+		used[dag->classify_count - 1] = true;
+	else
+		ipfw_mark_nodes(dag, result, used);
+
+	uint32_t classify_count = 0;
+	uint32_t lookup_count = 0;
+	for (uint32_t node_idx = 0; node_idx < dag->node_count; ++node_idx) {
+		struct ipfw_node *node = nodes + node_idx;
+		if (!used[node_idx])
+			continue;
+
+		if (node_idx < dag->classify_count) {
+			node->arg = classify_count;
+			filter->classify[classify_count++] = node->classify;
+			continue;
+		}
+
+		node->arg = classify_count + lookup_count;
+		filter->lookups[lookup_count] = (struct filter_lookup){
+			.first_arg = nodes[node->first].arg,
+			.second_arg = nodes[node->second].arg,
+			.table_idx = lookup_count,
+		};
+		struct filter_table *table = filter->tables + lookup_count;
+		if (filter_table_copy(table, node->table, scratch))
+			return -1;
+		// Emitted tables are freed with the filter on failure
+		filter->filter.lookup_count = ++lookup_count;
+
+		report->nodes[node_idx].h_dim = table->first_dim;
+		report->nodes[node_idx].v_dim = table->second_dim;
+		report->nodes[node_idx].bytes = filter_table_size(table);
+		uint64_t vtab_bytes = value_table_size(node->table);
+		value_table_free(node->table);
+		memset(node->table, 0, sizeof(struct value_table));
+		ipfw_compile_release(ctx, vtab_bytes);
+		if (ipfw_compile_charge(
+			ctx, report->nodes[node_idx].bytes, "filter table"))
+			return -1;
+	}
+
+	// Tables are run by the match routine which drops non-IPv6 packets
+	filter->filter.match = ipfw_tables_process;
+	filter->filter.classify_count = classify_count;
+	filter->filter.classify = filter->classify;
+	filter->filter.lookup_count = lookup_count;
+	filter->filter.lookups = filter->lookups;
+	filter->filter.tables = filter->tables;
+
+	return 0;
+}
+
+/*
+ * The routine frees structures of the compiled cross-product classifier.
+ */
+static void
+ipfw_compiled_free(struct ipfw_packet_filter *filter)
+{
+	for (uint32_t idx = 0; idx < filter->filter.lookup_count; ++idx)
+		filter_table_free(filter->tables + idx);
+	action_list_registry_free(&filter->action_lists);
+	for (uint32_t chunk = 0; chunk < IPFW_NET6_CHUNK_MAX; ++chunk) {
+		host_table_free(filter->dst_net6_hosts + chunk);
+		lpm64_free(filter->dst_net6 + chunk);
+		host_table_free(filter->src_net6_hosts + chunk);
+		lpm64_free(filter->src_net6 + chunk);
+	}
+}
+
+/*
+ * The routine joins registries of the stage arguments into the stage
+ * table taking cells from the cell budget clamped by the memory budget.
+ * The stage registry is collected unless the stage is the last one.
+ */
+static int
+ipfw_compile_stage(
+	struct ipfw_compile_ctx *ctx,
+	struct ipfw_filter_action *actions,
+	const uint32_t *rule_map,
+	struct value_registry *registries,
+	struct ipfw_node *node,
+	uint32_t node_idx,
+	bool last,
+	struct action_list_registry *action_lists,
+	uint64_t *budget)
+{
+	uint64_t start = ipfw_compile_now();
+	uint64_t cells = *budget;
+	bool memory_bound = ipfw_compile_cells(ctx) < cells;
+	if (memory_bound)
+		cells = ipfw_compile_cells(ctx);
+	uint64_t stage_budget = cells;
+
+	int res;
+	if (last)
+		res = set_registry_values(
+			actions,
+			rule_map,
+			registries + node->first,
+			registries + node->second,
+			node->table,
+			action_lists,
+			&cells);
+	else
+		res = merge_and_collect_registry(
+			registries + node->first,
+			registries + node->second,
+			node->table,
+			registries + node_idx,
+			&cells);
+	if (res) {
+		if (errno == E2BIG)
+			ipfw_compile_error(
+				ctx,
+				"stage %u exceeds %s budget",
+				node_idx,
+				memory_bound ? "memory" : "table cell");
+		return -1;
+	}
+	*budget -= stage_budget - cells;
+
+	struct ipfw_compile_node *report = ctx->report->nodes + node_idx;
+	report->value_count = last
+		? action_list_registry_count(action_lists)
+		: value_registry_capacity(registries + node_idx);
+	report->nsec = ipfw_compile_now() - start;
+
+	uint64_t bytes = value_table_size(node->table);
+	if (!last)
+		bytes += value_registry_size(registries + node_idx);
+	if (ipfw_compile_charge(ctx, bytes, "stage"))
+		return -1;
+
+	// Each node is an argument of exactly one stage
+	uint32_t args[2] = {node->first, node->second};
+	for (uint32_t idx = 0; idx < 2; ++idx) {
+		struct value_registry *registry = registries + args[idx];
+		ipfw_compile_release(ctx, value_registry_size(registry));
+		value_registry_free(registry);
+		memset(registry, 0, sizeof(struct value_registry));
+	}
+	return 0;
+}
+
+/*
+ * Compile scratch is taken from the arena and dropped at once in the end.
+ */
+#define IPFW_SCRATCH_BLOCK_SIZE (1 << 16)
+
+/*
+ * The routine compiles cross-product classifier of the rules with IPv6
+ * addresses split into chunks of the width. The filter is left untouched
+ * in case of error.
+ *
+ * Intermediates are released as soon as their consumer is done: expanded
+ * rules after classifiers are collected, registries after the stage of
+ * their node, port tables after classes are merged and stage tables once
+ * copied into the filter.
+ */
+static int
+ipfw_packet_filter_compile(
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	uint8_t chunk_width,
+	struct ipfw_packet_filter *filter,
+	uint64_t budget,
+	struct ipfw_compile_ctx *ctx)
+{
+	int res = -1;
+
+	uint32_t chunk_count = 128 / chunk_width;
+	struct ipfw_dag dag;
+	ipfw_dag_init(&dag, chunk_count);
+	struct ipfw_node *nodes = dag.nodes;
+
+	struct ipfw_compile_report *report = ctx->report;
+	ipfw_compile_start(ctx, IPFW_COMPILE_CROSS_PRODUCT);
+	report->classify_count = dag.classify_count;
+	report->node_count = dag.node_count;
+
+	// Registry and table of each node producing values
+	struct value_registry registries[IPFW_NODE_MAX];
+	struct value_table tables[IPFW_NODE_MAX];
+
+	// Rules are compiled as is unless chunks are narrower than halves
+	struct ipfw_filter_action *rules = actions;
+	uint32_t rule_count = count;
+	uint32_t *rule_map = NULL;
+
+	// Zeroed items are safe to free so there is only one cleanup path
+	memset(filter->src_net6, 0, sizeof(filter->src_net6));
+	memset(filter->dst_net6, 0, sizeof(filter->dst_net6));
+	memset(filter->src_net6_hosts, 0, sizeof(filter->src_net6_hosts));
+	memset(filter->dst_net6_hosts, 0, sizeof(filter->dst_net6_hosts));
+	memset(&filter->action_lists, 0, sizeof(struct action_list_registry));
+	filter->filter.lookup_count = 0;
+	memset(registries, 0, sizeof(registries));
+	memset(tables, 0, sizeof(tables));
+
+	struct arena scratch;
+	arena_init(&scratch, IPFW_SCRATCH_BLOCK_SIZE);
+
+	if (chunk_count > 2 &&
+	    ipfw_chunk_rules_expand(
+		actions,
+		count,
+		chunk_width,
+		&rules,
+		&rule_count,
+		&rule_map)) {
+		rules = NULL;
+		goto cleanup;
+	}
+	report->rule_count = rule_count;
+
+	for (uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+		struct ipfw_node *src = nodes + chunk;
+		struct ipfw_node *dst = nodes + chunk_count + chunk;
+		uint64_t start = ipfw_compile_now();
+
+		src->classify = filter_classify_src_net6[chunk];
+		src->lpm = filter->src_net6 + chunk;
+		src->hosts = filter->src_net6_hosts + chunk;
+		dst->classify = filter_classify_dst_net6[chunk];
+		dst->lpm = filter->dst_net6 + chunk;
+		dst->hosts = filter->dst_net6_hosts + chunk;
+
+		if (collect_network_values(
+			rules,
+			rule_count,
+			action_get_net6_src,
+			chunk,
+			chunk_width,
+			src->lpm,
+			src->hosts,
+			registries + chunk) ||
+		    collect_network_values(
+			rules,
+			rule_count,
+			action_get_net6_dst,
+			chunk,
+			chunk_width,
+			dst->lpm,
+			dst->hosts,
+			registries + chunk_count + chunk))
+			goto cleanup;
+
+		uint64_t nsec = (ipfw_compile_now() - start) / 2;
+		for (uint32_t node_idx = chunk;
+		     node_idx < chunk_count * 2;
+		     node_idx += chunk_count) {
+			struct ipfw_node *node = nodes + node_idx;
+			struct ipfw_compile_node *node_report =
+				report->nodes + node_idx;
+			node_report->value_count =
+				value_registry_capacity(registries + node_idx);
+			node_report->bytes =
+				lpm64_size(node->lpm) + host_table_size(node->hosts);
+			node_report->nsec = nsec;
+			if (ipfw_compile_charge(
+				ctx,
+				node_report->bytes +
+					value_registry_size(registries + node_idx),
+				"network classifier"))
+				goto cleanup;
+		}
+	}
+
+	uint32_t src_port_idx = chunk_count * 2;
+	uint32_t dst_port_idx = chunk_count * 2 + 1;
+	nodes[src_port_idx].classify = filter_classify_src_port;
+	nodes[src_port_idx].table = tables + src_port_idx;
+	nodes[dst_port_idx].classify = filter_classify_dst_port;
+	nodes[dst_port_idx].table = tables + dst_port_idx;
+
+	if (collect_port_values(
+		rules,
+		rule_count,
+		get_port_range_src,
+		tables + src_port_idx,
+		registries + src_port_idx) ||
+	    collect_port_values(
+		rules,
+		rule_count,
+		get_port_range_dst,
+		tables + dst_port_idx,
+		registries + dst_port_idx))
+		goto cleanup;
+
+	// Expanded rules are needed to collect classifier values only
+	if (rules != actions) {
+		ipfw_chunk_rules_free(rules, rule_count);
+		rules = actions;
+	}
+
+	for (uint32_t node_idx = src_port_idx;
+	     node_idx <= dst_port_idx;
+	     ++node_idx) {
+		struct ipfw_compile_node *node_report = report->nodes + node_idx;
+		node_report->value_count =
+			value_registry_capacity(registries + node_idx);
+		node_report->bytes = sizeof(filter->src_port);
+		if (ipfw_compile_charge(
+			ctx,
+			value_table_size(tables + node_idx) +
+				value_registry_size(registries + node_idx),
+			"port classifier"))
+			goto cleanup;
+	}
+
+	uint32_t last_idx = dag.node_count - 1;
+	for (uint32_t node_idx = dag.classify_count;
+	     node_idx <= last_idx;
+	     ++node_idx) {
+		nodes[node_idx].table = tables + node_idx;
+		if (ipfw_compile_stage(
+			ctx,
+			actions,
+			rule_map,
+			registries,
+			nodes + node_idx,
+			node_idx,
+			node_idx == last_idx,
+			&filter->action_lists,
+			&budget))
+			goto cleanup;
+	}
+
+	/*
+	 * Merge equivalent classifier identifiers going from the last stage
+	 * to the first one, so each stage and classifier shrinks.
+	 */
+	for (uint32_t node_idx = last_idx;
+	     node_idx >= dag.classify_count;
+	     --node_idx) {
+		struct ipfw_node *node = nodes + node_idx;
+		if (merge_table_classes(
+			node->table,
+			nodes + node->first,
+			nodes + node->second,
+			&scratch))
+			goto cleanup;
+	}
+
+	uint32_t result;
+	if (ipfw_prune_nodes(&dag, &scratch, &result))
+		goto cleanup;
+
+	// Port classes are final after pruning
+	for (uint32_t port = 0; port < 65536; ++port) {
+		filter->src_port[port] =
+			value_table_get(tables + src_port_idx, 0, port);
+		filter->dst_port[port] =
+			value_table_get(tables + dst_port_idx, 0, port);
+	}
+	for (uint32_t node_idx = src_port_idx;
+	     node_idx <= dst_port_idx;
+	     ++node_idx) {
+		ipfw_compile_release(ctx, value_table_size(tables + node_idx));
+		value_table_free(tables + node_idx);
+		memset(tables + node_idx, 0, sizeof(struct value_table));
+	}
+
+	if (ipfw_emit_nodes(filter, &dag, result, ctx, &scratch))
+		goto cleanup;
+
+	for (uint32_t node_idx = 0; node_idx < dag.node_count; ++node_idx)
+		report->filter_bytes += report->nodes[node_idx].bytes;
+	report->action_list_count =
+		action_list_registry_count(&filter->action_lists);
+
+	// Constant result is returned by the only port classifier
+	if (result == IPFW_NODE_CONST) {
+		for (uint32_t port = 0; port < 65536; ++port)
+			filter->dst_port[port] = nodes[last_idx].value;
+	}
+
+	filter->net6_chunk_width = chunk_width;
+	res = 0;
+
+cleanup:
+	if (rules != actions && rules != NULL)
+		ipfw_chunk_rules_free(rules, rule_count);
+	free(rule_map);
+	for (uint32_t node_idx = 0; node_idx < dag.node_count; ++node_idx) {
+		value_table_free(tables + node_idx);
+		value_registry_free(registries + node_idx);
+	}
+	arena_free(&scratch);
+
+	if (res)
+		ipfw_compiled_free(filter);
+
+	return res;
+}
+
+/*
+ * Cell budget of all stage tables. Rules making the cross-product tables
+ * exceed the budget are matched with the fallback tuple space instead.
+ */
+#define IPFW_TABLE_CELL_BUDGET ((uint64_t)1 << 28)
+#define IPFW_FALLBACK_RULE_MAX 256
+
+struct ipfw_rule_score {
+	double score;
+	uint32_t rule;
+};
+
+static int
+ipfw_rule_score_cmp(const void *first, const void *second)
+{
+	const struct ipfw_rule_score *score1 =
+		(const struct ipfw_rule_score *)first;
+	const struct ipfw_rule_score *score2 =
+		(const struct ipfw_rule_score *)second;
+	if (score1->score != score2->score)
+		return score1->score > score2->score ? -1 : 1;
+	return score1->rule < score2->rule ? -1 : 1;
+}
+
+static int
+ipfw_rule_cmp(const void *first, const void *second)
+{
+	uint32_t rule1 = *(const uint32_t *)first;
+	uint32_t rule2 = *(const uint32_t *)second;
+	return rule1 < rule2 ? -1 : rule1 > rule2;
+}
+
+/*
+ * Part of stage cells covered by a rule. A rule covering all cells of a
+ * stage does not split its classes so only partial coverage is counted.
+ */
+static inline double
+ipfw_stage_score(double cells, double total)
+{
+	return cells < total ? cells : 0;
+}
+
+/*
+ * The routine estimates how much each rule multiplies stage tables as the
+ * count of stage cells the rule covers partially. Rules wide in some
+ * dimensions and narrow in other ones get the most score while rules
+ * matching exact or any values get the least one. Stages joining other
+ * stages are estimated as products of the producer estimates.
+ */
+static int
+ipfw_rule_scores(
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	struct ipfw_rule_score *scores)
+{
+	int res = -1;
+
+	// src hi, src lo, dst hi, dst lo, src port and dst port values
+	struct value_registry registries[TUPLE_FIELD_COUNT];
+	struct lpm64 lpms[4];
+	struct host_table hosts[4];
+	struct value_table port_vtabs[2];
+	memset(registries, 0, sizeof(registries));
+	memset(lpms, 0, sizeof(lpms));
+	memset(hosts, 0, sizeof(hosts));
+	memset(port_vtabs, 0, sizeof(port_vtabs));
+
+	if (collect_network_values(
+		actions, count, action_get_net6_src, 0, 64,
+		lpms + 0, hosts + 0, registries + 0) ||
+	    collect_network_values(
+		actions, count, action_get_net6_src, 1, 64,
+		lpms + 1, hosts + 1, registries + 1) ||
+	    collect_network_values(
+		actions, count, action_get_net6_dst, 0, 64,
+		lpms + 2, hosts + 2, registries + 2) ||
+	    collect_network_values(
+		actions, count, action_get_net6_dst, 1, 64,
+		lpms + 3, hosts + 3, registries + 3) ||
+	    collect_port_values(
+		actions, count, get_port_range_src,
+		port_vtabs + 0, registries + 4) ||
+	    collect_port_values(
+		actions, count, get_port_range_dst,
+		port_vtabs + 1, registries + 5))
+		goto cleanup;
+
+	double totals[TUPLE_FIELD_COUNT];
+	for (uint32_t idx = 0; idx < TUPLE_FIELD_COUNT; ++idx)
+		totals[idx] = value_registry_capacity(registries + idx);
+
+	for (uint32_t rule = 0; rule < count; ++rule) {
+		double cells[TUPLE_FIELD_COUNT];
+		for (uint32_t idx = 0; idx < TUPLE_FIELD_COUNT; ++idx)
+			cells[idx] = registries[idx].ranges[rule].count;
+
+		double cells1 = cells[0] * cells[2];
+		double cells2 = cells[1] * cells[3];
+		double cells3 = cells[4] * cells[5];
+		double total1 = totals[0] * totals[2];
+		double total2 = totals[1] * totals[3];
+		double total3 = totals[4] * totals[5];
+
+		scores[rule].rule = rule;
+		scores[rule].score =
+			ipfw_stage_score(cells1, total1) +
+			ipfw_stage_score(cells2, total2) +
+			ipfw_stage_score(cells3, total3) +
+			ipfw_stage_score(cells1 * cells2, total1 * total2) +
+			ipfw_stage_score(
+				cells1 * cells2 * cells3,
+				total1 * total2 * total3);
+	}
+
+	res = 0;
+
+cleanup:
+	for (uint32_t idx = 0; idx < TUPLE_FIELD_COUNT; ++idx)
+		value_registry_free(registries + idx);
+	for (uint32_t idx = 0; idx < 4; ++idx) {
+		host_table_free(hosts + idx);
+		lpm64_free(lpms + idx);
+	}
+	value_table_free(port_vtabs + 0);
+	value_table_free(port_vtabs + 1);
+	return res;
+}
+
+/*
+ * The routine splits port range into prefixes and returns its count.
+ */
+static uint32_t
+port_range_prefixes(
+	const struct ipfw_port_range *range,
+	uint64_t *values,
+	uint64_t *masks)
+{
+	uint32_t count = 0;
+	uint32_t value = range->from;
+	while (value <= range->to) {
+		uint32_t size = value ? value & -value : 0x10000;
+		while (value + size - 1 > range->to)
+			size >>= 1;
+		values[count] = value;
+		masks[count] = 0xffff & ~(size - 1);
+		++count;
+		value += size;
+	}
+	return count;
+}
+
+#define IPFW_PORT_RANGE_PREFIX_MAX 32
+
+/*
+ * The routine expands the rule into tuple space entries. Address halves
+ * and ports are matched independently the same way the cross-product
+ * classifier does.
+ */
+static int
+ipfw_fallback_insert(
+	struct tuple_space *space,
+	struct ipfw_filter_action *action,
+	uint32_t pos)
+{
+	struct ipfw_filter *filter = &action->filter;
+	uint32_t counts[TUPLE_FIELD_COUNT] = {
+		filter->net6.src_count,
+		filter->net6.src_count,
+		filter->net6.dst_count,
+		filter->net6.dst_count,
+		0,
+		0,
+	};
+	uint64_t *values[TUPLE_FIELD_COUNT];
+	uint64_t *masks[TUPLE_FIELD_COUNT];
+	uint32_t sizes[TUPLE_FIELD_COUNT] = {
+		counts[0], counts[1], counts[2], counts[3],
+		filter->transport.src_count * IPFW_PORT_RANGE_PREFIX_MAX,
+		filter->transport.dst_count * IPFW_PORT_RANGE_PREFIX_MAX,
+	};
+
+	int res = -1;
+	uint32_t field;
+	for (field = 0; field < TUPLE_FIELD_COUNT; ++field) {
+		values[field] = (uint64_t *)
+			malloc(sizeof(uint64_t) * (sizes[field] + 1));
+		masks[field] = (uint64_t *)
+			malloc(sizeof(uint64_t) * (sizes[field] + 1));
+		if (values[field] == NULL || masks[field] == NULL) {
+			++field;
+			goto cleanup;
+		}
+	}
+
+	for (uint32_t idx = 0; idx < filter->net6.src_count; ++idx) {
+		struct ipfw_net6 *net = filter->net6.srcs + idx;
+		net6_get_chunk(net, 0, 64, values[0] + idx, masks[0] + idx);
+		net6_get_chunk(net, 1, 64, values[1] + idx, masks[1] + idx);
+	}
+	for (uint32_t idx = 0; idx < filter->net6.dst_count; ++idx) {
+		struct ipfw_net6 *net = filter->net6.dsts + idx;
+		net6_get_chunk(net, 0, 64, values[2] + idx, masks[2] + idx);
+		net6_get_chunk(net, 1, 64, values[3] + idx, masks[3] + idx);
+	}
+	for (uint32_t idx = 0; idx < filter->transport.src_count; ++idx) {
+		counts[4] += port_range_prefixes(
+			filter->transport.srcs + idx,
+			values[4] + counts[4],
+			masks[4] + counts[4]);
+	}
+	for (uint32_t idx = 0; idx < filter->transport.dst_count; ++idx) {
+		counts[5] += port_range_prefixes(
+			filter->transport.dsts + idx,
+			values[5] + counts[5],
+			masks[5] + counts[5]);
+	}
+
+	// Rule with an empty field matches nothing
+	res = 0;
+	bool empty = false;
+	for (field = 0; field < TUPLE_FIELD_COUNT; ++field)
+		empty |= !counts[field];
+
+	// Go through all combinations of field items
+	uint32_t items[TUPLE_FIELD_COUNT] = {0};
+	while (!empty) {
+		struct tuple_key key;
+		struct tuple_key key_masks;
+		for (field = 0; field < TUPLE_FIELD_COUNT; ++field) {
+			key.fields[field] = values[field][items[field]];
+			key_masks.fields[field] = masks[field][items[field]];
+		}
+		if (tuple_space_insert(space, &key, &key_masks, pos)) {
+			res = -1;
+			break;
+		}
+
+		for (field = 0; field < TUPLE_FIELD_COUNT; ++field) {
+			if (++items[field] < counts[field])
+				break;
+			items[field] = 0;
+		}
+		if (field == TUPLE_FIELD_COUNT)
+			break;
+	}
+
+	field = TUPLE_FIELD_COUNT;
+
+cleanup:
+	while (field-- > 0) {
+		free(masks[field]);
+		free(values[field]);
+	}
+	return res;
+}
+
+/*
+ * The routine builds the fallback tuple space of the rules and the table
+ * merging each primary list with each fallback rule: primary rules
+ * preceding the fallback one are kept and the fallback rule terminates
+ * the list. The tuple space is charged as it grows.
+ */
+static int
+ipfw_fallback_build(
+	struct ipfw_compile_ctx *ctx,
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	const uint32_t *rules,
+	uint32_t rule_count,
+	struct ipfw_packet_filter *filter)
+{
+	uint64_t space_bytes = 0;
+	for (uint32_t pos = 0; pos < rule_count; ++pos) {
+		if (ipfw_fallback_insert(
+			&filter->fallback, actions + rules[pos], pos))
+			return -1;
+
+		uint64_t bytes = tuple_space_size(&filter->fallback);
+		if (ipfw_compile_charge(
+			ctx, bytes - space_bytes, "fallback tuple space"))
+			return -1;
+		space_bytes = bytes;
+	}
+	tuple_space_finish(&filter->fallback);
+	ctx->report->filter_bytes += space_bytes;
+
+	struct action_list_registry *lists = &filter->action_lists;
+	uint32_t list_count = action_list_registry_count(lists);
+
+	filter->fallback_limits = (uint32_t *)
+		malloc(sizeof(uint32_t) * list_count);
+	if (filter->fallback_limits == NULL)
+		return -1;
+	if (filter_table_init(
+		&filter->fallback_lists, list_count, rule_count))
+		return -1;
+
+	for (uint32_t list = 0; list < list_count; ++list) {
+		uint32_t term = count;
+		if (list != ACTION_LIST_EMPTY &&
+		    !(actions[action_list_last(lists, list)].action &
+		      IPFW_ACTION_NON_TERMINATE))
+			term = action_list_last(lists, list);
+
+		uint32_t limit = 0;
+		while (limit < rule_count && rules[limit] < term)
+			++limit;
+		filter->fallback_limits[list] = limit;
+
+		for (uint32_t pos = 0; pos < limit; ++pos) {
+			uint32_t prefix = list;
+			while (prefix != ACTION_LIST_EMPTY &&
+			       action_list_last(lists, prefix) > rules[pos])
+				prefix = action_list_parent(lists, prefix);
+
+			uint32_t merged;
+			if (action_list_append(
+				lists, prefix, rules[pos], &merged))
+				return -1;
+			filter->fallback_lists.values[pos * list_count + list] =
+				merged;
+		}
+	}
 
 	return 0;
 }
+
+/*
+ * The routine moves rules exploding the cross-product classifier into
+ * the fallback tuple space. Rules are moved in the order of its score
+ * doubling the count until tables fit the budget.
+ */
+static int
+ipfw_packet_filter_create_hybrid(
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	uint8_t chunk_width,
+	struct ipfw_packet_filter *filter,
+	struct ipfw_compile_ctx *ctx)
+{
+	int res = -1;
+	bool compiled = false;
+
+	struct ipfw_rule_score *scores = (struct ipfw_rule_score *)
+		malloc(sizeof(struct ipfw_rule_score) * (count + 1));
+	uint32_t *rules = (uint32_t *)malloc(sizeof(uint32_t) * (count + 1));
+	struct ipfw_filter_action *primary = (struct ipfw_filter_action *)
+		malloc(sizeof(struct ipfw_filter_action) * (count + 1));
+	if (scores == NULL || rules == NULL || primary == NULL)
+		goto cleanup;
+
+	if (ipfw_rule_scores(actions, count, scores))
+		goto cleanup;
+	qsort(scores, count, sizeof(struct ipfw_rule_score),
+	      ipfw_rule_score_cmp);
+
+	// Fallback lookup returns the first matched rule so it must be terminal
+	uint32_t candidate_count = 0;
+	for (uint32_t idx = 0;
+	     idx < count && candidate_count < IPFW_FALLBACK_RULE_MAX;
+	     ++idx) {
+		if (scores[idx].score > 0 &&
+		    !(actions[scores[idx].rule].action &
+		      IPFW_ACTION_NON_TERMINATE))
+			rules[candidate_count++] = scores[idx].rule;
+	}
+
+	uint32_t rule_count = 0;
+	for (uint32_t step = 1; ; step *= 2) {
+		rule_count = step < candidate_count ? step : candidate_count;
+
+		// Moved rules match nothing but keep rule indices
+		memcpy(primary, actions,
+		       sizeof(struct ipfw_filter_action) * count);
+		for (uint32_t idx = 0; idx < rule_count; ++idx) {
+			struct ipfw_filter *rule = &primary[rules[idx]].filter;
+			rule->net6.src_count = 0;
+			rule->net6.dst_count = 0;
+			rule->transport.src_count = 0;
+			rule->transport.dst_count = 0;
+		}
+
+		if (!ipfw_packet_filter_compile(
+			primary, count, chunk_width, filter,
+			IPFW_TABLE_CELL_BUDGET, ctx))
+			break;
+		if (errno != E2BIG || rule_count == candidate_count)
+			goto cleanup;
+	}
+
+	compiled = true;
+
+	// Fallback lists table and limits take a cell per list of the tables
+	struct ipfw_compile_report *report = ctx->report;
+	uint64_t fallback_bytes = sizeof(uint32_t) * (rule_count + 1) *
+		action_list_registry_count(&filter->action_lists);
+	if (ipfw_compile_charge(ctx, fallback_bytes, "fallback lists"))
+		goto cleanup;
+
+	qsort(rules, rule_count, sizeof(uint32_t), ipfw_rule_cmp);
+	if (ipfw_fallback_build(
+		ctx, actions, count, rules, rule_count, filter))
+		goto cleanup;
+
+	// Fallback rules are merged into table results by the match routine
+	filter->filter.match = ipfw_hybrid_process;
+
+	report->strategy = IPFW_COMPILE_HYBRID;
+	report->fallback_rule_count = rule_count;
+	report->action_list_count =
+		action_list_registry_count(&filter->action_lists);
+	report->filter_bytes += fallback_bytes;
+	res = 0;
+
+cleanup:
+	if (res && compiled) {
+		filter_table_free(&filter->fallback_lists);
+		free(filter->fallback_limits);
+		filter->fallback_limits = NULL;
+		tuple_space_free(&filter->fallback);
+		tuple_space_init(&filter->fallback);
+		ipfw_compiled_free(filter);
+	}
+	free(primary);
+	free(rules);
+	free(scores);
+	return res;
+}
+
+/*
+ * Small rulesets are scanned linearly instead of cross-product lookups.
+ * Linear matcher result is converted into an action list at runtime so all
+ * lists must be registered in advance and the count of non-terminal rules
+ * is limited as each their combination is a separate list.
+ */
+#define IPFW_LINEAR_RULE_MAX LINEAR_RULE_MAX
+#define IPFW_LINEAR_NON_TERMINATE_MAX 4
+
+static inline uint64_t
+ipfw_net6_part_to(uint64_t addr, uint64_t mask)
+{
+	return be64toh(addr | ~mask);
+}
+
+/*
+ * The routine registers lists of any non-terminal rules following the
+ * list and optionally terminated with a terminal rule.
+ */
+static int
+ipfw_linear_register_lists(
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	struct action_list_registry *registry,
+	uint32_t list,
+	uint32_t from)
+{
+	for (uint32_t rule = from; rule < count; ++rule) {
+		uint32_t child;
+		if (action_list_append(registry, list, rule, &child))
+			return -1;
+		if (!(actions[rule].action & IPFW_ACTION_NON_TERMINATE))
+			continue;
+		if (ipfw_linear_register_lists(
+			actions, count, registry, child, rule + 1))
+			return -1;
+	}
+	return 0;
+}
+
+static int
+ipfw_linear_create(
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	struct ipfw_packet_filter *filter,
+	struct ipfw_compile_ctx *ctx)
+{
+	ipfw_compile_start(ctx, IPFW_COMPILE_LINEAR);
+	ctx->report->rule_count = count;
+
+	struct linear_matcher *matcher = &filter->linear;
+	linear_matcher_init(matcher);
+	matcher->rule_count = count;
+
+	for (uint32_t rule = 0; rule < count; ++rule) {
+		struct ipfw_filter *rule_filter = &actions[rule].filter;
+		if (!(actions[rule].action & IPFW_ACTION_NON_TERMINATE))
+			matcher->terminal |= (uint64_t)1 << rule;
+
+		for (uint32_t idx = 0; idx < rule_filter->net6.src_count; ++idx) {
+			struct ipfw_net6 *net = rule_filter->net6.srcs + idx;
+			if (linear_matcher_add(
+				matcher, 0, be64toh(net->addr_hi),
+				ipfw_net6_part_to(net->addr_hi, net->mask_hi),
+				rule) ||
+			    linear_matcher_add(
+				matcher, 1, be64toh(net->addr_lo),
+				ipfw_net6_part_to(net->addr_lo, net->mask_lo),
+				rule))
+				goto error;
+		}
+		for (uint32_t idx = 0; idx < rule_filter->net6.dst_count; ++idx) {
+			struct ipfw_net6 *net = rule_filter->net6.dsts + idx;
+			if (linear_matcher_add(
+				matcher, 2, be64toh(net->addr_hi),
+				ipfw_net6_part_to(net->addr_hi, net->mask_hi),
+				rule) ||
+			    linear_matcher_add(
+				matcher, 3, be64toh(net->addr_lo),
+				ipfw_net6_part_to(net->addr_lo, net->mask_lo),
+				rule))
+				goto error;
+		}
+		for (uint32_t idx = 0;
+		     idx < rule_filter->transport.src_count;
+		     ++idx) {
+			struct ipfw_port_range *range =
+				rule_filter->transport.srcs + idx;
+			if (linear_matcher_add(
+				matcher, 4, range->from, range->to, rule))
+				goto error;
+		}
+		for (uint32_t idx = 0;
+		     idx < rule_filter->transport.dst_count;
+		     ++idx) {
+			struct ipfw_port_range *range =
+				rule_filter->transport.dsts + idx;
+			if (linear_matcher_add(
+				matcher, 5, range->from, range->to, rule))
+				goto error;
+		}
+	}
+
+	if (action_list_registry_init(&filter->action_lists))
+		goto error;
+	if (ipfw_linear_register_lists(
+		actions, count, &filter->action_lists, ACTION_LIST_EMPTY, 0)) {
+		action_list_registry_free(&filter->action_lists);
+		goto error;
+	}
+
+	// Ranges and lists of small rulesets are charged once they are built
+	uint64_t bytes = linear_matcher_size(matcher) +
+		action_list_registry_size(&filter->action_lists);
+	if (ipfw_compile_charge(ctx, bytes, "linear matcher")) {
+		action_list_registry_free(&filter->action_lists);
+		goto error;
+	}
+
+	ctx->report->filter_bytes += bytes;
+	ctx->report->action_list_count =
+		action_list_registry_count(&filter->action_lists);
+
+	filter->filter.match = ipfw_linear_process;
+	filter->filter.classify_count = 0;
+	filter->filter.lookup_count = 0;
+	return 0;
+
+error:
+	linear_matcher_free(matcher);
+	return -1;
+}
+
+/*
+ * Mid-size rulesets exceeding the table budget are matched with the
+ * bit-vector matcher if its bitmaps fit the budget. As with the linear
+ * matcher lists are registered in advance, so the count of lists that
+ * rules sharing packets may form is limited as well.
+ */
+#define IPFW_BITVECTOR_RULE_MAX 8192
+#define IPFW_BITVECTOR_LIST_MAX (1 << 20)
+
+struct ipfw_bitvector_ctx {
+	struct ipfw_compile_ctx *compile;
+	struct ipfw_filter_action *actions;
+	struct bitvector_matcher *matcher;
+	struct action_list_registry *registry;
+	// Registry bytes taken from the memory budget so far
+	uint64_t registry_bytes;
+	// Bitsets of field values are placed one by one
+	uint32_t value_word_counts[BITVECTOR_FIELD_COUNT];
+	uint32_t value_word_count;
+	// Value bitsets of each rule
+	uint64_t *rule_values;
+	/*
+	 * Each list depth takes a frame of candidate rules and child values.
+	 * Lists grow by non-terminal rules only, so depth is bounded by
+	 * their count.
+	 */
+	uint64_t *stack;
+	uint32_t frame_word_count;
+	uint64_t *field_rules;
+};
+
+/*
+ * The routine registers lists extending the list with rules which share
+ * a packet with all rules of the list. Such rules have a value from the
+ * value bitset common for the list rules in each field.
+ */
+static int
+ipfw_bitvector_register_lists(
+	struct ipfw_bitvector_ctx *ctx,
+	uint32_t list,
+	const uint64_t *values,
+	uint32_t from,
+	uint32_t depth)
+{
+	struct bitvector_matcher *matcher = ctx->matcher;
+	uint64_t *candidates = ctx->stack + (size_t)depth * ctx->frame_word_count;
+	uint64_t *child_values = candidates + matcher->word_count;
+	uint64_t *field_rules = ctx->field_rules;
+
+	memset(candidates, 0xff, sizeof(uint64_t) * matcher->word_count);
+	const uint64_t *field_values = values;
+	for (uint32_t field = 0; field < BITVECTOR_FIELD_COUNT; ++field) {
+		memset(field_rules, 0, sizeof(uint64_t) * matcher->word_count);
+		for (uint32_t idx = 0;
+		     idx < ctx->value_word_counts[field];
+		     ++idx) {
+			for (uint64_t bits = field_values[idx]; bits;
+			     bits &= bits - 1) {
+				uint32_t value =
+					idx * 64 + __builtin_ctzll(bits);
+				if (value >= matcher->value_counts[field])
+					break;
+				const uint64_t *bitmap =
+					bitvector_matcher_bitmap(
+						matcher, field, value);
+				for (uint32_t word = 0;
+				     word < matcher->word_count;
+				     ++word)
+					field_rules[word] |= bitmap[word];
+			}
+		}
+		for (uint32_t word = 0; word < matcher->word_count; ++word)
+			candidates[word] &= field_rules[word];
+		field_values += ctx->value_word_counts[field];
+	}
+
+	for (uint32_t word = from / 64; word < matcher->word_count; ++word) {
+		uint64_t bits = candidates[word];
+		if (word == from / 64)
+			bits &= ~(uint64_t)0 << (from % 64);
+		for (; bits; bits &= bits - 1) {
+			uint32_t rule = word * 64 + __builtin_ctzll(bits);
+
+			uint32_t child;
+			if (action_list_append(ctx->registry, list, rule, &child))
+				return -1;
+			if (action_list_registry_count(ctx->registry) >
+			    IPFW_BITVECTOR_LIST_MAX) {
+				ipfw_compile_error(
+					ctx->compile,
+					"bit-vector exceeds list limit");
+				errno = E2BIG;
+				return -1;
+			}
+			uint64_t bytes = action_list_registry_size(ctx->registry);
+			if (bytes > ctx->registry_bytes) {
+				if (ipfw_compile_charge(
+					ctx->compile,
+					bytes - ctx->registry_bytes,
+					"bit-vector action lists"))
+					return -1;
+				ctx->registry_bytes = bytes;
+			}
+
+			if (!(ctx->actions[rule].action &
+			      IPFW_ACTION_NON_TERMINATE))
+				continue;
+
+			// Values common for the child list rules
+			const uint64_t *rule_values = ctx->rule_values +
+				(size_t)rule * ctx->value_word_count;
+			for (uint32_t idx = 0; idx < ctx->value_word_count; ++idx)
+				child_values[idx] = values[idx] & rule_values[idx];
+
+			if (ipfw_bitvector_register_lists(
+				ctx, child, child_values, rule + 1, depth + 1))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+ipfw_bitvector_create(
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	struct ipfw_packet_filter *filter,
+	struct ipfw_compile_ctx *ctx)
+{
+	int res = -1;
+
+	struct ipfw_compile_report *report = ctx->report;
+	ipfw_compile_start(ctx, IPFW_COMPILE_BITVECTOR);
+	report->rule_count = count;
+	report->classify_count = BITVECTOR_FIELD_COUNT;
+	report->node_count = BITVECTOR_FIELD_COUNT;
+
+	struct value_registry registries[BITVECTOR_FIELD_COUNT];
+	struct value_table port_vtabs[2];
+	uint64_t *values = NULL;
+	uint64_t scratch_bytes = 0;
+	memset(registries, 0, sizeof(registries));
+	memset(port_vtabs, 0, sizeof(port_vtabs));
+	memset(filter->src_net6, 0, sizeof(filter->src_net6));
+	memset(filter->dst_net6, 0, sizeof(filter->dst_net6));
+	memset(filter->src_net6_hosts, 0, sizeof(filter->src_net6_hosts));
+	memset(filter->dst_net6_hosts, 0, sizeof(filter->dst_net6_hosts));
+	memset(&filter->action_lists, 0, sizeof(struct action_list_registry));
+	memset(&filter->bitvector, 0, sizeof(struct bitvector_matcher));
+
+	// Fields are ordered as the filter classifiers
+	if (collect_network_values(
+		actions, count, action_get_net6_src, 0, 64,
+		filter->src_net6 + 0, filter->src_net6_hosts + 0,
+		registries + 0) ||
+	    collect_network_values(
+		actions, count, action_get_net6_src, 1, 64,
+		filter->src_net6 + 1, filter->src_net6_hosts + 1,
+		registries + 1) ||
+	    collect_network_values(
+		actions, count, action_get_net6_dst, 0, 64,
+		filter->dst_net6 + 0, filter->dst_net6_hosts + 0,
+		registries + 2) ||
+	    collect_network_values(
+		actions, count, action_get_net6_dst, 1, 64,
+		filter->dst_net6 + 1, filter->dst_net6_hosts + 1,
+		registries + 3) ||
+	    collect_port_values(
+		actions, count, get_port_range_src,
+		port_vtabs + 0, registries + 4) ||
+	    collect_port_values(
+		actions, count, get_port_range_dst,
+		port_vtabs + 1, registries + 5))
+		goto cleanup;
+
+	uint32_t value_counts[BITVECTOR_FIELD_COUNT];
+	uint64_t word_count = 0;
+	for (uint32_t field = 0; field < BITVECTOR_FIELD_COUNT; ++field) {
+		value_counts[field] = value_registry_capacity(registries + field);
+		word_count += (uint64_t)value_counts[field] * ((count + 63) / 64);
+
+		struct ipfw_compile_node *node_report = report->nodes + field;
+		node_report->value_count = value_counts[field];
+		if (field < 2)
+			node_report->bytes =
+				lpm64_size(filter->src_net6 + field) +
+				host_table_size(filter->src_net6_hosts + field);
+		else if (field < 4)
+			node_report->bytes =
+				lpm64_size(filter->dst_net6 + field - 2) +
+				host_table_size(filter->dst_net6_hosts + field - 2);
+		else
+			node_report->bytes = sizeof(filter->src_port);
+		report->filter_bytes += node_report->bytes;
+	}
+	if (ipfw_compile_charge(ctx, report->filter_bytes, "classifiers"))
+		goto cleanup;
+	// Bitmap words take two table cells
+	if (word_count * 2 > IPFW_TABLE_CELL_BUDGET) {
+		ipfw_compile_error(ctx, "bit-vector exceeds table cell budget");
+		errno = E2BIG;
+		goto cleanup;
+	}
+	if (ipfw_compile_charge(
+		ctx, word_count * sizeof(uint64_t), "bit-vector bitmaps"))
+		goto cleanup;
+	report->filter_bytes += word_count * sizeof(uint64_t);
+
+	struct bitvector_matcher *matcher = &filter->bitvector;
+	if (bitvector_matcher_init(matcher, count, value_counts))
+		goto cleanup;
+
+	struct ipfw_bitvector_ctx list_ctx;
+	memset(&list_ctx, 0, sizeof(struct ipfw_bitvector_ctx));
+	list_ctx.compile = ctx;
+	list_ctx.actions = actions;
+	list_ctx.matcher = matcher;
+	list_ctx.registry = &filter->action_lists;
+	uint32_t non_terminate_count = 0;
+	for (uint32_t field = 0; field < BITVECTOR_FIELD_COUNT; ++field) {
+		list_ctx.value_word_counts[field] = (value_counts[field] + 63) / 64;
+		list_ctx.value_word_count += list_ctx.value_word_counts[field];
+	}
+	for (uint32_t rule = 0; rule < count; ++rule) {
+		non_terminate_count +=
+			!!(actions[rule].action & IPFW_ACTION_NON_TERMINATE);
+	}
+	list_ctx.frame_word_count =
+		matcher->word_count + list_ctx.value_word_count;
+
+	// Rule value bitsets, list frames, field rules and the root values
+	uint64_t scratch_words =
+		(uint64_t)count * list_ctx.value_word_count +
+		(uint64_t)(non_terminate_count + 1) * list_ctx.frame_word_count +
+		matcher->word_count + list_ctx.value_word_count + 1;
+	if (ipfw_compile_charge(
+		ctx, scratch_words * sizeof(uint64_t), "bit-vector lists scratch"))
+		goto cleanup;
+	scratch_bytes = scratch_words * sizeof(uint64_t);
+	values = (uint64_t *)calloc(scratch_words, sizeof(uint64_t));
+	if (values == NULL)
+		goto cleanup;
+	list_ctx.rule_values = values + list_ctx.value_word_count + 1;
+	list_ctx.stack = list_ctx.rule_values +
+			 (size_t)count * list_ctx.value_word_count;
+	list_ctx.field_rules = list_ctx.stack +
+		(size_t)(non_terminate_count + 1) * list_ctx.frame_word_count;
+
+	for (uint32_t rule = 0; rule < count; ++rule) {
+		if (!(actions[rule].action & IPFW_ACTION_NON_TERMINATE))
+			matcher->terminal[rule / 64] |= (uint64_t)1 << (rule % 64);
+
+		uint64_t *rule_values = list_ctx.rule_values +
+			(size_t)rule * list_ctx.value_word_count;
+		for (uint32_t field = 0;
+		     field < BITVECTOR_FIELD_COUNT;
+		     ++field) {
+			const uint32_t *range_values =
+				value_registry_range_values(
+					registries + field, rule);
+			if (range_values == NULL)
+				goto cleanup;
+			for (uint32_t idx = 0;
+			     idx < registries[field].ranges[rule].count;
+			     ++idx) {
+				uint32_t value = range_values[idx];
+				bitvector_matcher_set(matcher, field, value, rule);
+				rule_values[value / 64] |=
+					(uint64_t)1 << (value % 64);
+			}
+			rule_values += list_ctx.value_word_counts[field];
+		}
+	}
+
+	// Any value of any field is common for the empty list
+	memset(values, 0xff, sizeof(uint64_t) * list_ctx.value_word_count);
+
+	if (action_list_registry_init(&filter->action_lists) ||
+	    ipfw_bitvector_register_lists(
+		&list_ctx, ACTION_LIST_EMPTY, values, 0, 0))
+		goto cleanup;
+	report->filter_bytes += list_ctx.registry_bytes;
+
+	for (uint32_t port = 0; port < 65536; ++port) {
+		filter->src_port[port] =
+			value_table_get(port_vtabs + 0, 0, port);
+		filter->dst_port[port] =
+			value_table_get(port_vtabs + 1, 0, port);
+	}
+
+	report->action_list_count =
+		action_list_registry_count(&filter->action_lists);
+
+	filter->net6_chunk_width = 64;
+	filter->filter.match = ipfw_bitvector_process;
+	filter->filter.classify_count = 0;
+	filter->filter.lookup_count = 0;
+	res = 0;
+
+cleanup:
+	free(values);
+	ipfw_compile_release(ctx, scratch_bytes);
+	for (uint32_t field = 0; field < BITVECTOR_FIELD_COUNT; ++field)
+		value_registry_free(registries + field);
+	value_table_free(port_vtabs + 0);
+	value_table_free(port_vtabs + 1);
+
+	if (res) {
+		// Later strategies leave the matcher as is for the filter free
+		bitvector_matcher_free(&filter->bitvector);
+		memset(&filter->bitvector, 0, sizeof(struct bitvector_matcher));
+		action_list_registry_free(&filter->action_lists);
+		for (uint32_t chunk = 0; chunk < 2; ++chunk) {
+			host_table_free(filter->dst_net6_hosts + chunk);
+			lpm64_free(filter->dst_net6 + chunk);
+			host_table_free(filter->src_net6_hosts + chunk);
+			lpm64_free(filter->src_net6 + chunk);
+		}
+	}
+	return res;
+}
+
+/*
+ * Each created filter gets a unique generation so verdicts cached for a
+ * replaced filter never match the new one.
+ */
+static uint64_t ipfw_filter_generation;
+
+int
+ipfw_packet_filter_create(
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	const struct ipfw_compile_config *config,
+	struct ipfw_compile_report *report,
+	struct ipfw_packet_filter *filter)
+{
+	uint8_t chunk_width = IPFW_NET6_CHUNK_WIDTH_DEFAULT;
+	uint64_t memory_budget = 0;
+	if (config != NULL) {
+		chunk_width = config->net6_chunk_width;
+		memory_budget = config->memory_budget;
+	}
+	if (chunk_width != 16 && chunk_width != 32 && chunk_width != 64) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct ipfw_compile_report local_report;
+	if (report == NULL)
+		report = &local_report;
+	memset(report, 0, sizeof(struct ipfw_compile_report));
+
+	struct ipfw_compile_ctx ctx;
+	ctx.memory_budget = memory_budget ? memory_budget : UINT64_MAX;
+	ctx.memory_used = 0;
+	ctx.report = report;
+	uint64_t start = ipfw_compile_now();
+
+	filter->filter.generation = __atomic_add_fetch(
+		&ipfw_filter_generation, 1, __ATOMIC_RELAXED);
+	tuple_space_init(&filter->fallback);
+	filter->fallback_limits = NULL;
+	memset(&filter->fallback_lists, 0, sizeof(struct filter_table));
+	linear_matcher_init(&filter->linear);
+	memset(&filter->bitvector, 0, sizeof(struct bitvector_matcher));
+	// Strategies not using classifiers leave them zeroed for the free
+	memset(filter->src_net6, 0, sizeof(filter->src_net6));
+	memset(filter->dst_net6, 0, sizeof(filter->dst_net6));
+	memset(filter->src_net6_hosts, 0, sizeof(filter->src_net6_hosts));
+	memset(filter->dst_net6_hosts, 0, sizeof(filter->dst_net6_hosts));
+	memset(&filter->action_lists, 0, sizeof(struct action_list_registry));
+	filter->filter.lookup_count = 0;
+
+	int res;
+	uint32_t non_terminate_count = 0;
+	for (uint32_t rule = 0; rule < count; ++rule) {
+		non_terminate_count +=
+			!!(actions[rule].action & IPFW_ACTION_NON_TERMINATE);
+	}
+	if (count <= IPFW_LINEAR_RULE_MAX &&
+	    non_terminate_count <= IPFW_LINEAR_NON_TERMINATE_MAX) {
+		res = ipfw_linear_create(actions, count, filter, &ctx);
+		goto out;
+	}
+
+	res = ipfw_packet_filter_compile(
+		actions, count, chunk_width, filter,
+		IPFW_TABLE_CELL_BUDGET, &ctx);
+	if (!res || errno != E2BIG)
+		goto out;
+
+	if (count <= IPFW_BITVECTOR_RULE_MAX) {
+		res = ipfw_bitvector_create(actions, count, filter, &ctx);
+		if (!res || errno != E2BIG)
+			goto out;
+	}
+
+	res = ipfw_packet_filter_create_hybrid(
+		actions, count, chunk_width, filter, &ctx);
+
+out:
+	report->nsec = ipfw_compile_now() - start;
+	return res;
+}
+
+void
+ipfw_packet_filter_free(struct ipfw_packet_filter *filter)
+{
+	ipfw_compiled_free(filter);
+	linear_matcher_free(&filter->linear);
+	bitvector_matcher_free(&filter->bitvector);
+	tuple_space_free(&filter->fallback);
+	free(filter->fallback_limits);
+	filter_table_free(&filter->fallback_lists);
+}
@@ -6,6 +6,11 @@
 #include "dataplane/filter.h"
 
 #include "lpm.h"
+#include "action_list.h"
+#include "tuple.h"
+#include "linear.h"
+#include "bitvector.h"
+#include "host_table.h"
 
 struct ipfw_net6 {
 	uint64_t addr_hi;
@@ -52,32 +57,203 @@ struct ipfw_filter {
 	struct ipfw_transport_filter transport;
 };
 
+/*
+ * Rules are matched in order and the first matched rule with terminal
+ * action (accept, deny, etc) finishes the match. Rules with non-terminal
+ * action (count, log, etc) are collected until the terminal one.
+ */
+#define IPFW_ACTION_NON_TERMINATE 0x80000000
+
 struct ipfw_filter_action {
 	struct ipfw_filter filter;
 	uint32_t action;
 };
 
+/*
+ * IPv6 addresses are split into chunks classified with separate LPMs and
+ * joined with cross-product stages. Narrow chunks make LPM trees shallow
+ * and produce fewer classes per chunk at the cost of more classifiers and
+ * lookups per packet.
+ */
+#define IPFW_NET6_CHUNK_WIDTH_DEFAULT 64
+#define IPFW_NET6_CHUNK_WIDTH_MIN 16
+#define IPFW_NET6_CHUNK_MAX (128 / IPFW_NET6_CHUNK_WIDTH_MIN)
+
+// Network chunk classifiers of both addresses and two port classifiers
+#define IPFW_CLASSIFY_MAX (IPFW_NET6_CHUNK_MAX * 2 + 2)
+// Chunk stages, their joins, port stage and the final stage
+#define IPFW_LOOKUP_MAX (IPFW_NET6_CHUNK_MAX * 2 + 1)
+
+struct ipfw_compile_config {
+	// Width of IPv6 address chunks in bits, either 16, 32 or 64
+	uint8_t net6_chunk_width;
+	/*
+	 * Limit of bytes taken by compiled tables together with compile
+	 * intermediates alive at once, zero means no limit. A strategy
+	 * exceeding the limit is abandoned before the offending allocation
+	 * and the compilation fails if no strategy fits.
+	 */
+	uint64_t memory_budget;
+};
+
+enum ipfw_compile_strategy {
+	IPFW_COMPILE_LINEAR,
+	IPFW_COMPILE_CROSS_PRODUCT,
+	IPFW_COMPILE_BITVECTOR,
+	IPFW_COMPILE_HYBRID,
+};
+
+#define IPFW_COMPILE_NODE_MAX (IPFW_CLASSIFY_MAX + IPFW_LOOKUP_MAX)
+
+/*
+ * Node of the compiled classifier DAG. Classifier nodes are either chunk
+ * LPMs with their host tables or port tables, other nodes are stages.
+ */
+struct ipfw_compile_node {
+	// Count of distinct values the node produces
+	uint32_t value_count;
+	// Stage table dimensions after class merging, zero for classifiers
+	uint32_t h_dim;
+	uint32_t v_dim;
+	// Bytes of the node in the filter, zero if the node is pruned
+	uint64_t bytes;
+	uint64_t nsec;
+};
+
+struct ipfw_compile_report {
+	enum ipfw_compile_strategy strategy;
+	// Rules compiled into tables after chunk variant expansion
+	uint32_t rule_count;
+	uint32_t fallback_rule_count;
+	uint32_t action_list_count;
+
+	uint32_t classify_count;
+	uint32_t node_count;
+	struct ipfw_compile_node nodes[IPFW_COMPILE_NODE_MAX];
+
+	// Bytes of the filter and the peak of accounted compile memory
+	uint64_t filter_bytes;
+	uint64_t peak_bytes;
+	uint64_t nsec;
+
+	// Diagnostic of the last abandoned or failed attempt
+	char error[128];
+};
+
 struct ipfw_packet_filter {
 	struct filter filter;
-	struct lpm64 src_net6_hi;
-	struct lpm64 src_net6_lo;
-	struct lpm64 dst_net6_hi;
-	struct lpm64 dst_net6_lo;
+
+	/*
+	 * LPMs of address chunks in the address order. Matchers other than
+	 * the cross-product classifier use 64-bit chunks only.
+	 */
+	uint8_t net6_chunk_width;
+	struct lpm64 src_net6[IPFW_NET6_CHUNK_MAX];
+	struct lpm64 dst_net6[IPFW_NET6_CHUNK_MAX];
+	/*
+	 * Host entries of wide chunks are kept apart from the LPMs. Host
+	 * tables are looked up first and return the same classifier values.
+	 */
+	struct host_table src_net6_hosts[IPFW_NET6_CHUNK_MAX];
+	struct host_table dst_net6_hosts[IPFW_NET6_CHUNK_MAX];
 
 	uint32_t src_port[65536];
 	uint32_t dst_port[65536];
 
 	uint16_t proto_flag[65536];
 
-	filter_classify classify[6];
-	struct filter_lookup lookups[5];
-	struct filter_table tables[5];
+	filter_classify classify[IPFW_CLASSIFY_MAX];
+	struct filter_lookup lookups[IPFW_LOOKUP_MAX];
+	struct filter_table tables[IPFW_LOOKUP_MAX];
+
+	/*
+	 * Filter result is an action list identifier, each list consists
+	 * of matched rule indices in the rule order up to the first rule
+	 * with terminal action.
+	 */
+	struct action_list_registry action_lists;
+
+	/*
+	 * Rules exploding the cross-product tables beyond the budget match
+	 * nothing in the tables and are kept in the fallback tuple space as
+	 * positions in the fallback rule order. The fallback is looked up
+	 * only if a fallback rule precedes the terminal rule of the table
+	 * result and the first matched fallback rule is merged into the
+	 * result with the fallback lists table.
+	 */
+	struct tuple_space fallback;
+	// Count of fallback rules preceding the terminal rule of each list
+	uint32_t *fallback_limits;
+	struct filter_table fallback_lists;
+
+	// Small rulesets are matched with the linear matcher only
+	struct linear_matcher linear;
+
+	/*
+	 * Mid-size rulesets exceeding the table budget are matched with the
+	 * bit-vector matcher using the network and port classifiers.
+	 */
+	struct bitvector_matcher bitvector;
 };
 
+/*
+ * The routine compiles the filter of the rules. Default configuration is
+ * used if the config is NULL and the report is filled if it is not NULL.
+ * If the memory budget is exceeded the routine fails with E2BIG errno.
+ */
 int
 ipfw_packet_filter_create(
 	struct ipfw_filter_action *actions,
 	uint32_t count,
+	const struct ipfw_compile_config *config,
+	struct ipfw_compile_report *report,
 	struct ipfw_packet_filter *filter);
 
+/*
+ * The routine frees the filter created with ipfw_packet_filter_create
+ * whatever strategy it is compiled with.
+ */
+void
+ipfw_packet_filter_free(struct ipfw_packet_filter *filter);
+
+/*
+ * The routine returns action list of the packet. The generic filter
+ * processing gives the same result whatever strategy the filter is
+ * compiled with as hybrid filters run the fallback in the match routine.
+ */
+uint32_t
+ipfw_packet_filter_process(
+	struct ipfw_packet_filter *filter,
+	struct packet *packet);
+
+#define IPFW_RULE_REMOVED 0xffffffff
+
+struct ipfw_optimize_report {
+	// Rules matching nothing or fully covered by an earlier terminal rule
+	uint32_t shadowed_count;
+	// Rules merged into the previous rule with the same action
+	uint32_t merged_count;
+	// Networks and port ranges covered by other ones of the same rule
+	uint32_t net_removed_count;
+	uint32_t port_range_removed_count;
+};
+
+/*
+ * The routine removes shadowed rules and merges adjacent rules with the
+ * same terminal action into a new ruleset to be compiled instead of the
+ * original one. For each original rule `rule_map` receives index of the
+ * optimized rule it was merged into or IPFW_RULE_REMOVED.
+ */
+int
+ipfw_filter_optimize(
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	struct ipfw_filter_action **optimized,
+	uint32_t *optimized_count,
+	uint32_t *rule_map,
+	struct ipfw_optimize_report *report);
+
+void
+ipfw_filter_actions_free(struct ipfw_filter_action *actions, uint32_t count);
+
 #endif
@@ -0,0 +1,582 @@
+#include "ipfw.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <endian.h>
+
+/*
+ * Ruleset optimizer working before ipfw filter compilation.
+ *
+ * Note the filter compiler classifies high and low address halves
+ * independently, so a rule matches a packet if the packet high half is
+ * inside any of the rule high halves and the low half is inside any of
+ * the rule low halves. All transformations below preserve the matched
+ * set in these terms.
+ */
+
+static int
+net6_cmp(const void *first, const void *second)
+{
+	const struct ipfw_net6 *net1 = (const struct ipfw_net6 *)first;
+	const struct ipfw_net6 *net2 = (const struct ipfw_net6 *)second;
+
+	uint64_t keys1[4] = {
+		be64toh(net1->addr_hi), be64toh(net1->mask_hi),
+		be64toh(net1->addr_lo), be64toh(net1->mask_lo)};
+	uint64_t keys2[4] = {
+		be64toh(net2->addr_hi), be64toh(net2->mask_hi),
+		be64toh(net2->addr_lo), be64toh(net2->mask_lo)};
+
+	for (uint32_t idx = 0; idx < 4; ++idx) {
+		if (keys1[idx] != keys2[idx])
+			return keys1[idx] < keys2[idx] ? -1 : 1;
+	}
+	return 0;
+}
+
+static int
+port_range_cmp(const void *first, const void *second)
+{
+	const struct ipfw_port_range *range1 =
+		(const struct ipfw_port_range *)first;
+	const struct ipfw_port_range *range2 =
+		(const struct ipfw_port_range *)second;
+
+	if (range1->from != range2->from)
+		return range1->from < range2->from ? -1 : 1;
+	if (range1->to != range2->to)
+		return range1->to < range2->to ? -1 : 1;
+	return 0;
+}
+
+static inline bool
+net6_part_contains(
+	uint64_t addr,
+	uint64_t mask,
+	uint64_t sub_addr,
+	uint64_t sub_mask)
+{
+	return (mask & sub_mask) == mask && (sub_addr & mask) == addr;
+}
+
+static inline bool
+net6_contains(const struct ipfw_net6 *net, const struct ipfw_net6 *sub)
+{
+	return net6_part_contains(
+			net->addr_hi, net->mask_hi,
+			sub->addr_hi, sub->mask_hi) &&
+	       net6_part_contains(
+			net->addr_lo, net->mask_lo,
+			sub->addr_lo, sub->mask_lo);
+}
+
+/*
+ * The routine returns parent prefix if both parts are sibling prefixes.
+ */
+static inline bool
+net6_part_sibling(
+	uint64_t addr1,
+	uint64_t addr2,
+	uint64_t mask,
+	uint64_t *parent_addr,
+	uint64_t *parent_mask)
+{
+	uint64_t host_mask = be64toh(mask);
+	if (!host_mask)
+		return false;
+
+	uint64_t last_bit = host_mask & -host_mask;
+	if ((be64toh(addr1) ^ be64toh(addr2)) != last_bit)
+		return false;
+
+	*parent_mask = htobe64(host_mask ^ last_bit);
+	*parent_addr = addr1 & *parent_mask;
+	return true;
+}
+
+static bool
+net6_sibling(
+	const struct ipfw_net6 *net1,
+	const struct ipfw_net6 *net2,
+	struct ipfw_net6 *parent)
+{
+	if (net1->mask_hi == net2->mask_hi &&
+	    net1->addr_lo == net2->addr_lo &&
+	    net1->mask_lo == net2->mask_lo &&
+	    net6_part_sibling(
+		net1->addr_hi, net2->addr_hi, net1->mask_hi,
+		&parent->addr_hi, &parent->mask_hi)) {
+		parent->addr_lo = net1->addr_lo;
+		parent->mask_lo = net1->mask_lo;
+		return true;
+	}
+
+	if (net1->mask_lo == net2->mask_lo &&
+	    net1->addr_hi == net2->addr_hi &&
+	    net1->mask_hi == net2->mask_hi &&
+	    net6_part_sibling(
+		net1->addr_lo, net2->addr_lo, net1->mask_lo,
+		&parent->addr_lo, &parent->mask_lo)) {
+		parent->addr_hi = net1->addr_hi;
+		parent->mask_hi = net1->mask_hi;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * The routine removes networks contained in other ones and merges
+ * sibling networks into parent ones until there is nothing to merge.
+ * Returns new network count.
+ */
+static uint32_t
+net6_list_normalize(struct ipfw_net6 *nets, uint32_t count)
+{
+	bool changed = true;
+	while (changed) {
+		changed = false;
+
+		for (uint32_t idx = 0; idx < count; ++idx) {
+			for (uint32_t sub_idx = 0; sub_idx < count; ++sub_idx) {
+				if (sub_idx == idx)
+					continue;
+
+				struct ipfw_net6 parent;
+				if (net6_contains(nets + idx, nets + sub_idx)) {
+					nets[sub_idx] = nets[--count];
+				} else if (net6_sibling(
+						nets + idx,
+						nets + sub_idx,
+						&parent)) {
+					nets[idx] = parent;
+					nets[sub_idx] = nets[--count];
+				} else {
+					continue;
+				}
+
+				changed = true;
+				break;
+			}
+		}
+	}
+
+	qsort(nets, count, sizeof(struct ipfw_net6), net6_cmp);
+	return count;
+}
+
+/*
+ * The routine sorts port ranges and coalesces overlapping and adjacent
+ * ones. Returns new range count.
+ */
+static uint32_t
+port_range_list_normalize(struct ipfw_port_range *ranges, uint32_t count)
+{
+	if (count == 0)
+		return 0;
+
+	qsort(ranges, count, sizeof(struct ipfw_port_range), port_range_cmp);
+
+	uint32_t last = 0;
+	for (uint32_t idx = 1; idx < count; ++idx) {
+		if ((uint32_t)ranges[idx].from <= (uint32_t)ranges[last].to + 1) {
+			if (ranges[idx].to > ranges[last].to)
+				ranges[last].to = ranges[idx].to;
+			continue;
+		}
+		ranges[++last] = ranges[idx];
+	}
+	return last + 1;
+}
+
+/*
+ * Each part of the sub list should be covered by a part of the list as
+ * parts are classified independently.
+ */
+static bool
+net6_list_covers(
+	const struct ipfw_net6 *nets,
+	uint32_t count,
+	const struct ipfw_net6 *sub_nets,
+	uint32_t sub_count)
+{
+	for (uint32_t sub_idx = 0; sub_idx < sub_count; ++sub_idx) {
+		const struct ipfw_net6 *sub = sub_nets + sub_idx;
+		bool hi_covered = false;
+		bool lo_covered = false;
+		for (uint32_t idx = 0; idx < count; ++idx) {
+			hi_covered |= net6_part_contains(
+				nets[idx].addr_hi, nets[idx].mask_hi,
+				sub->addr_hi, sub->mask_hi);
+			lo_covered |= net6_part_contains(
+				nets[idx].addr_lo, nets[idx].mask_lo,
+				sub->addr_lo, sub->mask_lo);
+		}
+		if (!hi_covered || !lo_covered)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Port range lists should be normalized so each sub range must be
+ * inside one range.
+ */
+static bool
+port_range_list_covers(
+	const struct ipfw_port_range *ranges,
+	uint32_t count,
+	const struct ipfw_port_range *sub_ranges,
+	uint32_t sub_count)
+{
+	for (uint32_t sub_idx = 0; sub_idx < sub_count; ++sub_idx) {
+		bool covered = false;
+		for (uint32_t idx = 0; idx < count && !covered; ++idx) {
+			covered = ranges[idx].from <= sub_ranges[sub_idx].from &&
+				  ranges[idx].to >= sub_ranges[sub_idx].to;
+		}
+		if (!covered)
+			return false;
+	}
+	return true;
+}
+
+static bool
+ipfw_filter_is_empty(const struct ipfw_filter *filter)
+{
+	return !filter->net6.src_count || !filter->net6.dst_count ||
+	       !filter->transport.src_count || !filter->transport.dst_count;
+}
+
+static bool
+ipfw_filter_covers(
+	const struct ipfw_filter *filter,
+	const struct ipfw_filter *sub)
+{
+	return filter->transport.proto_flags == sub->transport.proto_flags &&
+	       net6_list_covers(
+			filter->net6.srcs, filter->net6.src_count,
+			sub->net6.srcs, sub->net6.src_count) &&
+	       net6_list_covers(
+			filter->net6.dsts, filter->net6.dst_count,
+			sub->net6.dsts, sub->net6.dst_count) &&
+	       port_range_list_covers(
+			filter->transport.srcs, filter->transport.src_count,
+			sub->transport.srcs, sub->transport.src_count) &&
+	       port_range_list_covers(
+			filter->transport.dsts, filter->transport.dst_count,
+			sub->transport.dsts, sub->transport.dst_count);
+}
+
+static bool
+net6_list_equal(
+	const struct ipfw_net6 *nets1,
+	uint32_t count1,
+	const struct ipfw_net6 *nets2,
+	uint32_t count2)
+{
+	return count1 == count2 &&
+	       !memcmp(nets1, nets2, sizeof(struct ipfw_net6) * count1);
+}
+
+static bool
+port_range_list_equal(
+	const struct ipfw_port_range *ranges1,
+	uint32_t count1,
+	const struct ipfw_port_range *ranges2,
+	uint32_t count2)
+{
+	return count1 == count2 &&
+	       !memcmp(ranges1,
+		       ranges2,
+		       sizeof(struct ipfw_port_range) * count1);
+}
+
+/*
+ * Union of two network lists is exact only if the lists differ in one of
+ * address halves.
+ */
+static bool
+net6_list_mergeable(
+	const struct ipfw_net6 *nets1,
+	uint32_t count1,
+	const struct ipfw_net6 *nets2,
+	uint32_t count2)
+{
+	bool same_hi = true;
+	bool same_lo = true;
+	for (uint32_t idx = 0; idx < count1 + count2; ++idx) {
+		const struct ipfw_net6 *net =
+			idx < count1 ? nets1 + idx : nets2 + idx - count1;
+		same_hi &= net->addr_hi == nets1->addr_hi &&
+			   net->mask_hi == nets1->mask_hi;
+		same_lo &= net->addr_lo == nets1->addr_lo &&
+			   net->mask_lo == nets1->mask_lo;
+	}
+	return same_hi || same_lo;
+}
+
+static int
+net6_list_union(
+	struct ipfw_net6 **nets,
+	uint32_t *count,
+	const struct ipfw_net6 *add_nets,
+	uint32_t add_count)
+{
+	struct ipfw_net6 *new_nets = (struct ipfw_net6 *)
+		realloc(*nets, sizeof(struct ipfw_net6) * (*count + add_count));
+	if (new_nets == NULL)
+		return -1;
+	memcpy(new_nets + *count,
+	       add_nets,
+	       sizeof(struct ipfw_net6) * add_count);
+	*nets = new_nets;
+	*count = net6_list_normalize(new_nets, *count + add_count);
+	return 0;
+}
+
+static int
+port_range_list_union(
+	struct ipfw_port_range **ranges,
+	uint16_t *count,
+	const struct ipfw_port_range *add_ranges,
+	uint16_t add_count)
+{
+	struct ipfw_port_range *new_ranges = (struct ipfw_port_range *)
+		realloc(*ranges,
+			sizeof(struct ipfw_port_range) * (*count + add_count));
+	if (new_ranges == NULL)
+		return -1;
+	memcpy(new_ranges + *count,
+	       add_ranges,
+	       sizeof(struct ipfw_port_range) * add_count);
+	*ranges = new_ranges;
+	*count = port_range_list_normalize(new_ranges, *count + add_count);
+	return 0;
+}
+
+/*
+ * The routine merges the next rule into the rule if both have the same
+ * terminal action and filters differ in one dimension only.
+ * Returns 1 if the rule was merged, 0 if not and -1 in case of error.
+ */
+static int
+ipfw_filter_action_merge(
+	struct ipfw_filter_action *action,
+	const struct ipfw_filter_action *next)
+{
+	if (action->action != next->action ||
+	    (action->action & IPFW_ACTION_NON_TERMINATE))
+		return 0;
+
+	struct ipfw_filter *filter = &action->filter;
+	const struct ipfw_filter *next_filter = &next->filter;
+
+	if (filter->transport.proto_flags != next_filter->transport.proto_flags)
+		return 0;
+
+	bool same_src = net6_list_equal(
+		filter->net6.srcs, filter->net6.src_count,
+		next_filter->net6.srcs, next_filter->net6.src_count);
+	bool same_dst = net6_list_equal(
+		filter->net6.dsts, filter->net6.dst_count,
+		next_filter->net6.dsts, next_filter->net6.dst_count);
+	bool same_src_port = port_range_list_equal(
+		filter->transport.srcs, filter->transport.src_count,
+		next_filter->transport.srcs, next_filter->transport.src_count);
+	bool same_dst_port = port_range_list_equal(
+		filter->transport.dsts, filter->transport.dst_count,
+		next_filter->transport.dsts, next_filter->transport.dst_count);
+
+	uint32_t diff_count = !same_src + !same_dst +
+			      !same_src_port + !same_dst_port;
+	if (diff_count > 1)
+		return 0;
+
+	if (!same_src) {
+		if (!net6_list_mergeable(
+			filter->net6.srcs, filter->net6.src_count,
+			next_filter->net6.srcs, next_filter->net6.src_count))
+			return 0;
+		if (net6_list_union(
+			&filter->net6.srcs, &filter->net6.src_count,
+			next_filter->net6.srcs, next_filter->net6.src_count))
+			return -1;
+	} else if (!same_dst) {
+		if (!net6_list_mergeable(
+			filter->net6.dsts, filter->net6.dst_count,
+			next_filter->net6.dsts, next_filter->net6.dst_count))
+			return 0;
+		if (net6_list_union(
+			&filter->net6.dsts, &filter->net6.dst_count,
+			next_filter->net6.dsts, next_filter->net6.dst_count))
+			return -1;
+	} else if (!same_src_port) {
+		if (port_range_list_union(
+			&filter->transport.srcs, &filter->transport.src_count,
+			next_filter->transport.srcs,
+			next_filter->transport.src_count))
+			return -1;
+	} else if (!same_dst_port) {
+		if (port_range_list_union(
+			&filter->transport.dsts, &filter->transport.dst_count,
+			next_filter->transport.dsts,
+			next_filter->transport.dst_count))
+			return -1;
+	}
+
+	return 1;
+}
+
+static void
+ipfw_filter_action_free(struct ipfw_filter_action *action)
+{
+	free(action->filter.net6.srcs);
+	free(action->filter.net6.dsts);
+	free(action->filter.transport.srcs);
+	free(action->filter.transport.dsts);
+}
+
+static void *
+memdup(const void *data, size_t size)
+{
+	// Never return NULL for empty lists as NULL denotes an error
+	void *copy = malloc(size ? size : 1);
+	if (copy != NULL)
+		memcpy(copy, data, size);
+	return copy;
+}
+
+/*
+ * The routine makes a deep copy of the rule with normalized lists.
+ */
+static int
+ipfw_filter_action_copy(
+	struct ipfw_filter_action *copy,
+	const struct ipfw_filter_action *action,
+	struct ipfw_optimize_report *report)
+{
+	const struct ipfw_filter *filter = &action->filter;
+
+	*copy = *action;
+	copy->filter.net6.srcs = (struct ipfw_net6 *)memdup(
+		filter->net6.srcs,
+		sizeof(struct ipfw_net6) * filter->net6.src_count);
+	copy->filter.net6.dsts = (struct ipfw_net6 *)memdup(
+		filter->net6.dsts,
+		sizeof(struct ipfw_net6) * filter->net6.dst_count);
+	copy->filter.transport.srcs = (struct ipfw_port_range *)memdup(
+		filter->transport.srcs,
+		sizeof(struct ipfw_port_range) * filter->transport.src_count);
+	copy->filter.transport.dsts = (struct ipfw_port_range *)memdup(
+		filter->transport.dsts,
+		sizeof(struct ipfw_port_range) * filter->transport.dst_count);
+	if (copy->filter.net6.srcs == NULL ||
+	    copy->filter.net6.dsts == NULL ||
+	    copy->filter.transport.srcs == NULL ||
+	    copy->filter.transport.dsts == NULL) {
+		ipfw_filter_action_free(copy);
+		return -1;
+	}
+
+	struct ipfw_filter *copy_filter = &copy->filter;
+	copy_filter->net6.src_count = net6_list_normalize(
+		copy_filter->net6.srcs, copy_filter->net6.src_count);
+	copy_filter->net6.dst_count = net6_list_normalize(
+		copy_filter->net6.dsts, copy_filter->net6.dst_count);
+	copy_filter->transport.src_count = port_range_list_normalize(
+		copy_filter->transport.srcs, copy_filter->transport.src_count);
+	copy_filter->transport.dst_count = port_range_list_normalize(
+		copy_filter->transport.dsts, copy_filter->transport.dst_count);
+
+	report->net_removed_count +=
+		filter->net6.src_count - copy_filter->net6.src_count +
+		filter->net6.dst_count - copy_filter->net6.dst_count;
+	report->port_range_removed_count +=
+		filter->transport.src_count - copy_filter->transport.src_count +
+		filter->transport.dst_count - copy_filter->transport.dst_count;
+
+	return 0;
+}
+
+int
+ipfw_filter_optimize(
+	struct ipfw_filter_action *actions,
+	uint32_t count,
+	struct ipfw_filter_action **optimized,
+	uint32_t *optimized_count,
+	uint32_t *rule_map,
+	struct ipfw_optimize_report *report)
+{
+	memset(report, 0, sizeof(*report));
+
+	struct ipfw_filter_action *result = (struct ipfw_filter_action *)
+		malloc(sizeof(struct ipfw_filter_action) * (count + 1));
+	if (result == NULL)
+		return -1;
+	uint32_t result_count = 0;
+
+	for (uint32_t idx = 0; idx < count; ++idx) {
+		struct ipfw_filter_action *action = result + result_count;
+		if (ipfw_filter_action_copy(action, actions + idx, report))
+			goto error;
+
+		/*
+		 * The rule is shadowed if it matches nothing or an earlier
+		 * rule with terminal action matches all its packets.
+		 */
+		bool shadowed = ipfw_filter_is_empty(&action->filter);
+		for (uint32_t prev_idx = 0;
+		     prev_idx < result_count && !shadowed;
+		     ++prev_idx) {
+			const struct ipfw_filter_action *prev =
+				result + prev_idx;
+			shadowed = !(prev->action & IPFW_ACTION_NON_TERMINATE) &&
+				   ipfw_filter_covers(
+					&prev->filter,
+					&action->filter);
+		}
+		if (shadowed) {
+			ipfw_filter_action_free(action);
+			rule_map[idx] = IPFW_RULE_REMOVED;
+			report->shadowed_count++;
+			continue;
+		}
+
+		if (result_count > 0) {
+			int res = ipfw_filter_action_merge(
+				result + result_count - 1,
+				action);
+			if (res < 0) {
+				ipfw_filter_action_free(action);
+				goto error;
+			}
+			if (res > 0) {
+				ipfw_filter_action_free(action);
+				rule_map[idx] = result_count - 1;
+				report->merged_count++;
+				continue;
+			}
+		}
+
+		rule_map[idx] = result_count++;
+	}
+
+	*optimized = result;
+	*optimized_count = result_count;
+	return 0;
+
+error:
+	ipfw_filter_actions_free(result, result_count);
+	return -1;
+}
+
+void
+ipfw_filter_actions_free(struct ipfw_filter_action *actions, uint32_t count)
+{
+	for (uint32_t idx = 0; idx < count; ++idx)
+		ipfw_filter_action_free(actions + idx);
+	free(actions);
+}
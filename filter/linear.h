@@ -0,0 +1,174 @@
+#ifndef FILTER_LINEAR_H
+#define FILTER_LINEAR_H
+
+/*
+ * Linear matcher scans all rules of a small ruleset at once. Each rule is
+ * a bit of 64-bit mask and each key field keeps a list of value ranges
+ * with masks of rules containing the range. A key field matches rules of
+ * all ranges containing the field value and the key matches rules which
+ * are matched by all fields.
+ *
+ * Ranges are stored as separate arrays of range starts, spans and rule
+ * masks so the range scan is branchless and vectorized by the compiler.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "action_list.h"
+
+#define LINEAR_RULE_MAX 64
+#define LINEAR_FIELD_COUNT 6
+
+struct linear_field {
+	uint64_t *froms;
+	uint64_t *spans;
+	uint64_t *rules;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+struct linear_matcher {
+	struct linear_field fields[LINEAR_FIELD_COUNT];
+	// Rules with terminal action
+	uint64_t terminal;
+	uint32_t rule_count;
+};
+
+static inline void
+linear_matcher_init(struct linear_matcher *matcher)
+{
+	memset(matcher, 0, sizeof(struct linear_matcher));
+}
+
+static inline void
+linear_matcher_free(struct linear_matcher *matcher)
+{
+	for (uint32_t idx = 0; idx < LINEAR_FIELD_COUNT; ++idx) {
+		free(matcher->fields[idx].rules);
+		free(matcher->fields[idx].spans);
+		free(matcher->fields[idx].froms);
+	}
+}
+
+static inline uint64_t
+linear_matcher_size(const struct linear_matcher *matcher)
+{
+	uint64_t size = 0;
+	for (uint32_t idx = 0; idx < LINEAR_FIELD_COUNT; ++idx)
+		size += (uint64_t)matcher->fields[idx].capacity *
+			sizeof(uint64_t) * 3;
+	return size;
+}
+
+static inline int
+linear_field_grow(struct linear_field *field)
+{
+	uint32_t capacity = field->capacity ? field->capacity * 2 : 8;
+
+	uint64_t *froms = (uint64_t *)
+		realloc(field->froms, sizeof(uint64_t) * capacity);
+	if (froms == NULL)
+		return -1;
+	field->froms = froms;
+
+	uint64_t *spans = (uint64_t *)
+		realloc(field->spans, sizeof(uint64_t) * capacity);
+	if (spans == NULL)
+		return -1;
+	field->spans = spans;
+
+	uint64_t *rules = (uint64_t *)
+		realloc(field->rules, sizeof(uint64_t) * capacity);
+	if (rules == NULL)
+		return -1;
+	field->rules = rules;
+
+	field->capacity = capacity;
+	return 0;
+}
+
+/*
+ * The routine adds range [from..to] of the field to the rule. Rules
+ * sharing the same range share the range item.
+ */
+static inline int
+linear_matcher_add(
+	struct linear_matcher *matcher,
+	uint32_t field_idx,
+	uint64_t from,
+	uint64_t to,
+	uint32_t rule)
+{
+	struct linear_field *field = matcher->fields + field_idx;
+
+	for (uint32_t idx = 0; idx < field->count; ++idx) {
+		if (field->froms[idx] == from &&
+		    field->spans[idx] == to - from) {
+			field->rules[idx] |= (uint64_t)1 << rule;
+			return 0;
+		}
+	}
+
+	if (field->count == field->capacity && linear_field_grow(field))
+		return -1;
+
+	field->froms[field->count] = from;
+	field->spans[field->count] = to - from;
+	field->rules[field->count] = (uint64_t)1 << rule;
+	field->count++;
+	return 0;
+}
+
+/*
+ * The routine returns mask of rules matching the key. Key fields are
+ * compared as unsigned numbers.
+ */
+static inline uint64_t
+linear_matcher_lookup(
+	const struct linear_matcher *matcher,
+	const uint64_t *key)
+{
+	uint64_t matched = ~(uint64_t)0;
+
+	for (uint32_t field_idx = 0;
+	     field_idx < LINEAR_FIELD_COUNT;
+	     ++field_idx) {
+		const struct linear_field *field = matcher->fields + field_idx;
+		uint64_t value = key[field_idx];
+		uint64_t field_matched = 0;
+		for (uint32_t idx = 0; idx < field->count; ++idx) {
+			field_matched |= field->rules[idx] &
+				-(uint64_t)(value - field->froms[idx] <=
+					    field->spans[idx]);
+		}
+		matched &= field_matched;
+	}
+
+	return matched;
+}
+
+/*
+ * The routine converts matched rules into the action list consisting of
+ * matched rules up to the first terminal one. All such lists must be
+ * registered in advance.
+ */
+static inline uint32_t
+linear_matcher_list(
+	const struct linear_matcher *matcher,
+	const struct action_list_registry *registry,
+	uint64_t matched)
+{
+	uint32_t list = ACTION_LIST_EMPTY;
+	while (matched) {
+		uint32_t rule = __builtin_ctzll(matched);
+		list = action_list_child(registry, list, rule);
+		if (matcher->terminal & ((uint64_t)1 << rule))
+			break;
+		matched &= matched - 1;
+	}
+	return list;
+}
+
+#endif
@@ -63,7 +63,7 @@ lpm64_new_page(struct lpm64 *lpm64, uint32_t *page_idx)
 		lpm64->pages = pages;
 		lpm64->pages[new_chunk_count - 1] =
 			(lpm64_page_t *)malloc(sizeof(lpm64_page_t) * 16);
-		if (lpm64->pages[new_chunk_count - 1])
+		if (lpm64->pages[new_chunk_count - 1] == NULL)
 			return -1;
 	}
 	*page_idx = lpm64->page_count;
@@ -72,6 +72,23 @@ lpm64_new_page(struct lpm64 *lpm64, uint32_t *page_idx)
 	return 0;
 }
 
+static inline uint64_t
+lpm64_size(const struct lpm64 *lpm64)
+{
+	size_t chunk_count = (lpm64->page_count + 15) / 16;
+	return chunk_count * (sizeof(lpm64_page_t *) + sizeof(lpm64_page_t) * 16);
+}
+
+static inline void
+lpm64_free(struct lpm64 *lpm64)
+{
+	for (size_t chunk_idx = 0;
+	     chunk_idx < (lpm64->page_count + 15) / 16;
+	     ++chunk_idx)
+		free(lpm64->pages[chunk_idx]);
+	free(lpm64->pages);
+}
+
 /*
  * The routine maps range [from..to] to value value.
  * Keys are big-endian encoded.
@@ -106,7 +123,7 @@ lpm64_lookup(const struct lpm64 *lpm64, uint64_t key)
 {
 	uint8_t *key_bytes = (uint8_t *)&key;
 
-	uint32_t value;
+	uint32_t value = 0;
 
 	for (uint8_t hop = 0; hop < 8; ++hop) {
 		lpm64_page_t *page = lpm64_page(lpm64, value);
@@ -174,13 +191,11 @@ lpm64_walk(
 		}
 
 		keys[hop]++;
-		if (keys[hop] == (uint8_t)(to_bytes[hop] + 1)) {
+		while (keys[hop] == (uint8_t)(to_bytes[hop] + 1)) {
 			if (hop == 0)
-				break;
+				return;
 			--hop;
 			keys[hop]++;
-			if (keys[0] == (uint8_t)(to_bytes[hop] + 1))
-				break;
 		}
 	}
 }
@@ -221,9 +236,9 @@ lpm64_compact(
 		}
 
 		keys[hop]++;
-		if (keys[hop] == 0) {
+		while (keys[hop] == 0) {
 			if (hop == 0)
-				break;
+				return;
 			/*
 			 * The code bellow squash page if there is only
 			 * one value set decreasing the tree branch length.
@@ -239,8 +254,26 @@ lpm64_compact(
 			}
 
 			keys[hop]++;
-			if (keys[0] == 0)
-				break;
+		}
+	}
+}
+
+/*
+ * The routine rewrites each stored value using the map. Unlike compaction
+ * the tree shape is preserved so it is enough to go through all pages.
+ */
+static inline void
+lpm64_remap(struct lpm64 *lpm, const uint32_t *map)
+{
+	for (uint32_t page_idx = 0; page_idx < lpm->page_count; ++page_idx) {
+		lpm64_page_t *page = lpm64_page(lpm, page_idx);
+		for (uint32_t idx = 0; idx < 256; ++idx) {
+			uint32_t value = (*page)[idx];
+			if (value == LPM_VALUE_INVALID ||
+			    !(value & LPM_VALUE_FLAG))
+				continue;
+			(*page)[idx] =
+				map[value & LPM_VALUE_MASK] | LPM_VALUE_FLAG;
 		}
 	}
 }
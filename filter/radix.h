@@ -44,6 +44,16 @@ radix64_init(struct radix64 *radix64)
 	return 0;
 }
 
+static void
+radix64_free(struct radix64 *radix64)
+{
+	for (size_t chunk_idx = 0;
+	     chunk_idx < (radix64->page_count + 15) / 16;
+	     ++chunk_idx)
+		free(radix64->pages[chunk_idx]);
+	free(radix64->pages);
+}
+
 static uint32_t
 radix64_new_page(struct radix64 *radix64, uint32_t *page_idx)
 {
@@ -149,9 +159,9 @@ radix64_iterate(
 		}
 
 		keys[depth]++;
-		if (keys[depth] == 0) {
+		while (keys[depth] == 0) {
 			if (depth == 0)
-				break;
+				return;
 			--depth;
 			keys[depth]++;
 		}
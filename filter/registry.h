@@ -5,92 +5,45 @@
  * Value registry required to map a key into range of unique values.
  * The registry consists of an array of values and key mapping denoting
  * a sub-range of unique values inside the all values array.
+ *
+ * Each range is stored either as a plain array of values or as a dense
+ * bitset depending on which one is smaller. So wide ranges covering most
+ * of classifier values (wide prefixes, any ports) take one bit per value.
  */
 
-#define VALUE_COLLECTOR_CHUNK_SIZE 4096
-
 /*
- * Value collector is a simple array where each item contains inforamation
- * if a value was used while the current generation.
+ * Range of a registry key. If `words` is zero then the range consists of
+ * `count` values starting from `from` index of the registry values.
+ * In the opposite case the range is a bitset of `words` 32-bit words
+ * placed from `from` index where the first word denotes values
+ * [base * 32..base * 32 + 31].
  */
-struct value_collector {
-	uint32_t **use_map;
-	uint32_t chunk_count;
-	uint32_t gen;
-};
-
-static int
-value_collector_init(struct value_collector *collector)
-{
-	// zero-initialized array
-	collector->use_map = (uint32_t **)NULL;
-	collector->chunk_count = 0;
-	collector->gen = 0;
-
-	return 0;
-}
-
-static void
-value_collector_free(struct value_collector *collector)
-{
-	free(collector->use_map);
-}
-
-static void
-value_collector_reset(struct value_collector *collector)
-{
-	collector->gen++;
-}
-
-/*
- * The routine touches a value returnin if the value was seen before while
- * the current generation.
- */
-static int
-value_collector_collect(struct value_collector *collector, uint32_t value)
-{
-	uint32_t chunk_idx = value / VALUE_COLLECTOR_CHUNK_SIZE;
-	if (chunk_idx >= collector->chunk_count) {
-		uint32_t **use_map = (uint32_t **)realloc(
-			collector->use_map,
-			sizeof(uint32_t **) * (chunk_idx + 1));
-		if (use_map == NULL)
-			return -1;
-		memset(
-			use_map + collector->chunk_count,
-			0,
-			sizeof(uint32_t *) *
-			(chunk_idx + 1 - collector->chunk_count));
-		collector->use_map = use_map;
-		collector->chunk_count = chunk_idx + 1;
-	}
-
-	if (collector->use_map[chunk_idx] == NULL) {
-		collector->use_map[chunk_idx] = (uint32_t *)
-			calloc(VALUE_COLLECTOR_CHUNK_SIZE, sizeof(uint32_t));
-		if (collector->use_map[chunk_idx] == NULL)
-			return -1;
-	}
-
-	uint32_t value_idx = value % VALUE_COLLECTOR_CHUNK_SIZE;
-
-	if (collector->use_map[chunk_idx][value_idx] == collector->gen)
-		return 0;
-	collector->use_map[chunk_idx][value_idx] = collector->gen;
-	return 1;
-}
-
 struct value_range {
 	uint32_t from;
 	uint32_t count;
+	uint32_t base;
+	uint32_t words;
 };
 
+/*
+ * The registry collects values of the last range into a bitset so
+ * collecting a value costs one bit test and the range is flushed into
+ * values array when the next one starts.
+ */
 struct value_registry {
-	struct value_collector collector;
+	uint32_t *bits;
+	uint32_t bit_word_count;
+	uint32_t bit_word_min;
+	uint32_t bit_word_max;
+
+	// Decoded values of a bitset range
+	uint32_t *scratch;
+	uint32_t scratch_size;
 
 	uint32_t *values;
 	struct value_range *ranges;
 	uint32_t value_count;
+	uint32_t value_capacity;
 	uint32_t range_count;
 
 	uint32_t max_value;
@@ -99,11 +52,17 @@ struct value_registry {
 static int
 value_registry_init(struct value_registry *registry)
 {
-	if (value_collector_init(&registry->collector))
-		return -1;
+	registry->bits = NULL;
+	registry->bit_word_count = 0;
+	registry->bit_word_min = (uint32_t)-1;
+	registry->bit_word_max = 0;
+
+	registry->scratch = NULL;
+	registry->scratch_size = 0;
 
 	registry->values = NULL;
 	registry->value_count = 0;
+	registry->value_capacity = 0;
 	registry->ranges = NULL;
 	registry->range_count = 0;
 
@@ -111,13 +70,77 @@ value_registry_init(struct value_registry *registry)
 	return 0;
 }
 
+static int
+value_registry_reserve(struct value_registry *registry, uint32_t count)
+{
+	if (registry->value_count + count <= registry->value_capacity)
+		return 0;
+
+	uint32_t capacity = registry->value_capacity * 2;
+	if (capacity < registry->value_count + count)
+		capacity = registry->value_count + count;
+
+	uint32_t *new_values = (uint32_t *)
+		realloc(registry->values, sizeof(uint32_t) * capacity);
+	if (new_values == NULL)
+		return -1;
+	registry->values = new_values;
+	registry->value_capacity = capacity;
+	return 0;
+}
+
+/*
+ * The routine moves values collected into bitset into the last range
+ * choosing the smallest representation and clears the bitset.
+ */
+static int
+value_registry_flush(struct value_registry *registry)
+{
+	if (registry->bit_word_min > registry->bit_word_max)
+		return 0;
+
+	struct value_range *range = registry->ranges + registry->range_count - 1;
+	uint32_t *bits = registry->bits + registry->bit_word_min;
+	uint32_t span = registry->bit_word_max - registry->bit_word_min + 1;
+
+	if (span < range->count) {
+		if (value_registry_reserve(registry, span))
+			return -1;
+		memcpy(registry->values + registry->value_count,
+		       bits,
+		       sizeof(uint32_t) * span);
+		range->base = registry->bit_word_min;
+		range->words = span;
+		registry->value_count += span;
+	} else {
+		if (value_registry_reserve(registry, range->count))
+			return -1;
+		uint32_t *values = registry->values + registry->value_count;
+		for (uint32_t idx = 0; idx < span; ++idx) {
+			uint32_t word = bits[idx];
+			while (word) {
+				*values++ = (registry->bit_word_min + idx) * 32 +
+					    __builtin_ctz(word);
+				word &= word - 1;
+			}
+		}
+		registry->value_count += range->count;
+	}
+
+	memset(bits, 0, sizeof(uint32_t) * span);
+	registry->bit_word_min = (uint32_t)-1;
+	registry->bit_word_max = 0;
+	return 0;
+}
+
 /*
  * the routine start a new registry generation creating new key mapping range.
  */
 static int
 value_registry_start(struct value_registry *registry)
 {
-	value_collector_reset(&registry->collector);
+	if (value_registry_flush(registry))
+		return -1;
 
 	if (!(registry->range_count & (registry->range_count + 1))) {
 		struct value_range *new_ranges = (struct value_range *)
@@ -132,31 +155,60 @@ value_registry_start(struct value_registry *registry)
 	}
 
 	registry->ranges[registry->range_count++] =
-		(struct value_range){registry->value_count, 0};
+		(struct value_range){registry->value_count, 0, 0, 0};
+
+	return 0;
+}
 
+/*
+ * The routine finishes the last range and should be called before
+ * any registry range is read.
+ */
+static inline int
+value_registry_finish(struct value_registry *registry)
+{
+	return value_registry_flush(registry);
+}
+
+static int
+value_registry_grow_bits(struct value_registry *registry, uint32_t word)
+{
+	uint32_t count = registry->bit_word_count * 2;
+	if (count <= word)
+		count = word + 1;
+
+	uint32_t *bits = (uint32_t *)
+		realloc(registry->bits, sizeof(uint32_t) * count);
+	if (bits == NULL)
+		return -1;
+	memset(bits + registry->bit_word_count,
+	       0,
+	       sizeof(uint32_t) * (count - registry->bit_word_count));
+	registry->bits = bits;
+	registry->bit_word_count = count;
 	return 0;
 }
 
 static int
 value_registry_collect(struct value_registry *registry, uint32_t value)
 {
-	if (!(registry->value_count & (registry->value_count + 1))) {
-		uint32_t *new_values = (uint32_t *)
-			realloc(
-				registry->values,
-				sizeof(uint32_t) *
-				(registry->value_count + 1) * 2);
-		if (new_values == NULL)
-			return -1;
-		registry->values = new_values;
-	}
+	uint32_t word = value / 32;
+	if (word >= registry->bit_word_count &&
+	    value_registry_grow_bits(registry, word))
+		return -1;
 
-	if (value_collector_collect(&registry->collector, value)) {
-		registry->values[registry->value_count++] = value;
-		registry->ranges[registry->range_count - 1].count++;
-		if (value >= registry->max_value)
-			registry->max_value = value;
-	}
+	uint32_t bit = (uint32_t)1 << (value % 32);
+	if (registry->bits[word] & bit)
+		return 0;
+
+	registry->bits[word] |= bit;
+	registry->ranges[registry->range_count - 1].count++;
+	if (word < registry->bit_word_min)
+		registry->bit_word_min = word;
+	if (word > registry->bit_word_max)
+		registry->bit_word_max = word;
+	if (value >= registry->max_value)
+		registry->max_value = value;
 
 	return 0;
 }
@@ -164,17 +216,124 @@ value_registry_collect(struct value_registry *registry, uint32_t value)
 static inline void
 value_registry_free(struct value_registry *registry)
 {
-	value_collector_free(&registry->collector);
+	free(registry->bits);
+	free(registry->scratch);
 	free(registry->ranges);
 	free(registry->values);
 }
 
+static inline uint64_t
+value_registry_size(const struct value_registry *registry)
+{
+	return ((uint64_t)registry->value_capacity + registry->bit_word_count +
+		registry->scratch_size) * sizeof(uint32_t) +
+	       (uint64_t)registry->range_count * sizeof(struct value_range);
+}
+
 static inline uint32_t
 value_registry_capacity(struct value_registry *registry)
 {
 	return registry->max_value + 1;
 }
 
+static inline const uint32_t *
+value_registry_decode(
+	struct value_registry *registry,
+	const uint32_t *words,
+	uint32_t base,
+	uint32_t word_count,
+	uint32_t count)
+{
+	if (registry->scratch_size < count) {
+		uint32_t *scratch = (uint32_t *)
+			realloc(registry->scratch, sizeof(uint32_t) * count);
+		if (scratch == NULL)
+			return NULL;
+		registry->scratch = scratch;
+		registry->scratch_size = count;
+	}
+
+	uint32_t *values = registry->scratch;
+	for (uint32_t idx = 0; idx < word_count; ++idx) {
+		uint32_t word = words[idx];
+		while (word) {
+			*values++ = (base + idx) * 32 + __builtin_ctz(word);
+			word &= word - 1;
+		}
+	}
+	return registry->scratch;
+}
+
+/*
+ * The routine returns range values as a plain array. Bitset ranges and
+ * the last range being collected are decoded into the registry scratch
+ * array valid until the next call.
+ */
+static inline const uint32_t *
+value_registry_range_values(
+	struct value_registry *registry,
+	uint32_t range_idx)
+{
+	struct value_range *range = registry->ranges + range_idx;
+
+	if (range_idx == registry->range_count - 1 &&
+	    registry->bit_word_min <= registry->bit_word_max) {
+		return value_registry_decode(
+			registry,
+			registry->bits + registry->bit_word_min,
+			registry->bit_word_min,
+			registry->bit_word_max - registry->bit_word_min + 1,
+			range->count);
+	}
+
+	if (!range->words)
+		return registry->values + range->from;
+
+	return value_registry_decode(
+		registry,
+		registry->values + range->from,
+		range->base,
+		range->words,
+		range->count);
+}
+
+/*
+ * View of a range as either a plain array of values or bitset words, so
+ * ranges are walked without decoding bitsets into the scratch array.
+ */
+struct value_range_view {
+	const uint32_t *data;
+	// Count of values or of bitset words
+	uint32_t count;
+	// First bitset word index, zero for plain ranges
+	uint32_t base;
+	bool bitset;
+};
+
+static inline void
+value_registry_range_view(
+	const struct value_registry *registry,
+	uint32_t range_idx,
+	struct value_range_view *view)
+{
+	const struct value_range *range = registry->ranges + range_idx;
+
+	if (range_idx == registry->range_count - 1 &&
+	    registry->bit_word_min <= registry->bit_word_max) {
+		view->data = registry->bits + registry->bit_word_min;
+		view->count =
+			registry->bit_word_max - registry->bit_word_min + 1;
+		view->base = registry->bit_word_min;
+		view->bitset = true;
+		return;
+	}
+
+	view->data = registry->values + range->from;
+	view->count = range->words ? range->words : range->count;
+	view->base = range->base;
+	view->bitset = range->words != 0;
+}
+
 /*
  * Registry join callback called for each value pair combined from
  * two registry values.
@@ -186,8 +345,45 @@ typedef int (*value_registry_join_func)(
 	void *data
 );
 
+/*
+ * The routine joins the value with each value of the view. Bitset words
+ * are walked with ctz skipping zero words.
+ */
+static inline int
+value_registry_join_value(
+	uint32_t first,
+	const struct value_range_view *view,
+	uint32_t range_idx,
+	value_registry_join_func join_func,
+	void *join_func_data)
+{
+	if (!view->bitset) {
+		for (uint32_t idx = 0; idx < view->count; ++idx) {
+			if (join_func(first, view->data[idx], range_idx,
+				      join_func_data) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	for (uint32_t idx = 0; idx < view->count; ++idx) {
+		uint32_t word = view->data[idx];
+		while (word) {
+			uint32_t second =
+				(view->base + idx) * 32 + __builtin_ctz(word);
+			if (join_func(first, second, range_idx,
+				      join_func_data) < 0)
+				return -1;
+			word &= word - 1;
+		}
+	}
+	return 0;
+}
+
 /*
  * Merges two value registry iteration through registry keys and its values.
+ * Callers touch a table cell per pair so each pair is still emitted, while
+ * bitset ranges of both registries are walked word by word in place.
  * NOTE: both registry keys should be exact the same.
  */
 static inline int
@@ -198,22 +394,148 @@ value_registry_join_range(
 	value_registry_join_func join_func,
 	void *join_func_data)
 {
-	struct value_range *range1 = registry1->ranges + range_idx;
-	struct value_range *range2 = registry2->ranges + range_idx;
-	for (uint32_t idx1 = range1->from;
-	     idx1 < range1->from + range1->count;
-	     ++idx1) {
-		for (uint32_t idx2 = range2->from;
-		     idx2 < range2->from + range2->count;
-		     ++idx2) {
+	if (!registry1->ranges[range_idx].count ||
+	    !registry2->ranges[range_idx].count)
+		return 0;
+
+	struct value_range_view view1;
+	struct value_range_view view2;
+	value_registry_range_view(registry1, range_idx, &view1);
+	value_registry_range_view(registry2, range_idx, &view2);
+
+	if (!view1.bitset) {
+		for (uint32_t idx = 0; idx < view1.count; ++idx) {
+			if (value_registry_join_value(
+				view1.data[idx], &view2, range_idx,
+				join_func, join_func_data))
+				return -1;
+		}
+		return 0;
+	}
 
-			uint32_t v1 = registry1->values[idx1];
-			uint32_t v2 = registry2->values[idx2];
+	for (uint32_t idx = 0; idx < view1.count; ++idx) {
+		uint32_t word = view1.data[idx];
+		while (word) {
+			uint32_t first =
+				(view1.base + idx) * 32 + __builtin_ctz(word);
+			if (value_registry_join_value(
+				first, &view2, range_idx,
+				join_func, join_func_data))
+				return -1;
+			word &= word - 1;
+		}
+	}
+	return 0;
+}
 
-			join_func(v1, v2, range_idx, join_func_data);
+/*
+ * The routine joins the value with values of the bitset words skipping
+ * pairs set in the mask row. Pairs the callback returns a positive result
+ * for are set in the mask row, so the words are combined with the row
+ * word-wise and only open pairs reach the callback.
+ */
+static inline int
+value_registry_join_row(
+	uint32_t first,
+	uint32_t *row,
+	const uint32_t *words,
+	uint32_t base,
+	uint32_t word_count,
+	uint32_t range_idx,
+	value_registry_join_func join_func,
+	void *join_func_data)
+{
+	for (uint32_t idx = 0; idx < word_count; ++idx) {
+		uint32_t word = words[idx] & ~row[base + idx];
+		while (word) {
+			uint32_t bit = __builtin_ctz(word);
+			int res = join_func(first, (base + idx) * 32 + bit,
+					    range_idx, join_func_data);
+			if (res < 0)
+				return -1;
+			if (res > 0)
+				row[base + idx] |= (uint32_t)1 << bit;
+			word &= word - 1;
 		}
 	}
 	return 0;
 }
 
+/*
+ * The routine joins the range as value_registry_join_range does while
+ * pairs set in the mask are skipped. The mask has a row of mask_stride
+ * words for each value of the first registry and a pair is set once the
+ * callback returns a positive result for it, so later ranges never visit
+ * the pair again. Plain ranges of the second registry are spread into the
+ * scratch bitset of mask_stride zeroed words which is zeroed back.
+ */
+static inline int
+value_registry_join_range_masked(
+	struct value_registry *registry1,
+	struct value_registry *registry2,
+	uint32_t range_idx,
+	uint32_t *mask,
+	uint32_t mask_stride,
+	uint32_t *scratch,
+	value_registry_join_func join_func,
+	void *join_func_data)
+{
+	if (!registry1->ranges[range_idx].count ||
+	    !registry2->ranges[range_idx].count)
+		return 0;
+
+	struct value_range_view view1;
+	struct value_range_view view2;
+	value_registry_range_view(registry1, range_idx, &view1);
+	value_registry_range_view(registry2, range_idx, &view2);
+
+	const uint32_t *words = view2.data;
+	uint32_t base = view2.base;
+	uint32_t word_count = view2.count;
+	if (!view2.bitset) {
+		uint32_t min = (uint32_t)-1;
+		uint32_t max = 0;
+		for (uint32_t idx = 0; idx < view2.count; ++idx) {
+			uint32_t word = view2.data[idx] / 32;
+			scratch[word] |= (uint32_t)1 << (view2.data[idx] % 32);
+			if (word < min)
+				min = word;
+			if (word > max)
+				max = word;
+		}
+		words = scratch + min;
+		base = min;
+		word_count = max - min + 1;
+	}
+
+	int res = 0;
+	if (!view1.bitset) {
+		for (uint32_t idx = 0; idx < view1.count && !res; ++idx) {
+			uint32_t first = view1.data[idx];
+			res = value_registry_join_row(
+				first, mask + (uint64_t)first * mask_stride,
+				words, base, word_count, range_idx,
+				join_func, join_func_data);
+		}
+	} else {
+		for (uint32_t idx = 0; idx < view1.count && !res; ++idx) {
+			uint32_t word = view1.data[idx];
+			while (word && !res) {
+				uint32_t first = (view1.base + idx) * 32 +
+						 __builtin_ctz(word);
+				res = value_registry_join_row(
+					first,
+					mask + (uint64_t)first * mask_stride,
+					words, base, word_count, range_idx,
+					join_func, join_func_data);
+				word &= word - 1;
+			}
+		}
+	}
+
+	if (!view2.bitset)
+		memset(scratch + base, 0, sizeof(uint32_t) * word_count);
+	return res;
+}
+
 #endif
@@ -75,10 +75,13 @@ static void
 remap_table_free(struct remap_table *table)
 {
 	for (uint32_t chunk_idx = 0;
-	     chunk_idx < table->count / REMAP_TABLE_CHUNK_SIZE;
+	     chunk_idx < (table->count + REMAP_TABLE_CHUNK_SIZE - 1) /
+			 REMAP_TABLE_CHUNK_SIZE;
 	     ++chunk_idx)
 		free(table->keys[chunk_idx]);
 	free(table->keys);
+	table->keys = NULL;
+	table->count = 0;
 }
 
 static inline void
@@ -119,6 +122,7 @@ remap_table_new_key(struct remap_table *table, uint32_t *key)
 				sizeof(struct remap_item *) * new_chunk_count);
 		if (keys == NULL)
 			return -1;
+		table->keys = keys;
 		table->keys[new_chunk_count - 1] =
 			(struct remap_item *)malloc(
 				sizeof(struct remap_item) *
@@ -146,6 +150,12 @@ remap_table_touch(struct remap_table *table, uint32_t key, uint32_t *value)
 			return -1;
 		item->gen = table->gen;
 		item->value = new_key;
+		/*
+		 * The new key maps into itself while the generation so one
+		 * may touch the same value twice without splitting it again.
+		 */
+		*remap_table_item(table, new_key) =
+			(struct remap_item){0, table->gen, new_key, 0};
 		res = 1;
 	}
 
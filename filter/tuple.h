@@ -0,0 +1,261 @@
+#ifndef FILTER_TUPLE_H
+#define FILTER_TUPLE_H
+
+/*
+ * Tuple space maps a packet key into the first matching rule. Each rule is
+ * expanded into entries of masked key fields and entries sharing the same
+ * field masks form a tuple keeping entries inside a hash table. So a lookup
+ * costs one hash probe per tuple.
+ *
+ * Tuples are ordered by the least rule index of its entries and the lookup
+ * stops as soon as no tuple may contain a rule preceding the found one.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TUPLE_FIELD_COUNT 6
+#define TUPLE_RULE_INVALID 0xffffffff
+
+/*
+ * Key fields are compared as is so the caller is responsible to encode
+ * packet values the same way as rule values and masks.
+ */
+struct tuple_key {
+	uint64_t fields[TUPLE_FIELD_COUNT];
+};
+
+struct tuple_entry {
+	struct tuple_key key;
+	uint32_t rule;
+};
+
+struct tuple {
+	struct tuple_key masks;
+	uint32_t min_rule;
+
+	struct tuple_entry *entries;
+	uint32_t entry_count;
+	uint32_t bucket_count;
+};
+
+struct tuple_space {
+	struct tuple *tuples;
+	uint32_t tuple_count;
+	uint32_t tuple_capacity;
+};
+
+static inline void
+tuple_space_init(struct tuple_space *space)
+{
+	space->tuples = NULL;
+	space->tuple_count = 0;
+	space->tuple_capacity = 0;
+}
+
+static inline void
+tuple_space_free(struct tuple_space *space)
+{
+	for (uint32_t idx = 0; idx < space->tuple_count; ++idx)
+		free(space->tuples[idx].entries);
+	free(space->tuples);
+}
+
+static inline uint32_t
+tuple_bucket(const struct tuple *tuple, const struct tuple_key *key)
+{
+	uint64_t hash = 0;
+	for (uint32_t idx = 0; idx < TUPLE_FIELD_COUNT; ++idx) {
+		hash ^= key->fields[idx];
+		hash *= 0x9e3779b97f4a7c15;
+		hash ^= hash >> 29;
+	}
+	return (hash >> 32) & (tuple->bucket_count - 1);
+}
+
+static inline int
+tuple_key_equal(const struct tuple_key *key1, const struct tuple_key *key2)
+{
+	return !memcmp(key1, key2, sizeof(struct tuple_key));
+}
+
+/*
+ * The routine returns entry of the masked key or the empty entry where
+ * the key should be placed.
+ */
+static inline struct tuple_entry *
+tuple_find(const struct tuple *tuple, const struct tuple_key *key)
+{
+	uint32_t bucket = tuple_bucket(tuple, key);
+	while (tuple->entries[bucket].rule != TUPLE_RULE_INVALID) {
+		if (tuple_key_equal(&tuple->entries[bucket].key, key))
+			break;
+		bucket = (bucket + 1) & (tuple->bucket_count - 1);
+	}
+	return tuple->entries + bucket;
+}
+
+static inline int
+tuple_init(struct tuple *tuple, const struct tuple_key *masks)
+{
+	tuple->masks = *masks;
+	tuple->min_rule = TUPLE_RULE_INVALID;
+	tuple->entry_count = 0;
+	tuple->bucket_count = 16;
+	tuple->entries = (struct tuple_entry *)
+		malloc(sizeof(struct tuple_entry) * tuple->bucket_count);
+	if (tuple->entries == NULL)
+		return -1;
+	for (uint32_t idx = 0; idx < tuple->bucket_count; ++idx)
+		tuple->entries[idx].rule = TUPLE_RULE_INVALID;
+	return 0;
+}
+
+static inline int
+tuple_grow(struct tuple *tuple)
+{
+	struct tuple_entry *entries = tuple->entries;
+	uint32_t bucket_count = tuple->bucket_count;
+
+	tuple->bucket_count *= 2;
+	tuple->entries = (struct tuple_entry *)
+		malloc(sizeof(struct tuple_entry) * tuple->bucket_count);
+	if (tuple->entries == NULL) {
+		tuple->entries = entries;
+		tuple->bucket_count = bucket_count;
+		return -1;
+	}
+	for (uint32_t idx = 0; idx < tuple->bucket_count; ++idx)
+		tuple->entries[idx].rule = TUPLE_RULE_INVALID;
+
+	for (uint32_t idx = 0; idx < bucket_count; ++idx) {
+		if (entries[idx].rule != TUPLE_RULE_INVALID)
+			*tuple_find(tuple, &entries[idx].key) = entries[idx];
+	}
+	free(entries);
+	return 0;
+}
+
+static inline struct tuple *
+tuple_space_get(struct tuple_space *space, const struct tuple_key *masks)
+{
+	for (uint32_t idx = 0; idx < space->tuple_count; ++idx) {
+		if (tuple_key_equal(&space->tuples[idx].masks, masks))
+			return space->tuples + idx;
+	}
+
+	if (space->tuple_count == space->tuple_capacity) {
+		uint32_t capacity =
+			space->tuple_capacity ? space->tuple_capacity * 2 : 8;
+		struct tuple *tuples = (struct tuple *)
+			realloc(space->tuples, sizeof(struct tuple) * capacity);
+		if (tuples == NULL)
+			return NULL;
+		space->tuples = tuples;
+		space->tuple_capacity = capacity;
+	}
+
+	struct tuple *tuple = space->tuples + space->tuple_count;
+	if (tuple_init(tuple, masks))
+		return NULL;
+	space->tuple_count++;
+	return tuple;
+}
+
+/*
+ * The routine adds the masked key of the rule. Keys already present keep
+ * the preceding rule so rules should be inserted in the rule order.
+ */
+static inline int
+tuple_space_insert(
+	struct tuple_space *space,
+	const struct tuple_key *key,
+	const struct tuple_key *masks,
+	uint32_t rule)
+{
+	struct tuple *tuple = tuple_space_get(space, masks);
+	if (tuple == NULL)
+		return -1;
+
+	if ((tuple->entry_count + 1) * 2 > tuple->bucket_count &&
+	    tuple_grow(tuple))
+		return -1;
+
+	struct tuple_key masked;
+	for (uint32_t idx = 0; idx < TUPLE_FIELD_COUNT; ++idx)
+		masked.fields[idx] = key->fields[idx] & masks->fields[idx];
+
+	struct tuple_entry *entry = tuple_find(tuple, &masked);
+	if (entry->rule != TUPLE_RULE_INVALID)
+		return 0;
+
+	*entry = (struct tuple_entry){masked, rule};
+	tuple->entry_count++;
+	if (rule < tuple->min_rule)
+		tuple->min_rule = rule;
+	return 0;
+}
+
+static int
+tuple_cmp(const void *first, const void *second)
+{
+	const struct tuple *tuple1 = (const struct tuple *)first;
+	const struct tuple *tuple2 = (const struct tuple *)second;
+	if (tuple1->min_rule != tuple2->min_rule)
+		return tuple1->min_rule < tuple2->min_rule ? -1 : 1;
+	return 0;
+}
+
+static inline uint64_t
+tuple_space_size(const struct tuple_space *space)
+{
+	uint64_t size = (uint64_t)space->tuple_capacity * sizeof(struct tuple);
+	for (uint32_t idx = 0; idx < space->tuple_count; ++idx)
+		size += (uint64_t)space->tuples[idx].bucket_count *
+			sizeof(struct tuple_entry);
+	return size;
+}
+
+/*
+ * The routine orders tuples and should be called after all insertions.
+ */
+static inline void
+tuple_space_finish(struct tuple_space *space)
+{
+	qsort(space->tuples,
+	      space->tuple_count,
+	      sizeof(struct tuple),
+	      tuple_cmp);
+}
+
+/*
+ * The routine returns the least rule matching the key and preceding
+ * the limit or TUPLE_RULE_INVALID.
+ */
+static inline uint32_t
+tuple_space_lookup(
+	const struct tuple_space *space,
+	const struct tuple_key *key,
+	uint32_t limit)
+{
+	uint32_t rule = limit;
+	for (uint32_t idx = 0; idx < space->tuple_count; ++idx) {
+		const struct tuple *tuple = space->tuples + idx;
+		if (tuple->min_rule >= rule)
+			break;
+
+		struct tuple_key masked;
+		for (uint32_t field = 0; field < TUPLE_FIELD_COUNT; ++field) {
+			masked.fields[field] =
+				key->fields[field] & tuple->masks.fields[field];
+		}
+
+		const struct tuple_entry *entry = tuple_find(tuple, &masked);
+		if (entry->rule < rule)
+			rule = entry->rule;
+	}
+	return rule == limit ? TUPLE_RULE_INVALID : rule;
+}
+
+#endif
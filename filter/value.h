@@ -8,16 +8,39 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "remap.h"
 
+#define VALUE_TABLE_KEY_EMPTY 0xffffffffffffffff
+
+/*
+ * Value table may be either dense or sparse. Dense table is a plain
+ * h_dim * v_dim array. Sparse table stores only touched cells inside an
+ * open-addressing hash with keys and values arrays of `capacity` slots,
+ * any untouched cell has the default value.
+ */
 struct value_table {
 	struct remap_table remap_table;
 	uint32_t h_dim;
 	uint32_t v_dim;
 	uint32_t *values;
+
+	uint64_t *keys;
+	uint32_t capacity;
+	uint32_t count;
+	uint32_t default_value;
 };
 
+static inline uint32_t
+value_table_cell_count(uint32_t h_dim, uint32_t v_dim)
+{
+	uint64_t count = (uint64_t)h_dim * v_dim;
+	if (count > 0xffffffff)
+		return 0xffffffff;
+	return count;
+}
+
 static inline int
 value_table_init(
 	struct value_table *value_table,
@@ -38,14 +61,75 @@ value_table_init(
 	value_table->h_dim = h_dim;
 	value_table->v_dim = v_dim;
 
+	value_table->keys = NULL;
+	value_table->capacity = 0;
+	value_table->count = 0;
+	value_table->default_value = 0;
+
+	return 0;
+}
+
+static inline int
+value_table_init_sparse(
+	struct value_table *value_table,
+	uint32_t h_dim,
+	uint32_t v_dim)
+{
+	if (remap_table_init(
+		&value_table->remap_table,
+		value_table_cell_count(h_dim, v_dim))) {
+		return -1;
+	}
+
+	value_table->capacity = 64;
+	value_table->keys = (uint64_t *)
+		malloc(sizeof(uint64_t) * value_table->capacity);
+	value_table->values = (uint32_t *)
+		malloc(sizeof(uint32_t) * value_table->capacity);
+	if (value_table->keys == NULL || value_table->values == NULL) {
+		free(value_table->values);
+		free(value_table->keys);
+		remap_table_free(&value_table->remap_table);
+		return -1;
+	}
+	memset(value_table->keys,
+	       0xff,
+	       sizeof(uint64_t) * value_table->capacity);
+
+	value_table->h_dim = h_dim;
+	value_table->v_dim = v_dim;
+	value_table->count = 0;
+	value_table->default_value = 0;
+
 	return 0;
 }
 
+static inline int
+value_table_is_sparse(const struct value_table *value_table)
+{
+	return value_table->keys != NULL;
+}
+
 static inline void
 value_table_free(struct value_table *value_table)
 {
 	remap_table_free(&value_table->remap_table);
 	free(value_table->values);
+	free(value_table->keys);
+}
+
+/*
+ * The routine returns bytes taken by cells of the table, the remap table
+ * is not counted.
+ */
+static inline uint64_t
+value_table_size(const struct value_table *value_table)
+{
+	if (value_table_is_sparse(value_table))
+		return (uint64_t)value_table->capacity *
+		       (sizeof(uint64_t) + sizeof(uint32_t));
+	return (uint64_t)value_table->h_dim * value_table->v_dim *
+	       sizeof(uint32_t);
 }
 
 static inline void
@@ -54,10 +138,106 @@ value_table_new_gen(struct value_table *value_table)
 	remap_table_new_gen(&value_table->remap_table);
 }
 
+static inline uint64_t
+value_table_key(uint32_t h_idx, uint32_t v_idx)
+{
+	return ((uint64_t)v_idx << 32) | h_idx;
+}
+
+static inline uint32_t
+value_table_slot(const struct value_table *value_table, uint64_t key)
+{
+	uint64_t hash = key * 0x9e3779b97f4a7c15;
+	return (hash ^ (hash >> 32)) & (value_table->capacity - 1);
+}
+
+/*
+ * The routine returns sparse table slot containing the key or the first
+ * empty slot where the key should be placed.
+ */
+static inline uint32_t
+value_table_find(const struct value_table *value_table, uint64_t key)
+{
+	uint32_t slot = value_table_slot(value_table, key);
+	while (value_table->keys[slot] != key &&
+	       value_table->keys[slot] != VALUE_TABLE_KEY_EMPTY)
+		slot = (slot + 1) & (value_table->capacity - 1);
+	return slot;
+}
+
+static inline int
+value_table_grow(struct value_table *value_table)
+{
+	uint32_t capacity = value_table->capacity;
+	uint64_t *keys = value_table->keys;
+	uint32_t *values = value_table->values;
+
+	value_table->keys = (uint64_t *)
+		malloc(sizeof(uint64_t) * capacity * 2);
+	value_table->values = (uint32_t *)
+		malloc(sizeof(uint32_t) * capacity * 2);
+	if (value_table->keys == NULL || value_table->values == NULL) {
+		free(value_table->values);
+		free(value_table->keys);
+		value_table->keys = keys;
+		value_table->values = values;
+		return -1;
+	}
+	memset(value_table->keys, 0xff, sizeof(uint64_t) * capacity * 2);
+	value_table->capacity = capacity * 2;
+
+	for (uint32_t idx = 0; idx < capacity; ++idx) {
+		if (keys[idx] == VALUE_TABLE_KEY_EMPTY)
+			continue;
+		uint32_t slot = value_table_find(value_table, keys[idx]);
+		value_table->keys[slot] = keys[idx];
+		value_table->values[slot] = values[idx];
+	}
+
+	free(values);
+	free(keys);
+	return 0;
+}
+
+/*
+ * The routine returns pointer to the cell value inserting the cell with
+ * the default value into sparse table if required.
+ */
+static inline uint32_t *
+value_table_cell(
+	struct value_table *value_table,
+	uint32_t h_idx,
+	uint32_t v_idx)
+{
+	if (!value_table_is_sparse(value_table))
+		return value_table->values +
+		       (v_idx * value_table->h_dim) + h_idx;
+
+	if ((value_table->count + 1) * 2 > value_table->capacity &&
+	    value_table_grow(value_table))
+		return NULL;
+
+	uint64_t key = value_table_key(h_idx, v_idx);
+	uint32_t slot = value_table_find(value_table, key);
+	if (value_table->keys[slot] == VALUE_TABLE_KEY_EMPTY) {
+		value_table->keys[slot] = key;
+		value_table->values[slot] = value_table->default_value;
+		value_table->count++;
+	}
+	return value_table->values + slot;
+}
+
 static inline uint32_t
 value_table_get(struct value_table *value_table, uint32_t h_idx, uint32_t v_idx)
 {
-	return value_table->values[(v_idx * value_table->h_dim) + h_idx];
+	if (!value_table_is_sparse(value_table))
+		return value_table->values[(v_idx * value_table->h_dim) + h_idx];
+
+	uint32_t slot = value_table_find(
+		value_table, value_table_key(h_idx, v_idx));
+	if (value_table->keys[slot] == VALUE_TABLE_KEY_EMPTY)
+		return value_table->default_value;
+	return value_table->values[slot];
 }
 
 typedef int (*value_table_touch_func)(
@@ -71,24 +251,215 @@ value_table_touch(
 	uint32_t h_idx,
 	uint32_t v_idx)
 {
-	uint32_t *value = value_table->values +
-			  (v_idx * value_table->h_dim) + h_idx;
+	uint32_t *value = value_table_cell(value_table, h_idx, v_idx);
+	if (value == NULL)
+		return -1;
 	return remap_table_touch(&value_table->remap_table, *value, value);
 }
 
+/*
+ * Number of value slots, either cells of dense table or hash slots of
+ * sparse one.
+ */
+static inline uint32_t
+value_table_slot_count(const struct value_table *value_table)
+{
+	if (value_table_is_sparse(value_table))
+		return value_table->capacity;
+	return value_table->h_dim * value_table->v_dim;
+}
+
+static inline int
+value_table_slot_used(const struct value_table *value_table, uint32_t slot)
+{
+	return !value_table_is_sparse(value_table) ||
+	       value_table->keys[slot] != VALUE_TABLE_KEY_EMPTY;
+}
+
 static inline void
 value_table_compact(struct value_table *value_table)
 {
 	remap_table_compact(&value_table->remap_table);
 
 	for (uint32_t vidx = 0;
-	     vidx < value_table->h_dim * value_table->v_dim;
+	     vidx < value_table_slot_count(value_table);
 	     ++vidx) {
+		if (!value_table_slot_used(value_table, vidx))
+			continue;
 		value_table->values[vidx] =
 			remap_table_compacted(
 				&value_table->remap_table,
 				value_table->values[vidx]);
 	}
+
+	value_table->default_value = remap_table_compacted(
+		&value_table->remap_table,
+		value_table->default_value);
+
+	// Touching is not legal any more so the remap table is useless
+	remap_table_free(&value_table->remap_table);
+}
+
+/*
+ * Line hash used to find equal rows or columns of a value table.
+ * A line is a sequence of `len` values starting at `start` with `step`
+ * distance between neighbour items.
+ */
+static inline uint64_t
+value_table_line_hash(const uint32_t *start, uint32_t len, uint32_t step)
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	for (uint32_t idx = 0; idx < len; ++idx) {
+		hash ^= start[idx * step];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+static inline int
+value_table_line_equal(
+	const uint32_t *first,
+	const uint32_t *second,
+	uint32_t len,
+	uint32_t step)
+{
+	for (uint32_t idx = 0; idx < len; ++idx) {
+		if (first[idx * step] != second[idx * step])
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * The routine assigns equivalence class to each of `count` lines so equal
+ * lines share the same class. Classes are numbered from zero without gaps
+ * in order of the first line occurence.
+ * Returns count of classes or -1 in case of error.
+ */
+static inline int64_t
+value_table_line_classes(
+	const uint32_t *values,
+	uint32_t count,
+	uint32_t line_step,
+	uint32_t len,
+	uint32_t step,
+	uint32_t *classes)
+{
+	uint32_t bucket_count = 1;
+	while (bucket_count < count * 2)
+		bucket_count <<= 1;
+
+	// Each bucket contains line index representing a class
+	uint32_t *buckets = (uint32_t *)malloc(sizeof(uint32_t) * bucket_count);
+	if (buckets == NULL)
+		return -1;
+	memset(buckets, 0xff, sizeof(uint32_t) * bucket_count);
+
+	uint32_t class_count = 0;
+	for (uint32_t idx = 0; idx < count; ++idx) {
+		const uint32_t *line = values + idx * line_step;
+		uint32_t bucket = value_table_line_hash(line, len, step) &
+				  (bucket_count - 1);
+		while (buckets[bucket] != (uint32_t)-1) {
+			const uint32_t *known =
+				values + buckets[bucket] * line_step;
+			if (value_table_line_equal(line, known, len, step))
+				break;
+			bucket = (bucket + 1) & (bucket_count - 1);
+		}
+
+		if (buckets[bucket] == (uint32_t)-1) {
+			buckets[bucket] = idx;
+			classes[idx] = class_count++;
+		} else {
+			classes[idx] = classes[buckets[bucket]];
+		}
+	}
+
+	free(buckets);
+	return class_count;
+}
+
+/*
+ * Merges equal rows and columns of a compacted value table. Horizontal and
+ * vertical indices are rewritten into equivalence class identifiers stored
+ * in h_map and v_map which should be h_dim and v_dim sized. After the
+ * routine returns the table dimensions are class counts and one must
+ * remap producers of table keys using the maps. Sparse tables are not
+ * merged and get identity maps.
+ *
+ * NOTE: Touching keys is not legal after the merge.
+ */
+static inline int
+value_table_merge_classes(
+	struct value_table *value_table,
+	uint32_t *h_map,
+	uint32_t *v_map)
+{
+	uint32_t h_dim = value_table->h_dim;
+	uint32_t v_dim = value_table->v_dim;
+
+	if (value_table_is_sparse(value_table)) {
+		// Sparse tables are kept as is with identity class mapping
+		for (uint32_t h_idx = 0; h_idx < h_dim; ++h_idx)
+			h_map[h_idx] = h_idx;
+		for (uint32_t v_idx = 0; v_idx < v_dim; ++v_idx)
+			v_map[v_idx] = v_idx;
+		return 0;
+	}
+
+	// Column h consists of values[v * h_dim + h] items
+	int64_t h_count = value_table_line_classes(
+		value_table->values, h_dim, 1, v_dim, h_dim, h_map);
+	if (h_count < 0)
+		return -1;
+
+	// Row v consists of values[v * h_dim + h] items
+	int64_t v_count = value_table_line_classes(
+		value_table->values, v_dim, h_dim, h_dim, 1, v_map);
+	if (v_count < 0)
+		return -1;
+
+	if (h_count == h_dim && v_count == v_dim)
+		return 0;
+
+	uint32_t *values = (uint32_t *)
+		malloc(sizeof(uint32_t) * h_count * v_count);
+	if (values == NULL)
+		return -1;
+
+	for (uint32_t v_idx = 0; v_idx < v_dim; ++v_idx) {
+		for (uint32_t h_idx = 0; h_idx < h_dim; ++h_idx) {
+			values[v_map[v_idx] * h_count + h_map[h_idx]] =
+				value_table->values[v_idx * h_dim + h_idx];
+		}
+	}
+
+	free(value_table->values);
+	value_table->values = values;
+	value_table->h_dim = h_count;
+	value_table->v_dim = v_count;
+
+	return 0;
+}
+
+/*
+ * The routine rewrites each table value using the map. Used to apply class
+ * merge of a consumer table to the table producing its keys.
+ */
+static inline void
+value_table_remap(struct value_table *value_table, const uint32_t *map)
+{
+	for (uint32_t vidx = 0;
+	     vidx < value_table_slot_count(value_table);
+	     ++vidx) {
+		if (!value_table_slot_used(value_table, vidx))
+			continue;
+		value_table->values[vidx] = map[value_table->values[vidx]];
+	}
+
+	if (value_table->default_value != REMAP_TABLE_INVALID)
+		value_table->default_value = map[value_table->default_value];
 }
 
 #endif